@@ -1,5 +1,7 @@
 #define _GNU_SOURCE /* For asprintf() */
 #include <string.h>
+#include <strings.h> // for strncasecmp
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
@@ -8,19 +10,61 @@
 #include <sys/socket.h>
 #include <sys/resource.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <ctype.h> // for tolower
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2/SSSE3 intrinsics for url_decode_span_ssse3()
+#endif
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <limits.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include <time.h>
+
+#include "../mime_types.h" // generated from tools/mime.types
+#include "../bundle_format.h"
 
 #define SERVER_STRING                   "Server: nitishhttpd/0.1\r\n"
+#define MIME_TYPES_FILE                 "mime.types"
+#define MIME_DEFAULT_HEADER             "Content-Type: application/octet-stream\r\n"
+#define RESPONSE_HEADERS_MAX_SIZE       1024
+#define RANGE_MAX_RANGES                8
+#define SENDFILE_CHUNK_SIZE             (512 * 1024)
+#define PRECOMPRESS_DIR                 "public"
+#define PRECOMPRESS_MIN_SIZE            256
+#define PUBLIC_BUNDLE                   "public.bundle"
+#define COMPRESSION_LEVEL_IDLE          6
+#define COMPRESSION_LEVEL_BUSY          1
+#define COMPRESSION_CHUNK_SIZE          (16 * 1024)
+#define RANGE_BOUNDARY                  "nitishhttpd-byteranges"
 #define DEFAULT_SERVER_PORT             8000
 #define REDIS_SERVER_HOST               "127.0.0.1"
 #define REDIS_SERVER_PORT               6379
 
+/*
+    Page cache hints for file bodies, see hint_file_transfer()
+    READAHEAD_MIN_SIZE -> files from this size on are declared sequential and their first READAHEAD_SIZE bytes
+                          are read ahead before the first sendfile()
+    DONTNEED_MIN_SIZE  -> files from this size on that were not in the page cache before they were sent
+                          are dropped from it afterwards, so a one-off download doesn't push the hot set out
+    Can be changed at build time, eg: make CFLAGS=-DDONTNEED_MIN_SIZE=268435456
+*/
+#ifndef READAHEAD_MIN_SIZE
+#define READAHEAD_MIN_SIZE              (256 * 1024)
+#endif
+#ifndef DONTNEED_MIN_SIZE
+#define DONTNEED_MIN_SIZE               (64 * 1024 * 1024)
+#endif
+#define READAHEAD_SIZE                  (2 * 1024 * 1024)
+
 #define METHOD_HANDLED                  0
 #define METHOD_NOT_HANDLED              1
 
@@ -31,10 +75,11 @@
 #define GUESTBOOK_TMPL_VISITOR          "$VISITOR_COUNT$"
 #define GUESTBOOK_TMPL_REMARKS          "$GUEST_REMARKS$"
 
-const char *unimplemented_content = \
-        "HTTP/1.0 400 Bad Request\r\n"
-        "Content-type: text/html\r\n"
-        "\r\n"
+#define REQUEST_ARENA_BLOCK_SIZE        (16 * 1024)
+#define FORM_MAX_BODY_SIZE              (64 * 1024)
+#define FORM_MAX_FIELDS                 16
+
+const char unimplemented_content[] = \
         "<html>"
         "<head>"
         "<title>ZeroHTTPd: Unimplemented</title>"
@@ -45,10 +90,7 @@ const char *unimplemented_content = \
         "</body>"
         "</html>";
 
-const char *http_404_content = \
-        "HTTP/1.0 404 Not Found\r\n"
-        "Content-type: text/html\r\n"
-        "\r\n"
+const char http_404_content[] = \
         "<html>"
         "<head>"
         "<title>ZeroHTTPd: Not Found</title>"
@@ -84,57 +126,610 @@ const char* get_filename_ext(const char* filename)
     return dot + 1;
 }
 
-/* Converts a hex character to its integer value */
-char from_hex(char ch)
+/*
+    Media types from MIME_TYPES_FILE, loaded once at startup. They take precedence over
+    the compiled-in perfect hash in mime_types.h, so a deployment can add or override
+    types without a rebuild. The table is open addressing over mime_hash() and is only
+    read once the server is accepting connections.
+*/
+struct mime_type* loaded_mime_types = NULL;
+unsigned int loaded_mime_types_mask = 0;
+
+const struct mime_type default_mime_type = {
+    "", 0, MIME_DEFAULT_HEADER, sizeof(MIME_DEFAULT_HEADER) - 1
+};
+
+void add_loaded_mime_type(const char* ext, const char* type)
+{
+    int len = strlen(ext);
+    unsigned int slot = mime_hash(ext, len, 0) & loaded_mime_types_mask;
+
+    while (loaded_mime_types[slot].extension)
+    {
+        /* Like mime.types itself, the first type listed for an extension wins */
+        if (strcasecmp(loaded_mime_types[slot].extension, ext) == 0) return;
+        slot = (slot + 1) & loaded_mime_types_mask;
+    }
+
+    struct mime_type* entry = &loaded_mime_types[slot];
+    char* extension = strdup(ext);
+    char* header;
+    strtolower(extension);
+    entry->header_len = asprintf(&header, "Content-Type: %s\r\n", type);
+    entry->header = header;
+    entry->extension_len = len;
+    entry->extension = extension;
+}
+
+/*
+    Walks a mime.types file, calling add_loaded_mime_type() for every extension when
+    insert is set. Returns the number of extensions seen.
+*/
+int read_mime_types_file(FILE* file, int insert)
+{
+    char line[1024];
+    int count = 0;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        char* saveptr;
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char* type = strtok_r(line, " \t\r\n", &saveptr);
+        if (!type) continue;
+
+        char* ext;
+        while ((ext = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL)
+        {
+            if (insert) add_loaded_mime_type(ext, type);
+            count++;
+        }
+    }
+    return count;
+}
+
+void load_mime_types(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) return; /* the compiled-in table is all we need */
+
+    int count = read_mime_types_file(file, 0);
+    if (count > 0)
+    {
+        unsigned int capacity = 1;
+        while (capacity < (unsigned int)count * 2) capacity <<= 1;
+
+        loaded_mime_types = calloc(capacity, sizeof(struct mime_type));
+        if (!loaded_mime_types) fatal_error("calloc()");
+        loaded_mime_types_mask = capacity - 1;
+
+        rewind(file);
+        read_mime_types_file(file, 1);
+        printf("Loaded %d media type extensions from %s\n", count, path);
+    }
+    fclose(file);
+}
+
+/*
+    Media type of a file, by its extension. Unknown types are sent as
+    application/octet-stream.
+*/
+const struct mime_type* mime_type_for_path(const char* path)
+{
+    const char* ext = get_filename_ext(path);
+    int len = strlen(ext);
+
+    if (loaded_mime_types && len > 0)
+    {
+        unsigned int slot = mime_hash(ext, len, 0) & loaded_mime_types_mask;
+        while (loaded_mime_types[slot].extension)
+        {
+            if (loaded_mime_types[slot].extension_len == len && strncasecmp(loaded_mime_types[slot].extension, ext, len) == 0)
+                return &loaded_mime_types[slot];
+            slot = (slot + 1) & loaded_mime_types_mask;
+        }
+    }
+
+    const struct mime_type* type = mime_type_lookup(ext, len);
+    return type ? type : &default_mime_type;
+}
+
+/*
+    Response header block. Status lines, the Server header and content types are
+    prebuilt constants, and the Date header is formatted at most once a second per
+    worker, so building headers is a handful of memcpy() calls.
+*/
+struct header_line {
+    const char* data;
+    int         len;
+};
+
+#define HEADER_LINE(s)                  { s, sizeof(s) - 1 }
+
+const struct header_line status_200 = HEADER_LINE("HTTP/1.0 200 OK\r\n");
+const struct header_line status_206 = HEADER_LINE("HTTP/1.0 206 Partial Content\r\n");
+const struct header_line status_304 = HEADER_LINE("HTTP/1.0 304 Not Modified\r\n");
+const struct header_line status_400 = HEADER_LINE("HTTP/1.0 400 Bad Request\r\n");
+const struct header_line status_404 = HEADER_LINE("HTTP/1.0 404 Not Found\r\n");
+const struct header_line status_413 = HEADER_LINE("HTTP/1.0 413 Payload Too Large\r\n");
+const struct header_line status_416 = HEADER_LINE("HTTP/1.0 416 Range Not Satisfiable\r\n");
+const struct header_line server_header = HEADER_LINE(SERVER_STRING);
+
+const struct mime_type html_mime_type = {
+    "html", 4, "Content-Type: text/html\r\n", sizeof("Content-Type: text/html\r\n") - 1
+};
+
+/*
+    time() is answered from the vDSO without entering the kernel, so checking whether
+    the second changed is cheap. Each worker keeps its own copy and never shares it.
+*/
+struct date_header_cache {
+    time_t  second;
+    int     len;
+    char    header[48];
+};
+
+__thread struct date_header_cache date_header_cache;
+
+const char* date_day_names[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+const char* date_month_names[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/* Formats t as an IMF-fixdate, always in English whatever the locale says */
+int format_http_date(char* buffer, size_t size, time_t t)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return snprintf(buffer, size, "%s, %02d %s %d %02d:%02d:%02d GMT",
+        date_day_names[tm.tm_wday], tm.tm_mday, date_month_names[tm.tm_mon], tm.tm_year + 1900,
+        tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+const struct date_header_cache* current_date_header()
+{
+    time_t now = time(NULL);
+    if (now != date_header_cache.second)
+    {
+        char date[32];
+        format_http_date(date, sizeof(date), now);
+        date_header_cache.len = snprintf(date_header_cache.header, sizeof(date_header_cache.header), "Date: %s\r\n", date);
+        date_header_cache.second = now;
+    }
+    return &date_header_cache;
+}
+
+/*
+    Writes the full header block, including the blank line that ends it, into buffer.
+    extra holds already formatted header lines (eg: validators), type may be NULL and
+    content_length negative for responses without a body.
+    buffer must hold RESPONSE_HEADERS_MAX_SIZE bytes. Returns the block length.
+*/
+int build_response_headers(char* buffer, const struct header_line* status, const struct mime_type* type, off_t content_length,
+                           const char* extra, int extra_len)
+{
+    const struct date_header_cache* date = current_date_header();
+    char digits[24];
+    int digits_len = 0;
+    char* p = buffer;
+
+    memcpy(p, status->data, status->len);
+    p += status->len;
+    memcpy(p, server_header.data, server_header.len);
+    p += server_header.len;
+    memcpy(p, date->header, date->len);
+    p += date->len;
+    memcpy(p, extra, extra_len);
+    p += extra_len;
+
+    if (type)
+    {
+        memcpy(p, type->header, type->header_len);
+        p += type->header_len;
+    }
+
+    if (content_length >= 0)
+    {
+        memcpy(p, "content-length: ", 16);
+        p += 16;
+        do {
+            digits[digits_len++] = '0' + content_length % 10;
+            content_length /= 10;
+        } while (content_length > 0);
+        while (digits_len > 0) *p++ = digits[--digits_len];
+        memcpy(p, "\r\n", 2);
+        p += 2;
+    }
+
+    memcpy(p, "\r\n", 2);
+    p += 2;
+    return p - buffer;
+}
+
+/*
+    Sends the header block and a body from memory with a single writev()
+*/
+void send_response(int client_socket, const struct header_line* status, const struct mime_type* type,
+                   const char* extra, int extra_len, const char* body, size_t body_len)
+{
+    char headers[RESPONSE_HEADERS_MAX_SIZE];
+    struct iovec iov[2];
+
+    iov[0].iov_base = headers;
+    iov[0].iov_len = build_response_headers(headers, status, type, body_len, extra, extra_len);
+    iov[1].iov_base = (void*)body;
+    iov[1].iov_len = body_len;
+
+    struct iovec* next = iov;
+    int count = 2;
+    while (count > 0)
+    {
+        ssize_t n = writev(client_socket, next, count);
+        if (n <= 0)
+        {
+            if (n == -1 && errno == EINTR) continue;
+            return;
+        }
+        /* short write, skip what already went out */
+        while (count > 0 && (size_t)n >= next->iov_len)
+        {
+            n -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0)
+        {
+            next->iov_base = (char*)next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+}
+
+/*
+    Content codings. Compressible files under public/ get .gz and .br variants generated next to
+    them at startup (see build_precompressed_variants()), and a variant is served in place of the
+    file when the client's Accept-Encoding allows it. Preference goes to the highest index
+*/
+#define ENCODING_IDENTITY               0
+#define ENCODING_GZIP                   1
+#define ENCODING_BROTLI                 2
+#define ENCODINGS_COUNT                 3
+
+struct content_encoding {
+    const char  *name;          /* Accept-Encoding token, also tagged onto the ETag */
+    const char  *file_suffix;   /* the variant of public/x.css is public/x.css<suffix> */
+    const char  *header;        /* Content-Encoding line */
+};
+
+const struct content_encoding content_encodings[ENCODINGS_COUNT] = {
+    { "identity",   "",     "" },
+    { "gzip",       ".gz",  "Content-Encoding: gzip\r\n" },
+    { "br",         ".br",  "Content-Encoding: br\r\n" },
+};
+
+/* Text-like media types are worth compressing, images, archives and media already are compressed */
+int mime_type_compressible(const struct mime_type* type)
+{
+    const char* media = type->header + strlen("Content-Type: ");
+    return strncmp(media, "text/", 5) == 0 || strstr(media, "javascript") || strstr(media, "json")
+        || strstr(media, "xml") || strstr(media, "manifest");
+}
+
+/*
+    Validators for conditional GETs. The ETag is built from the inode, size and
+    modification time, so it changes whenever the file is rewritten or replaced
+*/
+struct file_validators {
+    char    etag[64];           /* quoted, exactly as sent */
+    time_t  last_modified;
+    int     negotiated;         /* the file has compressed variants, responses say Vary: Accept-Encoding */
+    char    lines[256];         /* ETag, Last-Modified, Accept-Ranges, Vary and Content-Encoding header lines */
+    int     lines_len;
+};
+
+void format_validator_lines(struct file_validators* validators, int encoding)
+{
+    char date[32];
+
+    format_http_date(date, sizeof(date), validators->last_modified);
+    validators->lines_len = snprintf(validators->lines, sizeof(validators->lines), "ETag: %s\r\nLast-Modified: %s\r\n%s%s%s",
+                                     validators->etag, date,
+                                     encoding == ENCODING_IDENTITY ? "Accept-Ranges: bytes\r\n" : "",
+                                     validators->negotiated ? "Vary: Accept-Encoding\r\n" : "",
+                                     content_encodings[encoding].header);
+}
+
+void file_validators_from_stat(struct file_validators* validators, const struct stat* st, int negotiated)
+{
+    snprintf(validators->etag, sizeof(validators->etag), "\"%lx-%lx-%lx.%lx\"",
+             (unsigned long) st->st_ino, (unsigned long) st->st_size,
+             (unsigned long) st->st_mtim.tv_sec, (unsigned long) st->st_mtim.tv_nsec);
+    validators->last_modified = st->st_mtim.tv_sec;
+    validators->negotiated = negotiated;
+    format_validator_lines(validators, ENCODING_IDENTITY);
+}
+
+/* Validators of a precompressed variant: the same dates, an ETag of its own and the Content-Encoding line */
+void file_validators_for_encoding(struct file_validators* variant, const struct file_validators* identity, int encoding)
+{
+    *variant = *identity;
+    snprintf(variant->etag, sizeof(variant->etag), "%.*s-%s\"",
+             (int) strlen(identity->etag) - 1, identity->etag, content_encodings[encoding].name);
+    format_validator_lines(variant, encoding);
+}
+
+/* 304 carries the validators but no body, no Content-Type and no content-length */
+void send_not_modified(int client_socket, const struct file_validators* validators)
 {
-    return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+    char headers[RESPONSE_HEADERS_MAX_SIZE];
+    int headers_len = build_response_headers(headers, &status_304, NULL, -1, validators->lines, validators->lines_len);
+    send(client_socket, headers, headers_len, 0);
 }
 
+
 /*
     Sends "HTTP Not Found" code and message to the client
 */
 void handle_http_404(int client_socket)
 {
-    send(client_socket, http_404_content, strlen(http_404_content), 0);
+    send_response(client_socket, &status_404, &html_mime_type, NULL, 0, http_404_content, sizeof(http_404_content) - 1);
+}
+
+/*
+    Per request bump allocator. Everything a request needs while parsing and talking to Redis
+    (decoded form fields, Redis commands, list items) is carved out of the worker's arena and
+    released all at once by arena_reset() after the response is sent.
+    The first block is kept from one request to the next, so a typical request does not call malloc() at all
+    and threads don't contend on glibc's malloc arenas
+*/
+struct arena_block {
+    struct arena_block  *next;
+    size_t              size;
+    size_t              used;
+    char                data[];
+};
+
+__thread struct arena_block *request_arena;
+
+void* arena_alloc(size_t size)
+{
+    size = (size + 15) & ~((size_t)15);
+
+    struct arena_block *block = request_arena;
+    if (!block || block->used + size > block->size)
+    {
+        size_t block_size = size > REQUEST_ARENA_BLOCK_SIZE ? size : REQUEST_ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(struct arena_block) + block_size);
+        if (!block) fatal_error("malloc()");
+        block->size = block_size;
+        block->used = 0;
+        block->next = request_arena;
+        request_arena = block;
+    }
+
+    void *p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+/* Like asprintf(), but the string lives in the request arena */
+char* arena_sprintf(const char* fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    char *str = arena_alloc(len + 1);
+    va_start(args, fmt);
+    vsnprintf(str, len + 1, fmt, args);
+    va_end(args);
+    return str;
+}
+
+/*
+    Called once the response is sent. Frees overflow blocks and keeps the oldest one for the next request,
+    unless it was sized for one big allocation (a form body, a long list item), which would stay allocated
+    for the life of the process
+*/
+void arena_reset()
+{
+    struct arena_block *block = request_arena;
+    if (!block) return;
+
+    while (block->next)
+    {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    if (block->size > REQUEST_ARENA_BLOCK_SIZE)
+    {
+        free(block);
+        block = NULL;
+    }
+    else
+    {
+        block->used = 0;
+    }
+    request_arena = block;
 }
 
+/*
+    Value of every hex digit, -1 for everything else.
+    One table lookup per digit instead of isdigit() and tolower() calls
+*/
+static const signed char hex_values[256] = {
+    [0 ... 255] = -1,
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4, ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
 /*
     HTML URls and other data like data sent over POST method are encoded using a simple schema
-    This functions take encoded data and returns a regular, decoded string
     eg:
     Encoded: Nothing+is+better+than+bread+%26+butter%21
     Decoded: Nothing is better than bread & butter!
+
+    url_decode_span() decodes src[0 .. len) into dst, which may be src itself (decoding never writes ahead of reading).
+    It stops early, without consuming it, at an '&' (and at an '=' too with stop_at_equals), or at a '%' that
+    has less than two characters after it, so that form parsing can split fields and carry an escape over to the
+    next read. An invalid escape like "%zz" is copied literally. Returns bytes consumed, *written gets bytes written.
+
+    Two implementations are picked from at load time (see resolve_url_decode_span()):
+    - scalar: one byte at a time
+    - SSSE3: 16 bytes at a time. Runs without any '%' are copied with a single store, '+' is turned into ' '
+      with a compare and blend, and runs of consecutive escapes (typical of UTF-8 text) are decoded 5 at a time
 */
-char* urlencoding_decode(char* str)
+size_t url_decode_span_scalar(const char* src, size_t len, char* dst, size_t* written, int stop_at_equals)
 {
-    char* pstr = str;
-    char* buf = malloc(strlen(str) + 1);
-    char* pbuf = buf;
+    size_t i = 0, o = 0;
 
-    while (*pstr)
+    while (i < len)
     {
-        if(*pstr == '%')
+        char ch = src[i];
+        if (ch == '&' || (ch == '=' && stop_at_equals)) break;
+
+        if (ch == '%')
         {
-            if(pstr[1] && pstr[2])
+            if (i + 2 >= len) break;
+            int hi = hex_values[(unsigned char)src[i + 1]];
+            int lo = hex_values[(unsigned char)src[i + 2]];
+            if (hi >= 0 && lo >= 0)
             {
-                *pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
-                pstr += 2;
+                dst[o++] = hi << 4 | lo;
+                i += 3;
+                continue;
             }
         }
-        else if (*pstr == '+')
+
+        dst[o++] = ch == '+' ? ' ' : ch;
+        i++;
+    }
+
+    *written = o;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+    Decodes "%XX%XX%XX%XX%XX" at src into 5 bytes at dst. Returns 0, having written nothing,
+    if the 15 bytes are anything else. src must have 16 readable bytes
+*/
+__attribute__((target("ssse3")))
+int decode_5_escapes_ssse3(const char* src, char* dst)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*) src);
+
+    /* '%' at 0, 3, 6, 9 and 12 */
+    if ((_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('%'))) & 0x1249) != 0x1249) return 0;
+
+    /* Gather the 10 digits, in order: hi0 lo0 hi1 lo1 ... */
+    __m128i digits = _mm_shuffle_epi8(v, _mm_setr_epi8(1, 2, 4, 5, 7, 8, 10, 11, 13, 14, -1, -1, -1, -1, -1, -1));
+
+    __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(digits, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(digits, _mm_set1_epi8('9' + 1)));
+    __m128i lower = _mm_or_si128(digits, _mm_set1_epi8(0x20));
+    __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    if ((_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) & 0x3FF) != 0x3FF) return 0;
+
+    /* '0'..'9' -> low nibble as is, 'a'..'f' and 'A'..'F' -> low nibble + 9 */
+    __m128i values = _mm_add_epi8(_mm_and_si128(digits, _mm_set1_epi8(0x0F)), _mm_and_si128(is_alpha, _mm_set1_epi8(9)));
+
+    /* hi * 16 + lo for each pair, then narrow the 16 bit results back to bytes */
+    __m128i pairs = _mm_maddubs_epi16(values, _mm_setr_epi8(16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 0, 0, 0, 0, 0, 0));
+    __m128i bytes = _mm_packus_epi16(pairs, pairs);
+
+    char decoded[16];
+    _mm_storeu_si128((__m128i*) decoded, bytes);
+    memcpy(dst, decoded, 5);
+    return 1;
+}
+
+__attribute__((target("ssse3")))
+size_t url_decode_span_ssse3(const char* src, size_t len, char* dst, size_t* written, int stop_at_equals)
+{
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i plus = _mm_set1_epi8('+');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i ampersand = _mm_set1_epi8('&');
+    /* When '=' is not a stop character, compare against '&' twice instead */
+    const __m128i equals = _mm_set1_epi8(stop_at_equals ? '=' : '&');
+    size_t i = 0, o = 0;
+
+    while (i + 16 <= len)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+
+        __m128i is_plus = _mm_cmpeq_epi8(v, plus);
+        v = _mm_or_si128(_mm_andnot_si128(is_plus, v), _mm_and_si128(is_plus, space));
+
+        int special = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, percent),
+                                        _mm_or_si128(_mm_cmpeq_epi8(v, ampersand), _mm_cmpeq_epi8(v, equals))));
+        if (special == 0)
+        {
+            /* dst never runs ahead of src, so this store only overwrites bytes already loaded */
+            _mm_storeu_si128((__m128i*)(dst + o), v);
+            i += 16;
+            o += 16;
+            continue;
+        }
+
+        /* Copy the plain run in front of the special character, and only that: dst may trail src in place */
+        int run = __builtin_ctz(special);
+        char block[16];
+        _mm_storeu_si128((__m128i*) block, v);
+        memcpy(dst + o, block, run);
+        i += run;
+        o += run;
+
+        if (src[i] != '%') break;   /* a separator */
+
+        while (i + 16 <= len && decode_5_escapes_ssse3(src + i, dst + o))
         {
-            *pbuf++ = ' ';
+            i += 15;
+            o += 5;
         }
-        else
+
+        if (src[i] == '%')
         {
-            *pbuf++ = *pstr;
+            if (i + 2 >= len) break;
+            int hi = hex_values[(unsigned char)src[i + 1]];
+            int lo = hex_values[(unsigned char)src[i + 2]];
+            if (hi >= 0 && lo >= 0)
+            {
+                dst[o++] = hi << 4 | lo;
+                i += 3;
+            }
+            else
+            {
+                dst[o++] = '%';
+                i++;
+            }
         }
-        pstr++;
     }
-    *pbuf = '\0';
 
-    return buf;
+    /* Fewer than 16 bytes left, or stopped at a special character, the scalar code finishes */
+    size_t tail_written;
+    i += url_decode_span_scalar(src + i, len - i, dst + o, &tail_written, stop_at_equals);
+    *written = o + tail_written;
+    return i;
+}
+
+static void* resolve_url_decode_span()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3") ? (void*) url_decode_span_ssse3 : (void*) url_decode_span_scalar;
+}
+
+size_t url_decode_span(const char* src, size_t len, char* dst, size_t* written, int stop_at_equals)
+    __attribute__((ifunc("resolve_url_decode_span")));
+#else
+size_t url_decode_span(const char* src, size_t len, char* dst, size_t* written, int stop_at_equals)
+{
+    return url_decode_span_scalar(src, len, dst, written, stop_at_equals);
 }
+#endif
 
 // create a client socket for redis
 void connect_to_redis_server(char* redis_host)
@@ -175,15 +770,9 @@ void connect_to_redis_server(char* redis_host)
 */
 int _redis_get_key(const char* key, char* value_buffer, int value_buffer_sz)
 {
-    char *req_buffer;
-    /*
-        asprintf() is a useful GNU extension that allocates the string as required
-        No more guessing the right size for the buffer that holds the string
-        Don't forget to call free() once done
-    */
-   asprintf(&req_buffer, "*2\r\n$3\r\nGET\r\n$%ld\r\n%s\r\n", strlen(key), key);
+    /* The command only lives until the response is read, the request arena is the right home for it */
+    char *req_buffer = arena_sprintf("*2\r\n$3\r\nGET\r\n$%ld\r\n%s\r\n", strlen(key), key);
    write(redis_socket_fd, req_buffer, strlen(req_buffer));
-   free(req_buffer);
    read(redis_socket_fd, value_buffer, value_buffer_sz);
    return 0;
 }
@@ -242,19 +831,21 @@ int redis_incr(char* key)
     Appends an item pointed to by 'value' to the list in redis referred by 'key'
     Uses the redis RPUSH command
 */
-int redis_list_append(char* key, char* value)
+int redis_list_append(char* key, const char* value)
 {
-    char cmd_buf[1024] = "";
-    sprintf(cmd_buf, "*3\r\n$5\r\nRPUSH\r\n$%ld\r\n%s\r\n$%ld\r\n%s\r\n", strlen(key), key, strlen(value), value);
-    write(redis_socket_fd, cmd_buf, strlen(cmd_buf));
-    bzero(cmd_buf, sizeof(cmd_buf));
-    read(redis_socket_fd, cmd_buf, sizeof(cmd_buf));
+    /* Remarks can be as long as a form body, so the command is sized to fit in the request arena */
+    char *cmd = arena_sprintf("*3\r\n$5\r\nRPUSH\r\n$%ld\r\n%s\r\n$%ld\r\n%s\r\n", strlen(key), key, strlen(value), value);
+    write(redis_socket_fd, cmd, strlen(cmd));
+
+    char reply[64];
+    read(redis_socket_fd, reply, sizeof(reply));
     return 0;
 }
 
 /*
     Get range of items in a list from 'start' to 'end'
-    This function allocates memory. An array of pointers and all strings pointed to by it are dynamically allocated.
+    The array of pointers and all strings pointed to by it are allocated from the request arena,
+    they are valid until the response is sent.
 */
 int redis_list_get_range(char* key, int start, int end, char*** items, int* items_count)
 {
@@ -303,7 +894,7 @@ int redis_list_get_range(char* key, int start, int end, char*** items, int* item
 
     *items_count = returned_items;
     /* Allocate array that will hold pointer each for every element in the returned list */
-    char** items_holder = malloc(sizeof(char*) * returned_items);
+    char** items_holder = arena_alloc(sizeof(char*) * returned_items);
     *items = items_holder;
 
     /*
@@ -327,7 +918,7 @@ int redis_list_get_range(char* key, int start, int end, char*** items, int* item
         }
 
         // allocate and read the string
-        char *str = malloc(sizeof(char) * str_size + 1);
+        char *str = arena_alloc(sizeof(char) * str_size + 1);
         items_holder[i] = str;
         read(redis_socket_fd, str, str_size);
         str[str_size] = '\0';
@@ -338,16 +929,6 @@ int redis_list_get_range(char* key, int start, int end, char*** items, int* item
     }
 }
 
-/* Free all dynamically allocated string */
-int redis_free_array_result(char** items, int length)
-{
-    for (int i = 0; i < length; i++)
-    {
-        free(items[i]);
-    }
-    free(items);
-}
-
 /*
     Utility function to get the whole list
 */
@@ -391,91 +972,989 @@ int setup_listening_socket(int server_port)
     return sock;
 }
 
-int get_line(int sock, char* buf, int size)
+/*
+    The few request headers we act on. handle_client() resets them for every request and
+    passes each header line to parse_request_header(), everything else is thrown away as before
+*/
+struct request_headers {
+    long    content_length;         /* -1 when the request has no Content-Length */
+    int     form_urlencoded;        /* Content-Type is application/x-www-form-urlencoded */
+    char    if_none_match[256];     /* raw list of entity tags, empty when absent */
+    time_t  if_modified_since;      /* -1 when absent or unparsable */
+    char    range[256];             /* raw Range value, empty when absent */
+    char    if_range[64];           /* raw If-Range value, empty when absent */
+    int     accept_encodings;       /* 1 << ENCODING_x for every coding Accept-Encoding allows */
+};
+
+__thread struct request_headers request_headers;
+
+void reset_request_headers()
 {
-    int i = 0;
-    char c = '\0';
-    ssize_t n;
+    request_headers.content_length = -1;
+    request_headers.form_urlencoded = 0;
+    request_headers.if_none_match[0] = '\0';
+    request_headers.if_modified_since = -1;
+    request_headers.range[0] = '\0';
+    request_headers.if_range[0] = '\0';
+    request_headers.accept_encodings = 0;
+}
 
-    while ((i < size - 1) && (c != '\n'))
+/* q=0 (or 0.0, 0.000) marks a coding as not acceptable */
+int qvalue_is_zero(const char* q)
+{
+    while (*q == '0' || *q == '.') q++;
+    return *q == '\0' || *q == ',' || *q == ';' || *q == ' ' || *q == '\t';
+}
+
+/* Returns the content codings an Accept-Encoding value allows, as a 1 << ENCODING_x mask */
+int parse_accept_encoding(const char* value)
+{
+    int accepted = 0, refused = 0, wildcard = 0;
+    const char* p = value;
+
+    while (*p)
     {
-        // read 1 char byte, should be read in chunks for effeciency
-        n = recv(sock, &c, 1, 0);
-        if (n > 0)
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char* name = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t name_len = p - name;
+        if (name_len == 0) continue;
+
+        int allowed = 1;
+        while (*p && *p != ',')
         {
-            // check for \r\n line boundary as per HTTP protocol
-            if (c == '\r')
+            if (*p == ';')
             {
-                n = recv(sock, &c, 1, MSG_PEEK); // only peeks, don't read
-                if ((n > 0) && (c == '\n'))
-                {
-                    recv(sock, &c, 1, 0);
-                }
+                p++;
+                while (*p == ' ' || *p == '\t') p++;
+                if ((*p == 'q' || *p == 'Q') && p[1] == '=') allowed = !qvalue_is_zero(p + 2);
             }
             else
             {
-                buf[i] = c;
-                i++;
+                p++;
             }
         }
-        else
+
+        if (name_len == 1 && *name == '*')
         {
-            return 0;
+            wildcard = allowed;
+            continue;
+        }
+        for (int encoding = ENCODING_GZIP; encoding < ENCODINGS_COUNT; encoding++)
+        {
+            if (strlen(content_encodings[encoding].name) == name_len && strncasecmp(name, content_encodings[encoding].name, name_len) == 0)
+            {
+                if (allowed) accepted |= 1 << encoding;
+                else refused |= 1 << encoding;
+            }
         }
     }
-    buf[i] = '\0';
-    return i;
+
+    /* "*" covers every coding that is not named explicitly */
+    if (wildcard) accepted |= ((1 << ENCODINGS_COUNT) - 1) & ~(1 << ENCODING_IDENTITY);
+    return accepted & ~refused;
 }
 
-/*
-    Read the static file and write to client socket using sendfile() system call [zero copy]
-*/
-void transfer_file_contents(char* file_path, int client_socket, off_t file_size)
+void parse_request_header(const char* line)
 {
-    int fd;
-    fd = open(file_path, O_RDONLY);
-    sendfile(client_socket, fd, NULL, file_size);
-    close(fd);
+    const char *colon = strchr(line, ':');
+    if (!colon) return;
+
+    const char *value = colon + 1;
+    while (*value == ' ' || *value == '\t') value++;
+
+    if (strncasecmp(line, "content-length:", 15) == 0)
+    {
+        char *end;
+        long length = strtol(value, &end, 10);
+        if (end != value && length >= 0) request_headers.content_length = length;
+    }
+    else if (strncasecmp(line, "content-type:", 13) == 0)
+    {
+        request_headers.form_urlencoded = strncasecmp(value, "application/x-www-form-urlencoded", 33) == 0;
+    }
+    else if (strncasecmp(line, "if-none-match:", 14) == 0)
+    {
+        snprintf(request_headers.if_none_match, sizeof(request_headers.if_none_match), "%s", value);
+    }
+    else if (strncasecmp(line, "if-modified-since:", 18) == 0)
+    {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm)) request_headers.if_modified_since = timegm(&tm);
+    }
+    else if (strncasecmp(line, "range:", 6) == 0)
+    {
+        snprintf(request_headers.range, sizeof(request_headers.range), "%s", value);
+    }
+    else if (strncasecmp(line, "accept-encoding:", 16) == 0)
+    {
+        request_headers.accept_encodings = parse_accept_encoding(value);
+    }
+    else if (strncasecmp(line, "if-range:", 9) == 0)
+    {
+        snprintf(request_headers.if_range, sizeof(request_headers.if_range), "%s", value);
+    }
 }
 
-/*
-    Sends HTTP 200 OK header
-*/
-void send_headers(const char* path, off_t len, int client_socket)
+/* Checks an If-None-Match list ("*" or comma separated, possibly weak, entity tags) against etag */
+int etag_list_matches(const char* list, const char* etag)
 {
-    char small_case_path[1024];
-    char send_buffer[1024];
-    strcpy(small_case_path, path);
-    strtolower(small_case_path);
+    size_t etag_len = strlen(etag);
+    const char* p = list;
 
-    strcpy(send_buffer, "HTTP/1.0 200 OK\r\n");
-    send(client_socket, send_buffer, strlen(send_buffer), 0);
-    strcpy(send_buffer, SERVER_STRING);
-    send(client_socket, send_buffer, strlen(send_buffer), 0);
-
-    /*
-        Check file extensions for certain common types of files on web pages
-        and send the appropriate content type header 
-    */
-   const char* file_ext = get_filename_ext(small_case_path);
-   if (strcmp("jpg", file_ext) == 0) strcpy(send_buffer, "Content-Type: image/jpeg\r\n");
-   if (strcmp("jpeg", file_ext) == 0) strcpy(send_buffer, "Content-Type: image/jpeg\r\n");
-   if (strcmp("png", file_ext) == 0) strcpy(send_buffer, "Content-Type: image/png\r\n");
-   if (strcmp("gif", file_ext) == 0) strcpy(send_buffer, "Content-Type: image/gif\r\n");
-   if (strcmp("htm", file_ext) == 0) strcpy(send_buffer, "Content-Type: text/html\r\n");
-   if (strcmp("html", file_ext) == 0) strcpy(send_buffer, "Content-Type: text/html\r\n");
-   if (strcmp("js", file_ext) == 0) strcpy(send_buffer, "Content-Type: application/javascript\r\n");
-   if (strcmp("css", file_ext) == 0) strcpy(send_buffer, "Content-Type: text/css\r\n");
-   if (strcmp("txt", file_ext) == 0) strcpy(send_buffer, "Content-Type: text/plain\r\n");
-   send(client_socket, send_buffer, strlen(send_buffer), 0);
+    while (*p)
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '*') return 1;
 
-   /* Send the content length header*/
-   sprintf(send_buffer, "content-length: %ld\r\n", len);
-   send(client_socket, send_buffer, strlen(send_buffer), 0);
+        /* weak comparison is what GET revalidation asks for */
+        if (strncmp(p, "W/", 2) == 0) p += 2;
 
-   /* This empty line with "\r\n" signals browser there are no more headers. Content May follow */
-   strcpy(send_buffer, "\r\n");
-   send(client_socket, send_buffer, strlen(send_buffer), 0);
+        const char* end;
+        if (*p == '"')
+        {
+            end = strchr(p + 1, '"');
+            end = end ? end + 1 : p + strlen(p);
+        }
+        else
+        {
+            end = p;
+            while (*end && *end != ',' && *end != ' ' && *end != '\t') end++;
+        }
+
+        if ((size_t)(end - p) == etag_len && memcmp(p, etag, etag_len) == 0) return 1;
+        p = end;
+    }
+    return 0;
+}
+
+/*
+    Returns 1 when the client's copy is still current. If-None-Match wins over
+    If-Modified-Since when a request carries both
+*/
+int request_not_modified(const struct file_validators* validators)
+{
+    if (request_headers.if_none_match[0])
+        return etag_list_matches(request_headers.if_none_match, validators->etag);
+    if (request_headers.if_modified_since != -1)
+        return validators->last_modified <= request_headers.if_modified_since;
+    return 0;
+}
+
+/*
+    File body transfers. sendfile() writes less than asked whenever the socket buffer fills up,
+    so a transfer keeps its own offset and is resumed until nothing remains. Every call is capped
+    at SENDFILE_CHUNK_SIZE, and a caller can cap a whole turn with 'budget'
+*/
+#define TRANSFER_DONE                   0
+#define TRANSFER_BLOCKED                1   /* socket buffer is full (EAGAIN), wait until it is writable */
+#define TRANSFER_YIELD                  2   /* budget for this turn is spent */
+#define TRANSFER_ERROR                  -1
+
+struct file_transfer {
+    int     fd;
+    off_t   offset;
+    off_t   remaining;
+};
+
+int file_transfer_step(struct file_transfer* transfer, int client_socket, off_t budget)
+{
+    off_t sent = 0;
+
+    while (transfer->remaining > 0)
+    {
+        if (sent >= budget) return TRANSFER_YIELD;
+
+        off_t chunk = transfer->remaining;
+        if (chunk > SENDFILE_CHUNK_SIZE) chunk = SENDFILE_CHUNK_SIZE;
+        if (chunk > budget - sent) chunk = budget - sent;
+
+        ssize_t n = sendfile(client_socket, transfer->fd, &transfer->offset, chunk);
+        if (n > 0)
+        {
+            transfer->remaining -= n;
+            sent += n;
+        }
+        else if (n == 0)
+        {
+            return TRANSFER_ERROR; /* file got shorter since it was stat()ed */
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return TRANSFER_BLOCKED;
+        }
+        else if (errno != EINTR)
+        {
+            return TRANSFER_ERROR;
+        }
+    }
+    return TRANSFER_DONE;
+}
+
+/*
+    Page cache estimates for the bodies hint_file_transfer() saw, shown by print_stats().
+    Lives in a MAP_SHARED mapping made before the first fork(), every child adds to the same totals
+*/
+struct page_cache_stats {
+    long    files;
+    long    pages;
+    long    resident_pages;         /* of those, the ones mincore() found in the page cache before sending */
+    long    dropped_files;          /* let go with POSIX_FADV_DONTNEED once sent */
+};
+
+struct page_cache_stats     page_cache_totals;
+struct page_cache_stats     *page_cache_stats = &page_cache_totals;
+
+/*
+    Counts the pages of a file that are in the page cache. The file is mapped for mincore() only,
+    the mapping is never touched so nothing is read in. Returns -1 if the file can't be mapped
+*/
+long count_resident_pages(int fd, off_t size)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    long pages = (size + page_size - 1) / page_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return -1;
+
+    unsigned char residency[4096];
+    long resident = 0;
+    for (long page = 0; page < pages; page += sizeof(residency))
+    {
+        long count = pages - page < (long) sizeof(residency) ? pages - page : (long) sizeof(residency);
+        if (mincore(map + page * page_size, count * page_size, residency) == -1) break;
+        for (long i = 0; i < count; i++) resident += residency[i] & 1;
+    }
+    munmap(map, size);
+    return resident;
+}
+
+/*
+    Page cache hints for a body about to be sent with sendfile(). A large file is declared sequential, which
+    doubles the kernel's readahead window for it, and its start is read ahead so the first sendfile() finds it.
+    Returns 1 when the file should be dropped from the page cache once sent, see drop_file_pages()
+*/
+int hint_file_transfer(int fd, off_t size)
+{
+    if (size < READAHEAD_MIN_SIZE) return 0;
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    long pages = (size + page_size - 1) / page_size;
+    long resident = count_resident_pages(fd, size);
+    if (resident != -1)
+    {
+        __atomic_add_fetch(&page_cache_stats->files, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&page_cache_stats->pages, pages, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&page_cache_stats->resident_pages, resident, __ATOMIC_RELAXED);
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    readahead(fd, 0, size < READAHEAD_SIZE ? size : READAHEAD_SIZE);
+
+    /* A file that was mostly cached already is being read by others too, it stays */
+    return size >= DONTNEED_MIN_SIZE && resident != -1 && resident * 2 < pages;
+}
+
+void drop_file_pages(int fd)
+{
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    __atomic_add_fetch(&page_cache_stats->dropped_files, 1, __ATOMIC_RELAXED);
+}
+
+/* Sends length bytes from memory, retrying partial writes */
+void send_all(int client_socket, const char* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = send(client_socket, data, length, 0);
+        if (n > 0)
+        {
+            data += n;
+            length -= n;
+        }
+        else if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+/*
+    Byte range requests. A Range header that does not parse, asks for too many ranges
+    or fails its If-Range check is ignored and the whole file is sent, as RFC 9110 asks
+*/
+#define RANGE_NONE                      0
+#define RANGE_SATISFIABLE               1
+#define RANGE_NOT_SATISFIABLE           2
+
+struct byte_range {
+    off_t   first;
+    off_t   last;       /* inclusive */
+};
+
+const struct mime_type byteranges_mime_type = {
+    "", 0,
+    "Content-Type: multipart/byteranges; boundary=" RANGE_BOUNDARY "\r\n",
+    sizeof("Content-Type: multipart/byteranges; boundary=" RANGE_BOUNDARY "\r\n") - 1
+};
+
+/* If-Range needs an exact match: a strong ETag or the very same Last-Modified date */
+int if_range_matches(const struct file_validators* validators)
+{
+    const char* value = request_headers.if_range;
+
+    if (!value[0]) return 1;
+    if (value[0] == '"') return strcmp(value, validators->etag) == 0;
+    if (strncmp(value, "W/", 2) == 0) return 0;
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (!strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm)) return 0;
+    return timegm(&tm) == validators->last_modified;
+}
+
+/* Parses one off_t, returns the character after it or NULL if there are no digits */
+const char* parse_range_offset(const char* p, off_t* value)
+{
+    if (*p < '0' || *p > '9') return NULL;
+    *value = 0;
+    while (*p >= '0' && *p <= '9')
+    {
+        if (*value > (LLONG_MAX - 9) / 10) return NULL;
+        *value = *value * 10 + (*p++ - '0');
+    }
+    return p;
+}
+
+/*
+    Turns the request's Range header into at most RANGE_MAX_RANGES satisfiable ranges
+    of a 'size' bytes file. Ranges that start past the end of the file are dropped
+*/
+int parse_range_request(off_t size, const struct file_validators* validators, struct byte_range* ranges, int* ranges_count)
+{
+    const char* p = request_headers.range;
+    int specs = 0;
+
+    *ranges_count = 0;
+    if (!p[0] || strncasecmp(p, "bytes=", 6) != 0) return RANGE_NONE;
+    if (!if_range_matches(validators)) return RANGE_NONE;
+    p += 6;
+
+    while (*p)
+    {
+        off_t first, last;
+
+        while (*p == ' ' || *p == '\t') p++;
+        if (++specs > RANGE_MAX_RANGES) return RANGE_NONE;
+
+        if (*p == '-')
+        {
+            /* suffix range: the last N bytes */
+            off_t suffix;
+            p = parse_range_offset(p + 1, &suffix);
+            if (!p) return RANGE_NONE;
+            first = suffix >= size ? 0 : size - suffix;
+            last = size - 1;
+            if (suffix == 0) first = size;
+        }
+        else
+        {
+            p = parse_range_offset(p, &first);
+            if (!p || *p != '-') return RANGE_NONE;
+            p++;
+            if (*p >= '0' && *p <= '9')
+            {
+                p = parse_range_offset(p, &last);
+                if (!p || last < first) return RANGE_NONE;
+                if (last >= size) last = size - 1;
+            }
+            else
+            {
+                last = size - 1;
+            }
+        }
+
+        if (first < size)
+        {
+            ranges[*ranges_count].first = first;
+            ranges[*ranges_count].last = last;
+            (*ranges_count)++;
+        }
+
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == ',') p++;
+        else if (*p) return RANGE_NONE;
+    }
+
+    if (specs == 0) return RANGE_NONE;
+    return *ranges_count > 0 ? RANGE_SATISFIABLE : RANGE_NOT_SATISFIABLE;
+}
+
+/* Sends length bytes at offset, from memory when content is set, else with sendfile() from fd */
+void send_body_range(int client_socket, int fd, const char* content, off_t offset, off_t length)
+{
+    if (content)
+    {
+        send_all(client_socket, content + offset, length);
+        return;
+    }
+
+    struct file_transfer transfer = { fd, offset, length };
+    while (file_transfer_step(&transfer, client_socket, length) == TRANSFER_YIELD);
+}
+
+void send_range_not_satisfiable(int client_socket, off_t size, const struct file_validators* validators)
+{
+    char headers[RESPONSE_HEADERS_MAX_SIZE];
+    char extra[512];
+    int extra_len = snprintf(extra, sizeof(extra), "%sContent-Range: bytes */%ld\r\n", validators->lines, (long) size);
+    int headers_len = build_response_headers(headers, &status_416, NULL, 0, extra, extra_len);
+    send(client_socket, headers, headers_len, 0);
+}
+
+/*
+    206 Partial Content. A single range goes out as is, several become a
+    multipart/byteranges body where every part carries its own Content-Range
+*/
+void send_ranges(int client_socket, const char* path, int fd, const char* content, off_t size,
+                 const struct file_validators* validators, const struct byte_range* ranges, int ranges_count)
+{
+    char headers[RESPONSE_HEADERS_MAX_SIZE];
+    char extra[512];
+    int extra_len, headers_len;
+    const struct mime_type* type = mime_type_for_path(path);
+
+    if (ranges_count == 1)
+    {
+        off_t length = ranges[0].last - ranges[0].first + 1;
+        extra_len = snprintf(extra, sizeof(extra), "%sContent-Range: bytes %ld-%ld/%ld\r\n", validators->lines,
+                             (long) ranges[0].first, (long) ranges[0].last, (long) size);
+        headers_len = build_response_headers(headers, &status_206, type, length, extra, extra_len);
+        send(client_socket, headers, headers_len, MSG_MORE);
+        send_body_range(client_socket, fd, content, ranges[0].first, length);
+        return;
+    }
+
+    /* Part headers are formatted up front, the total length has to be known for content-length */
+    const char* closing = "\r\n--" RANGE_BOUNDARY "--\r\n";
+    char* part_headers[RANGE_MAX_RANGES];
+    off_t total = strlen(closing);
+    for (int i = 0; i < ranges_count; i++)
+    {
+        part_headers[i] = arena_sprintf("\r\n--" RANGE_BOUNDARY "\r\n%.*sContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                                        type->header_len, type->header,
+                                        (long) ranges[i].first, (long) ranges[i].last, (long) size);
+        total += strlen(part_headers[i]) + ranges[i].last - ranges[i].first + 1;
+    }
+
+    headers_len = build_response_headers(headers, &status_206, &byteranges_mime_type, total, validators->lines, validators->lines_len);
+    send(client_socket, headers, headers_len, MSG_MORE);
+    for (int i = 0; i < ranges_count; i++)
+    {
+        send(client_socket, part_headers[i], strlen(part_headers[i]), MSG_MORE);
+        send_body_range(client_socket, fd, content, ranges[i].first, ranges[i].last - ranges[i].first + 1);
+    }
+    send(client_socket, closing, strlen(closing), 0);
+}
+
+int get_line(int sock, char* buf, int size)
+{
+    int i = 0;
+    char c = '\0';
+    ssize_t n;
+
+    while ((i < size - 1) && (c != '\n'))
+    {
+        // read 1 char byte, should be read in chunks for effeciency
+        n = recv(sock, &c, 1, 0);
+        if (n > 0)
+        {
+            // check for \r\n line boundary as per HTTP protocol
+            if (c == '\r')
+            {
+                n = recv(sock, &c, 1, MSG_PEEK); // only peeks, don't read
+                if ((n > 0) && (c == '\n'))
+                {
+                    recv(sock, &c, 1, 0);
+                }
+            }
+            else
+            {
+                buf[i] = c;
+                i++;
+            }
+        }
+        else
+        {
+            return 0;
+        }
+    }
+    buf[i] = '\0';
+    return i;
+}
+
+/*
+    Precompressed variants. Run once at startup, before any worker exists: every compressible file
+    under 'dir' of at least PRECOMPRESS_MIN_SIZE bytes gets a gzip and a brotli copy at maximum
+    compression, unless an up to date one is already there. Variants that do not save at least
+    a tenth of the size are not kept. Serving them is then a plain sendfile() of another file
+*/
+ssize_t compress_buffer(int encoding, const char* src, size_t len, char** out)
+{
+    if (encoding == ENCODING_GZIP)
+    {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+
+        size_t bound = deflateBound(&zs, len);
+        *out = malloc(bound);
+        zs.next_in = (Bytef*) src;
+        zs.avail_in = len;
+        zs.next_out = (Bytef*) *out;
+        zs.avail_out = bound;
+        int status = deflate(&zs, Z_FINISH);
+        deflateEnd(&zs);
+        if (status != Z_STREAM_END)
+        {
+            free(*out);
+            return -1;
+        }
+        return bound - zs.avail_out;
+    }
+
+    size_t out_len = BrotliEncoderMaxCompressedSize(len);
+    *out = malloc(out_len);
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               len, (const uint8_t*) src, &out_len, (uint8_t*) *out))
+    {
+        free(*out);
+        return -1;
+    }
+    return out_len;
+}
+
+/* Writes a variant through a temporary file and rename(), so a worker never sees half of it */
+void write_variant(const char* path, const char* data, size_t len)
+{
+    char tmp_path[1100];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror(tmp_path);
+        return;
+    }
+    ssize_t written = write(fd, data, len);
+    close(fd);
+    if (written != (ssize_t) len || rename(tmp_path, path) == -1)
+    {
+        perror(path);
+        unlink(tmp_path);
+    }
+}
+
+/* A variant counts only if it was written after the file it was made from */
+int variant_is_current(const struct stat* variant, const struct stat* source)
+{
+    if (variant->st_mtim.tv_sec != source->st_mtim.tv_sec) return variant->st_mtim.tv_sec > source->st_mtim.tv_sec;
+    return variant->st_mtim.tv_nsec >= source->st_mtim.tv_nsec;
+}
+
+void precompress_file(const char* path, const struct stat* st, long* files_count, long* saved_bytes)
+{
+    char* content = NULL;
+    int done = 0;
+
+    for (int encoding = ENCODING_GZIP; encoding < ENCODINGS_COUNT; encoding++)
+    {
+        char variant_path[1100];
+        struct stat variant_stat;
+        snprintf(variant_path, sizeof(variant_path), "%s%s", path, content_encodings[encoding].file_suffix);
+        if (stat(variant_path, &variant_stat) == 0 && variant_is_current(&variant_stat, st)) continue;
+
+        if (!content)
+        {
+            int fd = open(path, O_RDONLY);
+            if (fd == -1) return;
+            content = malloc(st->st_size);
+            ssize_t n = read(fd, content, st->st_size);
+            close(fd);
+            if (n != st->st_size)
+            {
+                free(content);
+                return;
+            }
+        }
+
+        char* compressed;
+        ssize_t compressed_len = compress_buffer(encoding, content, st->st_size, &compressed);
+        if (compressed_len > 0 && compressed_len < st->st_size - st->st_size / 10)
+        {
+            write_variant(variant_path, compressed, compressed_len);
+            *saved_bytes += st->st_size - compressed_len;
+            done = 1;
+        }
+        else
+        {
+            unlink(variant_path); /* a stale one must not be served */
+        }
+        if (compressed_len > 0) free(compressed);
+    }
+
+    if (done) (*files_count)++;
+    free(content);
+}
+
+void precompress_directory(const char* dir, long* files_count, long* saved_bytes)
+{
+    DIR *d = opendir(dir);
+    if (!d) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (entry->d_name[0] == '.') continue;
+
+        char path[1024];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (stat(path, &st) == -1) continue;
+
+        if (S_ISDIR(st.st_mode))
+            precompress_directory(path, files_count, saved_bytes);
+        else if (S_ISREG(st.st_mode) && st.st_size >= PRECOMPRESS_MIN_SIZE && mime_type_compressible(mime_type_for_path(path)))
+            precompress_file(path, &st, files_count, saved_bytes);
+    }
+    closedir(d);
+}
+
+void build_precompressed_variants(const char* dir)
+{
+    long files_count = 0, saved_bytes = 0;
+    precompress_directory(dir, &files_count, &saved_bytes);
+    if (files_count > 0) printf("Precompressed %ld files, %ld bytes saved across variants\n", files_count, saved_bytes);
+}
+
+/*
+    Picks the precompressed variant to send for a file, filling variant_path and variant_stat.
+    Range requests are always answered from the identity file
+*/
+int pick_precompressed_variant(const char* path, const struct stat* st, char* variant_path, size_t variant_path_size, struct stat* variant_stat)
+{
+    if (!request_headers.accept_encodings || request_headers.range[0]) return ENCODING_IDENTITY;
+
+    for (int encoding = ENCODINGS_COUNT - 1; encoding > ENCODING_IDENTITY; encoding--)
+    {
+        if (!(request_headers.accept_encodings & (1 << encoding))) continue;
+        snprintf(variant_path, variant_path_size, "%s%s", path, content_encodings[encoding].file_suffix);
+        if (stat(variant_path, variant_stat) == 0 && S_ISREG(variant_stat->st_mode) && variant_is_current(variant_stat, st))
+            return encoding;
+    }
+    return ENCODING_IDENTITY;
+}
+
+/*
+    On-the-fly gzip for dynamic pages. Every worker keeps one deflate stream for its whole life and
+    deflateReset()s it per response, so zlib allocates its window once per worker, not per request.
+    The level follows CPU headroom, sampled at most once a second: COMPRESSION_LEVEL_IDLE while most
+    CPUs are free, COMPRESSION_LEVEL_BUSY once they fill up, and no compression at all when more
+    threads want to run than there are CPUs
+*/
+__thread z_stream   dynamic_stream;
+__thread int        dynamic_stream_ready;
+__thread int        dynamic_stream_level;
+__thread time_t     compression_sampled_at;
+__thread int        compression_level;
+
+/* Runnable threads system wide, the "running" half of the 4th field of /proc/loadavg */
+int runnable_threads()
+{
+    char buffer[128];
+    int fd = open("/proc/loadavg", O_RDONLY);
+    if (fd == -1) return 0;
+    ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    buffer[n] = '\0';
+
+    /* skip the three load averages without strtod(), LC_NUMERIC may not use '.' */
+    char *p = buffer;
+    for (int i = 0; i < 3 && p; i++)
+    {
+        p = strchr(p, ' ');
+        if (p) p++;
+    }
+    return p ? atoi(p) : 0;
+}
+
+int current_compression_level()
+{
+    time_t now = time(NULL);
+    if (now != compression_sampled_at)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int others = runnable_threads() - 1; /* the caller is running too */
+
+        if (others * 2 < cpus) compression_level = COMPRESSION_LEVEL_IDLE;
+        else if (others < cpus) compression_level = COMPRESSION_LEVEL_BUSY;
+        else compression_level = 0;
+        compression_sampled_at = now;
+    }
+    return compression_level;
+}
+
+/* Gets the worker's deflate stream ready for a new response at 'level' */
+int prepare_dynamic_stream(int level)
+{
+    if (!dynamic_stream_ready)
+    {
+        memset(&dynamic_stream, 0, sizeof(dynamic_stream));
+        if (deflateInit2(&dynamic_stream, level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+        dynamic_stream_ready = 1;
+        dynamic_stream_level = level;
+        return 0;
+    }
+
+    deflateReset(&dynamic_stream);
+    if (level != dynamic_stream_level)
+    {
+        if (deflateParams(&dynamic_stream, level, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+        dynamic_stream_level = level;
+    }
+    return 0;
+}
+
+void release_dynamic_stream()
+{
+    if (!dynamic_stream_ready) return;
+    deflateEnd(&dynamic_stream);
+    dynamic_stream_ready = 0;
+}
+
+/*
+    200 response for a generated page, gzipped when the client accepts it and the CPUs can afford it.
+    A page that compresses into one COMPRESSION_CHUNK_SIZE chunk goes out with a content-length in a
+    single writev(), bigger ones are streamed a chunk at a time and end with the connection
+*/
+void send_dynamic_response(int client_socket, const struct mime_type* type, const char* body, size_t body_len)
+{
+    const char *vary = "Vary: Accept-Encoding\r\n";
+    const char *gzip_headers = "Vary: Accept-Encoding\r\nContent-Encoding: gzip\r\n";
+    int level = 0;
+
+    if ((request_headers.accept_encodings & (1 << ENCODING_GZIP)) && body_len >= PRECOMPRESS_MIN_SIZE)
+        level = current_compression_level();
+    if (level == 0 || prepare_dynamic_stream(level) == -1)
+    {
+        send_response(client_socket, &status_200, type, vary, strlen(vary), body, body_len);
+        return;
+    }
+
+    char chunk[COMPRESSION_CHUNK_SIZE];
+    dynamic_stream.next_in = (Bytef*) body;
+    dynamic_stream.avail_in = body_len;
+    dynamic_stream.next_out = (Bytef*) chunk;
+    dynamic_stream.avail_out = sizeof(chunk);
+
+    int status = deflate(&dynamic_stream, Z_FINISH);
+    if (status == Z_STREAM_END)
+    {
+        send_response(client_socket, &status_200, type, gzip_headers, strlen(gzip_headers), chunk, sizeof(chunk) - dynamic_stream.avail_out);
+        return;
+    }
+
+    char headers[RESPONSE_HEADERS_MAX_SIZE];
+    int headers_len = build_response_headers(headers, &status_200, type, -1, gzip_headers, strlen(gzip_headers));
+    send(client_socket, headers, headers_len, MSG_MORE);
+    while (status == Z_OK || status == Z_BUF_ERROR)
+    {
+        send_all(client_socket, chunk, sizeof(chunk) - dynamic_stream.avail_out);
+        dynamic_stream.next_out = (Bytef*) chunk;
+        dynamic_stream.avail_out = sizeof(chunk);
+        status = deflate(&dynamic_stream, Z_FINISH);
+        if (status == Z_STREAM_END) send_all(client_socket, chunk, sizeof(chunk) - dynamic_stream.avail_out);
+    }
+}
+
+/*
+    Read the static file and write to client socket using sendfile() system call [zero copy]
+*/
+void transfer_file_contents(char* file_path, int client_socket, off_t file_size)
+{
+    struct file_transfer transfer = { open(file_path, O_RDONLY), 0, file_size };
+    if (transfer.fd == -1) return;
+    int drop_pages = hint_file_transfer(transfer.fd, file_size);
+
+    /* Blocking socket: step until the whole file is out or the client goes away */
+    while (file_transfer_step(&transfer, client_socket, file_size) == TRANSFER_YIELD);
+    if (drop_pages) drop_file_pages(transfer.fd);
+    close(transfer.fd);
+}
+
+/*
+    Sends the HTTP 200 OK header block ahead of a file body. MSG_MORE holds it back
+    so it leaves in the same segment as the start of the file
+*/
+void send_headers(const char* path, off_t len, const struct file_validators* validators, int client_socket)
+{
+    char headers[RESPONSE_HEADERS_MAX_SIZE];
+    int headers_len = build_response_headers(headers, &status_200, mime_type_for_path(path), len,
+                                             validators->lines, validators->lines_len);
+    send(client_socket, headers, headers_len, MSG_MORE);
+}
+
+/*
+    Packed asset bundle, built with "make public.bundle" (see tools/pack_bundle.c and bundle_format.h).
+    When PUBLIC_BUNDLE exists it stands for the whole of public/: a lookup is a hash probe in the mapped index
+    and bodies go out with sendfile() from the bundle's fd at their recorded offset, so serving a file takes
+    no stat() and no open(), and paths missing from the bundle are 404s.
+    SIGHUP maps the bundle again, which swaps a repacked one in between requests
+*/
+struct asset_bundle {
+    int     fd;
+    char    *map;
+    size_t  size;
+};
+
+struct asset_bundle     *asset_bundle;
+volatile sig_atomic_t   bundle_reload_requested;
+
+/* Maps and checks a bundle. Returns NULL if there is none or it can't be used */
+struct asset_bundle* open_asset_bundle(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        if (errno != ENOENT) perror(path);
+        return NULL;
+    }
+
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(struct bundle_header))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED || !bundle_valid(map, st.st_size))
+    {
+        fprintf(stderr, "%s: not a valid bundle of this version, ignored\n", path);
+        if (map != MAP_FAILED) munmap(map, st.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    struct asset_bundle *bundle = calloc(1, sizeof(struct asset_bundle));
+    bundle->fd = fd;
+    bundle->map = map;
+    bundle->size = st.st_size;
+    const struct bundle_header *header = (const struct bundle_header*) map;
+    printf("Asset bundle %s: %u files, %lu bytes\n", path, header->entries_count, header->size);
+    return bundle;
+}
+
+void close_asset_bundle(struct asset_bundle* bundle)
+{
+    munmap(bundle->map, bundle->size);
+    close(bundle->fd);
+    free(bundle);
+}
+
+void sighup_handler(int signo)
+{
+    bundle_reload_requested = 1;
+}
+
+/*
+    Maps the bundle again after SIGHUP. A bundle that was removed sends requests back to public/ on the
+    filesystem, one that can't be used leaves the current bundle in place
+*/
+void reload_asset_bundle()
+{
+    struct asset_bundle *bundle = open_asset_bundle(PUBLIC_BUNDLE);
+    if (!bundle && access(PUBLIC_BUNDLE, F_OK) == 0) return;
+    if (asset_bundle) close_asset_bundle(asset_bundle);
+    asset_bundle = bundle;
+}
+
+/* Bundle to serve the current request from, picking up a pending SIGHUP first */
+const struct asset_bundle* current_asset_bundle()
+{
+    if (bundle_reload_requested)
+    {
+        bundle_reload_requested = 0;
+        reload_asset_bundle();
+    }
+    return asset_bundle;
+}
+
+/* sendfile() straight out of the bundle at the body's offset, the fd stays open for the next request */
+void transfer_bundle_body(int client_socket, int bundle_fd, off_t offset, off_t size)
+{
+    struct file_transfer transfer = { bundle_fd, offset, size };
+
+    /* Blocking socket: step until the whole body is out or the client goes away */
+    while (file_transfer_step(&transfer, client_socket, size) == TRANSFER_YIELD);
+}
+
+/* Answers a GET for a file in the bundle, entirely out of the mapping and the bundle's fd */
+void send_bundle_file(int client_socket, const char* final_path, const struct asset_bundle* bundle, const struct bundle_entry* entry)
+{
+    /* Compressed body when the client takes one, ranges always come from the file itself */
+    int encoding = ENCODING_IDENTITY;
+    if (request_headers.accept_encodings && !request_headers.range[0])
+    {
+        for (int e = ENCODINGS_COUNT - 1; e > ENCODING_IDENTITY && encoding == ENCODING_IDENTITY; e--)
+            if ((request_headers.accept_encodings & (1 << e)) && entry->bodies[e].offset) encoding = e;
+    }
+    const struct bundle_body *body = &entry->bodies[encoding];
+
+    /* Validators as if the file was stat()ed when it was packed, so ETags match the ones public/ gets */
+    struct stat packed;
+    memset(&packed, 0, sizeof(packed));
+    packed.st_ino = entry->ino;
+    packed.st_size = entry->bodies[ENCODING_IDENTITY].size;
+    packed.st_mtim.tv_sec = entry->mtime_sec;
+    packed.st_mtim.tv_nsec = entry->mtime_nsec;
+
+    struct file_validators validators;
+    file_validators_from_stat(&validators, &packed, entry->negotiated);
+    if (encoding != ENCODING_IDENTITY)
+    {
+        struct file_validators identity = validators;
+        file_validators_for_encoding(&validators, &identity, encoding);
+    }
+
+    if (request_not_modified(&validators))
+    {
+        send_not_modified(client_socket, &validators);
+        printf("304 %s (bundle)\n", final_path);
+        return;
+    }
+
+    struct byte_range ranges[RANGE_MAX_RANGES];
+    int ranges_count;
+    int range_status = parse_range_request(body->size, &validators, ranges, &ranges_count);
+    if (range_status == RANGE_NOT_SATISFIABLE)
+    {
+        send_range_not_satisfiable(client_socket, body->size, &validators);
+        printf("416 %s (bundle)\n", final_path);
+        return;
+    }
+    if (range_status == RANGE_SATISFIABLE)
+    {
+        send_ranges(client_socket, final_path, -1, bundle->map + body->offset, body->size, &validators, ranges, ranges_count);
+        printf("206 %s %d range(s) (bundle)\n", final_path, ranges_count);
+        return;
+    }
+
+    send_headers(final_path, body->size, &validators, client_socket);
+    transfer_bundle_body(client_socket, bundle->fd, body->offset, body->size);
+    printf("200 %s %ld bytes (bundle, %s)\n", final_path, (long) body->size, content_encodings[encoding].name);
 }
 
 /*
@@ -508,7 +1987,6 @@ int render_guestbook_template(int client_socket)
         sprintf(guest_entry, "<p class=\"guest-entry\">%s</p>", guest_entries[i]);
         strcat(guest_entries_html, guest_entry);
     }
-    redis_free_array_result(guest_entries, entries_count);
 
     /* In Redis, increment visitor count and fetch latest value */
     int visitor_count;
@@ -544,20 +2022,7 @@ int render_guestbook_template(int client_socket)
     /*
         Template is rendered, Send headers and template over to the client
     */
-    char send_buffer[1024];
-    strcpy(send_buffer, "HTTP/1.0 200 OK\r\n");
-    send(client_socket, send_buffer, strlen(send_buffer), 0);
-    strcpy(send_buffer, SERVER_STRING);
-    send(client_socket, send_buffer, strlen(send_buffer), 0);
-    strcpy(send_buffer, "Content-Type: text/html\r\n");
-    send(client_socket, send_buffer, strlen(send_buffer), 0);
-    sprintf(send_buffer, "content-length: %ld\r\n", strlen(templ));
-    send(client_socket, send_buffer, strlen(send_buffer), 0);
-    strcpy(send_buffer, "\r\n");
-    send(client_socket, send_buffer, strlen(send_buffer), 0);
-
-    // send template
-    send(client_socket, templ, strlen(templ), 0);
+    send_dynamic_response(client_socket, &html_mime_type, templ, strlen(templ));
     printf("200 GET /guestbook %ld bytes\n", strlen(templ));
 }
 
@@ -609,6 +2074,20 @@ void handle_get_method(char* path, int client_socket)
         strcat(final_path, path);
     }
 
+    /* With a bundle, public/ is served from it alone */
+    const struct asset_bundle *bundle = current_asset_bundle();
+    if (bundle)
+    {
+        const struct bundle_entry *entry = bundle_lookup(bundle->map, final_path);
+        if (entry) send_bundle_file(client_socket, final_path, bundle, entry);
+        else
+        {
+            printf("404 Not Found: %s\n", final_path);
+            handle_http_404(client_socket);
+        }
+        return;
+    }
+
     struct stat path_stat;
     if (stat(final_path, &path_stat) == -1)
     {
@@ -620,7 +2099,60 @@ void handle_get_method(char* path, int client_socket)
         /* Check if this is a regular file and not a directory or something else */
         if (S_ISREG(path_stat.st_mode))
         {
-            send_headers(final_path, path_stat.st_size, client_socket);
+            struct file_validators validators;
+            int negotiated = path_stat.st_size >= PRECOMPRESS_MIN_SIZE && mime_type_compressible(mime_type_for_path(final_path));
+            file_validators_from_stat(&validators, &path_stat, negotiated);
+
+            /* Send a precompressed variant instead when the client takes one */
+            char variant_path[1100];
+            struct stat variant_stat;
+            int encoding = ENCODING_IDENTITY;
+            if (negotiated) encoding = pick_precompressed_variant(final_path, &path_stat, variant_path, sizeof(variant_path), &variant_stat);
+            if (encoding != ENCODING_IDENTITY)
+            {
+                struct file_validators identity = validators;
+                file_validators_for_encoding(&validators, &identity, encoding);
+            }
+            if (request_not_modified(&validators))
+            {
+                send_not_modified(client_socket, &validators);
+                printf("304 %s\n", final_path);
+                return;
+            }
+
+            struct byte_range ranges[RANGE_MAX_RANGES];
+            int ranges_count;
+            int range_status = parse_range_request(path_stat.st_size, &validators, ranges, &ranges_count);
+            if (range_status == RANGE_NOT_SATISFIABLE)
+            {
+                send_range_not_satisfiable(client_socket, path_stat.st_size, &validators);
+                printf("416 %s\n", final_path);
+                return;
+            }
+            if (range_status == RANGE_SATISFIABLE)
+            {
+                int fd = open(final_path, O_RDONLY);
+                if (fd == -1)
+                {
+                    handle_http_404(client_socket);
+                    printf("404 Not Found: %s\n", final_path);
+                    return;
+                }
+                send_ranges(client_socket, final_path, fd, NULL, path_stat.st_size, &validators, ranges, ranges_count);
+                close(fd);
+                printf("206 %s %d range(s)\n", final_path, ranges_count);
+                return;
+            }
+
+            if (encoding != ENCODING_IDENTITY)
+            {
+                send_headers(final_path, variant_stat.st_size, &validators, client_socket);
+                transfer_file_contents(variant_path, client_socket, variant_stat.st_size);
+                printf("200 %s %ld bytes (%s)\n", final_path, variant_stat.st_size, content_encodings[encoding].name);
+                return;
+            }
+
+            send_headers(final_path, path_stat.st_size, &validators, client_socket);
             transfer_file_contents(final_path, client_socket, path_stat.st_size);
             printf("200 %s %ld bytes\n", final_path, path_stat.st_size);
         }
@@ -633,104 +2165,203 @@ void handle_get_method(char* path, int client_socket)
 }
 
 /*
-    Guest submits name and remarks via the form on the page.
-    That data is available to us as post x-www-form-urlencoded data.
-    Need to decode and get what we need in plain text.
+    Reads the request body. get_line() never reads past the end of the headers,
+    so the whole body is still waiting in the socket
+*/
+ssize_t read_request_body(int client_socket, char* buf, size_t len)
+{
+    return read(client_socket, buf, len);
+}
 
-    At this point, we have already read the headers and whats left is post data, which forms the body of request
+/*
+    Streaming application/x-www-form-urlencoded parser.
+    The body is read into a single request arena buffer of Content-Length bytes and decoded in place as it
+    arrives: decoding never produces more bytes than it consumes, so the write cursor (out_len) can never pass
+    the read cursor (raw_pos). '=' and '&' are overwritten by the '\0' ending the name or value before them,
+    which leaves fields[] pointing straight into the buffer. A %XX escape split across two reads is
+    carried over in pct_state/pct_char.
 */
-void handle_new_guest_remarks(int client_socket)
+struct form_field {
+    const char  *name;
+    const char  *value;
+};
+
+struct form_data {
+    struct form_field   fields[FORM_MAX_FIELDS];
+    int                 fields_count;
+
+    /* Parser state */
+    char                *buf;
+    size_t              raw_len;        /* bytes received so far */
+    size_t              raw_pos;        /* bytes decoded so far */
+    size_t              out_len;        /* decoded bytes written */
+    size_t              token_start;    /* where the name or value being decoded starts */
+    size_t              name_start;
+    int                 in_value;
+    int                 pct_state;      /* 0: not in an escape, 1: after '%', 2: after '%' and one hex digit */
+    char                pct_char;
+};
+
+void form_end_token(struct form_data* form)
 {
-    char remarks[1024] = "";
-    char name[512] = "";
-    char buffer[4026] = "";
-    char* c1;
-    char* c2;
-    read(client_socket, buffer, sizeof(buffer));
-    /*
-     * Sample data format:
-     * guest-remarks=Relatively+great+service&guest-name=Albert+Einstein
-     * */
+    /* An escape cut short by the end of the token is kept literally */
+    if (form->pct_state >= 1) form->buf[form->out_len++] = '%';
+    if (form->pct_state == 2) form->buf[form->out_len++] = form->pct_char;
+    form->pct_state = 0;
+
+    form->buf[form->out_len++] = '\0';
+    if (!form->in_value)
+    {
+        /* A name without '=', treat it as a field with an empty value */
+        form->name_start = form->token_start;
+        form->token_start = form->out_len - 1;
+    }
+
+    if (form->fields_count < FORM_MAX_FIELDS && form->buf[form->name_start])
+    {
+        form->fields[form->fields_count].name = form->buf + form->name_start;
+        form->fields[form->fields_count].value = form->buf + form->token_start;
+        form->fields_count++;
+    }
+    form->in_value = 0;
+    form->token_start = form->out_len;
+}
+
+/*
+    Decodes everything received but not decoded yet.
+    Plain text and complete escapes go through url_decode_span() in bulk, the byte at a time
+    state machine only deals with separators and escapes split across reads
+*/
+void form_decode_received(struct form_data* form)
+{
+    char *buf = form->buf;
 
-    char* assignment = strtok_r(buffer, "&", &c1);
-    do
+    while (form->raw_pos < form->raw_len)
     {
-        char* subassignment = strtok_r(assignment, "=", &c2);
-        if (!subassignment) break;
-        
-        do
+        if (form->pct_state == 0)
         {
-            if (strcmp(subassignment, "guest-name") == 0)
+            size_t written;
+            form->raw_pos += url_decode_span(buf + form->raw_pos, form->raw_len - form->raw_pos, buf + form->out_len, &written, !form->in_value);
+            form->out_len += written;
+            if (form->raw_pos == form->raw_len) break;
+        }
+
+        char ch = buf[form->raw_pos++];
+
+        if (form->pct_state == 1)
+        {
+            if (hex_values[(unsigned char)ch] >= 0)
             {
-                subassignment = strtok_r(NULL, "=", &c2);
-                if (!subassignment)
-                {
-                    name[0] = '\0';
-                    break;
-                }
-                else
-                {
-                    strcpy(name, subassignment);
-                }
+                form->pct_char = ch;
+                form->pct_state = 2;
+                continue;
             }
-
-            if (strcmp(subassignment, "guest-remarks") == 0)
+            buf[form->out_len++] = '%';
+            form->pct_state = 0;
+        }
+        else if (form->pct_state == 2)
+        {
+            form->pct_state = 0;
+            if (hex_values[(unsigned char)ch] >= 0)
             {
-                subassignment = strtok_r(NULL, "=", &c2);
-                if(!subassignment)
-                {
-                    remarks[0] = '\0';
-                    break;
-                }
-                else
-                {
-                    strcpy(remarks, subassignment);
-                }
+                buf[form->out_len++] = hex_values[(unsigned char)form->pct_char] << 4 | hex_values[(unsigned char)ch];
+                continue;
             }
-            subassignment = strtok_r(NULL, "=", &c2);
-            if (!subassignment) break;
-        } while (1);
+            buf[form->out_len++] = '%';
+            buf[form->out_len++] = form->pct_char;
+        }
+
+        if (ch == '%') form->pct_state = 1;
+        else if (ch == '+') buf[form->out_len++] = ' ';
+        else if (ch == '&') form_end_token(form);
+        else if (ch == '=' && !form->in_value)
+        {
+            buf[form->out_len++] = '\0';
+            form->name_start = form->token_start;
+            form->token_start = form->out_len;
+            form->in_value = 1;
+        }
+        else buf[form->out_len++] = ch;
+    }
+}
 
-        assignment = strtok_r(NULL, "&", &c1);
-        if (!assignment) break;
-    } while (1);
+/* Returns the decoded value of field 'name', or NULL if the form has no such field */
+const char* form_get_field(const struct form_data* form, const char* name)
+{
+    for (int i = 0; i < form->fields_count; i++)
+    {
+        if (strcmp(form->fields[i].name, name) == 0) return form->fields[i].value;
+    }
+    return NULL;
+}
+
+/*
+    Reads a form body of exactly Content-Length bytes, however many reads it takes, and parses it.
+    Bodies that are not form encoded are left unread and give an empty form.
+    Returns 0 on success, 400 or 413 as the HTTP status to fail the request with
+*/
+int read_form_body(int client_socket, struct form_data* form)
+{
+    bzero(form, sizeof(*form));
+    if (!request_headers.form_urlencoded) return 0;
+    if (request_headers.content_length < 0) return 400;
+    if (request_headers.content_length > FORM_MAX_BODY_SIZE) return 413;
+
+    size_t content_length = request_headers.content_length;
+    form->buf = arena_alloc(content_length + 1);
+
+    while (form->raw_len < content_length)
+    {
+        ssize_t n = read_request_body(client_socket, form->buf + form->raw_len, content_length - form->raw_len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return 400; /* client went away or timed out before sending the whole body */
+
+        form->raw_len += n;
+        form_decode_received(form);
+    }
+    if (content_length > 0) form_end_token(form);
+    return 0;
+}
+
+/*
+    Guest submits name and remarks via the form on the page.
+    That data is available to us as post x-www-form-urlencoded data,
+    handle_post_method() has already read and decoded it into 'form'.
+    eg: guest-remarks=Relatively+great+service&guest-name=Albert+Einstein
+*/
+void handle_new_guest_remarks(int client_socket, struct form_data* form)
+{
+    const char *name = form_get_field(form, "guest-name");
+    const char *remarks = form_get_field(form, "guest-remarks");
 
     /* Validate name and remark lenghts and show an error page if required */
-    if(strlen(name) == 0 || strlen(remarks) == 0)
+    if (!name || !remarks || strlen(name) == 0 || strlen(remarks) == 0)
     {
-        char* html = "HTTP/1.0 400 Bad Request\r\ncontent-type: text/html\r\n\r\n<html><title>Error</title><body><p>Error: Do not leave name or remarks empty.</p><p><a href=\"/guestbook\">Go back to Guestbook</a></p></body></html>";
-        write(client_socket, html, strlen(html));
+        const char* html = "<html><title>Error</title><body><p>Error: Do not leave name or remarks empty.</p><p><a href=\"/guestbook\">Go back to Guestbook</a></p></body></html>";
+        send_response(client_socket, &status_400, &html_mime_type, NULL, 0, html, strlen(html));
         printf("400 POST /guestbook\n");
         return;
     }
 
-    /*
-        POST uses form URL encoding. Decode the strings and append them to the Redis
-        list that holds all remarks.
-    */
-   char* decoded_name = urlencoding_decode(name);
-   char* decoded_remarks = urlencoding_decode(remarks);
-   bzero(buffer, sizeof(buffer));
-   sprintf(buffer, "%s - %s", decoded_remarks, decoded_name);
-   redis_list_append(GUESTBOOK_REDIS_REMARKS_KEY, buffer);
-   free(decoded_name);
-   free(decoded_remarks);
+    /* Append the entry to the Redis list that holds all remarks */
+    redis_list_append(GUESTBOOK_REDIS_REMARKS_KEY, arena_sprintf("%s - %s", remarks, name));
 
    /* All good! Show a 'thank you' page. */
-   char *html = "HTTP/1.0 200 OK\r\ncontent-type: text/html\r\n\r\n<html><title>Thank you!</title><body><p>Thank you for leaving feedback! We really appreciate that!</p><p><a href=\"/guestbook\">Go back to Guestbook</a></p></body></html>";
-   write(client_socket, html, strlen(html));
+   const char* html = "<html><title>Thank you!</title><body><p>Thank you for leaving feedback! We really appreciate that!</p><p><a href=\"/guestbook\">Go back to Guestbook</a></p></body></html>";
+   send_response(client_socket, &status_200, &html_mime_type, NULL, 0, html, strlen(html));
    printf("200 POST /guestbook\n");
 }
 
 /*
     This is the routing function for POST calls,
-    Can be extended by adding newer POST methods and its handlers
+    Can be extended by adding newer POST methods and its handlers.
+    Form encoded bodies are already parsed, handlers look fields up with form_get_field()
 */
-int handle_app_post_routes(char* path, int client_socket)
+int handle_app_post_routes(char* path, int client_socket, struct form_data* form)
 {
     if (strcmp(path, GUESTBOOK_ROUTE) == 0)
     {
-        handle_new_guest_remarks(client_socket);
+        handle_new_guest_remarks(client_socket, form);
         return METHOD_HANDLED;
     }
 
@@ -740,13 +2371,25 @@ int handle_app_post_routes(char* path, int client_socket)
 
 void handle_post_method(char* path, int client_socket)
 {
+    struct form_data form;
+    int status = read_form_body(client_socket, &form);
+    if (status != 0)
+    {
+        const char *html = status == 413 ?
+            "<html><title>Error</title><body><p>Error: Request body too large.</p></body></html>" :
+            "<html><title>Error</title><body><p>Error: Incomplete or missing request body.</p></body></html>";
+        send_response(client_socket, status == 413 ? &status_413 : &status_400, &html_mime_type, NULL, 0, html, strlen(html));
+        printf("%d POST %s\n", status, path);
+        return;
+    }
+
     // it can only be for app methods
-    handle_app_post_routes(path, client_socket);
+    handle_app_post_routes(path, client_socket, &form);
 }
 
 void handle_unimplemented_method(int client_socket)
 {
-    send(client_socket, unimplemented_content, strlen(unimplemented_content), 0);
+    send_response(client_socket, &status_400, &html_mime_type, NULL, 0, unimplemented_content, sizeof(unimplemented_content) - 1);
 }
 
 void handle_http_method(char* method_buffer, int client_socket)
@@ -777,6 +2420,7 @@ void handle_client(int client_socket)
     char method_buffer[1024];
     int method_line = 0;
 
+    reset_request_headers();
     while (1)
     {
         get_line(client_socket, line_buffer, sizeof(line_buffer));
@@ -795,10 +2439,12 @@ void handle_client(int client_socket)
         {
             // empty line with "/r/n" => end of request headers
             if (len == 0) break;
+            parse_request_header(line_buffer);
         }
     }
 
     handle_http_method(method_buffer, client_socket);
+    arena_reset();
 }
 
 // accept client connections and calls handle_client() to serve the request
@@ -834,6 +2480,9 @@ void enter_server_loop(int server_socket)
             } 
         */
 
+        /* A SIGHUP is picked up here, so children inherit the new mapping rather than each mapping it again */
+        current_asset_bundle();
+
         int pid = fork();
         if (pid == 0)
         {
@@ -868,6 +2517,9 @@ void print_stats(int signo)
     sys +=  (double) childusage.ru_stime.tv_sec + childusage.ru_stime.tv_usec/1000000.0;
 
     printf("\nuser time = %g, sys time = %g\n", user, sys);
+    struct page_cache_stats *cache = page_cache_stats;
+    printf("page cache: %ld large files sent, %.1f%% of their pages resident beforehand, %ld dropped after sending\n",
+           cache->files, cache->pages ? 100.0 * cache->resident_pages / cache->pages : 0.0, cache->dropped_files);
     exit(0);
 }
 
@@ -910,6 +2562,13 @@ int main(int argc, char* argv[])
 
     // set up the listening socket
     int server_socket = setup_listening_socket(server_port);
+    load_mime_types(MIME_TYPES_FILE);
+    build_precompressed_variants(PRECOMPRESS_DIR);
+    asset_bundle = open_asset_bundle(PUBLIC_BUNDLE);
+    signal(SIGHUP, sighup_handler);
+    /* Children count page cache estimates into it, the parent prints them */
+    page_cache_stats = mmap(NULL, sizeof(struct page_cache_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (page_cache_stats == MAP_FAILED) fatal_error("mmap()");
     setlocale(LC_NUMERIC, "");
     printf("ZeroHTTPd server listening on port %d\n", server_port);
     
@@ -1,5 +1,7 @@
 #define _GNU_SOURCE /* For asprintf() */
 #include <string.h>
+#include <strings.h> // for strncasecmp
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
@@ -8,19 +10,67 @@
 #include <sys/socket.h>
 #include <sys/resource.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <ctype.h> // for tolower
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2/SSSE3 intrinsics for url_decode_span_ssse3()
+#endif
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <limits.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include <time.h>
+
+#include "../mime_types.h" // generated from tools/mime.types
+#include "../bundle_format.h"
+#include <dirent.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
 
 #define SERVER_STRING                   "Server: nitishhttpd/0.1\r\n"
+#define MIME_TYPES_FILE                 "mime.types"
+#define MIME_DEFAULT_HEADER             "Content-Type: application/octet-stream\r\n"
+#define RESPONSE_HEADERS_MAX_SIZE       1024
+#define RANGE_MAX_RANGES                8
+#define SENDFILE_CHUNK_SIZE             (512 * 1024)
+#define PRECOMPRESS_DIR                 "public"
+#define PRECOMPRESS_MIN_SIZE            256
+#define PUBLIC_BUNDLE                   "public.bundle"
+#define COMPRESSION_LEVEL_IDLE          6
+#define COMPRESSION_LEVEL_BUSY          1
+#define COMPRESSION_CHUNK_SIZE          (16 * 1024)
+#define RANGE_BOUNDARY                  "nitishhttpd-byteranges"
 #define DEFAULT_SERVER_PORT             8000
 #define REDIS_SERVER_HOST               "127.0.0.1"
 #define REDIS_SERVER_PORT               6379
 
+/*
+    Page cache hints for file bodies, see hint_file_transfer()
+    READAHEAD_MIN_SIZE -> files from this size on are declared sequential and their first READAHEAD_SIZE bytes
+                          are read ahead before the first sendfile()
+    DONTNEED_MIN_SIZE  -> files from this size on that were not in the page cache before they were sent
+                          are dropped from it afterwards, so a one-off download doesn't push the hot set out
+    Can be changed at build time, eg: make CFLAGS=-DDONTNEED_MIN_SIZE=268435456
+*/
+#ifndef READAHEAD_MIN_SIZE
+#define READAHEAD_MIN_SIZE              (256 * 1024)
+#endif
+#ifndef DONTNEED_MIN_SIZE
+#define DONTNEED_MIN_SIZE               (64 * 1024 * 1024)
+#endif
+#define READAHEAD_SIZE                  (2 * 1024 * 1024)
+
 #define METHOD_HANDLED                  0
 #define METHOD_NOT_HANDLED              1
 
@@ -31,14 +81,138 @@
 #define GUESTBOOK_TMPL_VISITOR          "$VISITOR_COUNT$"
 #define GUESTBOOK_TMPL_REMARKS          "$GUEST_REMARKS$"
 
+#define REQUEST_ARENA_BLOCK_SIZE        (16 * 1024)
+#define FORM_MAX_BODY_SIZE              (64 * 1024)
+#define FORM_MAX_FIELDS                 16
+
 #define PREFORK_CHILDREN                100
 
+/*
+    How children get their connections
+    PREFORK_SHARED_ACCEPT -> every child blocks in accept() on the inherited listening socket and the kernel picks one
+    PREFORK_MASTER_ACCEPT -> the parent accepts and passes each client socket (SCM_RIGHTS) to the child
+                             with the fewest active connections, as seen on a shared scoreboard
+    eg: make preforked-master builds the master accept variant
+*/
+#define PREFORK_SHARED_ACCEPT           0
+#define PREFORK_MASTER_ACCEPT           1
+
+#ifndef PREFORK_MODE
+#define PREFORK_MODE                    PREFORK_SHARED_ACCEPT
+#endif
+
+/*
+    CPU affinity policies applied to every worker when it is created
+    AFFINITY_COMPACT    -> worker i is pinned to the i-th CPU, filling one NUMA node before moving to the next
+    AFFINITY_SCATTER    -> workers are dealt round robin across NUMA nodes, each one pinned to a single CPU
+    AFFINITY_NUMA_LOCAL -> workers are dealt round robin across NUMA nodes and may float between the CPUs of their node
+    Can be changed at build time, eg: make CFLAGS=-DAFFINITY_POLICY=AFFINITY_SCATTER
+*/
+#define AFFINITY_NONE                   0
+#define AFFINITY_COMPACT                1
+#define AFFINITY_SCATTER                2
+#define AFFINITY_NUMA_LOCAL             3
+
+#ifndef AFFINITY_POLICY
+#define AFFINITY_POLICY                 AFFINITY_NUMA_LOCAL
+#endif
+
+/*
+    Page size backing the shared static cache
+    CACHE_PAGES_HUGE    -> explicit huge pages from the hugetlb pool (see /proc/sys/vm/nr_hugepages) when enough are free,
+                           else transparent huge pages through MADV_HUGEPAGE, else regular pages. A cache this size
+                           then needs 32 TLB entries instead of 16384
+    CACHE_PAGES_REGULAR -> always regular pages, to compare against, eg: perf stat -e dTLB-load-misses ./preforked-4k
+*/
+#define CACHE_PAGES_REGULAR             0
+#define CACHE_PAGES_HUGE                1
+
+#ifndef CACHE_PAGES
+#define CACHE_PAGES                     CACHE_PAGES_HUGE
+#endif
+
+#define MAX_NUMA_NODES                  64
+
+/* Files under public/ bigger than this are not cached, STATIC_CACHE_MAX_SIZE is the size of the shared data area */
+#define STATIC_CACHE_MAX_FILE_SIZE      (1024 * 1024)
+#define STATIC_CACHE_MAX_SIZE           (64 * 1024 * 1024)
+#define SHARED_CACHE_SETS               256
+#define SHARED_CACHE_WAYS               8
+#define SHARED_CACHE_MAX_PATH           256
+#define SHARED_CACHE_PAGE_SIZE          4096
+#define SHARED_CACHE_HUGE_PAGE_SIZE     (2 * 1024 * 1024)
+#define SHARED_CACHE_ORDERS             9       /* extents of 4 KiB up to 1 MiB, enough for STATIC_CACHE_MAX_FILE_SIZE */
+#define SHARED_CACHE_STOCK_BYTES        (64 * 1024)    /* kept ready on the free list of each order */
+#define SHARED_CACHE_TICK_MS            100
+#define SHARED_CACHE_REVALIDATE_TICKS   10      /* cached files are stat()ed by the parent once a second */
+#define SHARED_CACHE_POLICY_SIZE        (STATIC_CACHE_MAX_SIZE / 8 * 7)    /* the rest absorbs fragmentation and free list stock */
+#define SHARED_CACHE_WINDOW_PERCENT     1       /* of SHARED_CACHE_POLICY_SIZE, new entries' LRU window */
+#define SHARED_CACHE_PROTECTED_PERCENT  80      /* of the main area, entries hit again while on probation */
+#define SHARED_CACHE_SKETCH_ROWS        4
+#define SHARED_CACHE_SKETCH_WIDTH       4096    /* counters per row, a power of 2 */
+#define SHARED_CACHE_SKETCH_MAX         15
+#define SHARED_CACHE_ACCESS_RING        512     /* accesses a child can report per tick before older ones are lost */
+#define SHARED_CACHE_SEND_TIMEOUT_MS    10000   /* responses from the cache taking longer are aborted, see begin_cached_send() */
+
+/* Cached bodies from ZEROCOPY_MIN_SIZE on are sent with MSG_ZEROCOPY, see send_zerocopy() */
+#define ZEROCOPY_MIN_SIZE               (64 * 1024)
+#define ZEROCOPY_CHUNK_SIZE             (64 * 1024)     /* per send() */
+#define ZEROCOPY_MAX_PENDING            4               /* sends the kernel may hold pages of at once */
+#define ZEROCOPY_PENDING_WAIT_MS        20              /* longer than that for the oldest one and the rest is copied */
+
 static pid_t pids[PREFORK_CHILDREN];
 
-const char *unimplemented_content = \
-        "HTTP/1.0 400 Bad Request\r\n"
-        "Content-type: text/html\r\n"
-        "\r\n"
+/* Scoreboard slot of this child, -1 in the parent */
+static int child_index = -1;
+
+/*
+    Scoreboard shared by parent and children (MAP_SHARED, created before forking).
+    Parent increments active_connections when it passes a client to a child, the child decrements it when done.
+    cache_epoch is how the parent knows which retired cache entries the child might still be reading,
+    accesses is how it learns which files are popular, see drain_cache_accesses().
+    Each slot gets its own cache line so that children updating their counters don't slow each other down
+*/
+struct child_slot {
+    int             active_connections;
+    long            connections_served;
+    unsigned long   cache_epoch;        /* epoch of the shared cache lookup in progress, 0 outside the cache */
+    int             loading_entry;      /* index + 1 of the cache entry the child is claiming or loading, 0 if none */
+    long            cache_hits;
+    long            cache_misses;
+    long            cache_hit_bytes;    /* sizes of the files requested, whether the response was a 200, 206 or 304 */
+    long            cache_miss_bytes;
+    long            zerocopy_responses;
+    long            zerocopy_copied;    /* of those, the ones the kernel copied after all, eg: over loopback */
+    long            zerocopy_fallbacks; /* of those, the ones finished by copying because the client read slowly */
+    long            zerocopy_wait_us;   /* time spent waiting for completions, inside the shared cache */
+    long            cache_send_timeouts;    /* responses from the cache aborted after SHARED_CACHE_SEND_TIMEOUT_MS */
+    unsigned long   accesses_head;      /* written by the child only, after the record */
+    struct cache_access {
+        unsigned int    hash;           /* cache_path_hash() of the path */
+        int             entry;          /* index of the entry it hit, -1 on a miss */
+    } accesses[SHARED_CACHE_ACCESS_RING];
+} __attribute__((aligned(64)));
+
+static struct child_slot *scoreboard;
+
+/* Parent only, set once a child is reaped. Its pid may belong to another process from then on */
+static int exited_children[PREFORK_CHILDREN];
+
+/* Parent only. Whether child 'index' has exited, reaping it the first time it is found gone */
+int child_has_exited(int index)
+{
+    if (!exited_children[index] && waitpid(pids[index], NULL, WNOHANG) == pids[index])
+    {
+        exited_children[index] = 1;
+        printf("Child %d (pid %d) exited\n", index, pids[index]);
+    }
+    return exited_children[index];
+}
+
+/* Parent's ends of the Unix domain socket pairs over which client sockets are passed, one per child */
+static int child_channels[PREFORK_CHILDREN];
+
+const char unimplemented_content[] = \
         "<html>"
         "<head>"
         "<title>ZeroHTTPd: Unimplemented</title>"
@@ -49,10 +223,7 @@ const char *unimplemented_content = \
         "</body>"
         "</html>";
 
-const char *http_404_content = \
-        "HTTP/1.0 404 Not Found\r\n"
-        "Content-type: text/html\r\n"
-        "\r\n"
+const char http_404_content[] = \
         "<html>"
         "<head>"
         "<title>ZeroHTTPd: Not Found</title>"
@@ -66,6 +237,17 @@ const char *http_404_content = \
 char    redis_host_ip[32];
 int     redis_socket_fd;
 
+/*
+    Usable CPUs grouped by NUMA node. CPUs of node n are
+    topology_cpus[node_first_cpu[n]] .. topology_cpus[node_first_cpu[n] + node_cpus_count[n] - 1]
+*/
+int     topology_cpus[CPU_SETSIZE];
+int     topology_cpus_count;
+int     topology_nodes[MAX_NUMA_NODES];
+int     node_first_cpu[MAX_NUMA_NODES];
+int     node_cpus_count[MAX_NUMA_NODES];
+int     topology_nodes_count;
+
 void fatal_error(const char *syscall)
 {
     perror(syscall);
@@ -87,58 +269,675 @@ const char* get_filename_ext(const char* filename)
     return dot + 1;
 }
 
-/* Converts a hex character to its integer value */
-char from_hex(char ch)
+/*
+    Media types from MIME_TYPES_FILE, loaded once at startup. They take precedence over
+    the compiled-in perfect hash in mime_types.h, so a deployment can add or override
+    types without a rebuild. The table is open addressing over mime_hash() and is only
+    read once the server is accepting connections.
+*/
+struct mime_type* loaded_mime_types = NULL;
+unsigned int loaded_mime_types_mask = 0;
+
+const struct mime_type default_mime_type = {
+    "", 0, MIME_DEFAULT_HEADER, sizeof(MIME_DEFAULT_HEADER) - 1
+};
+
+void add_loaded_mime_type(const char* ext, const char* type)
+{
+    int len = strlen(ext);
+    unsigned int slot = mime_hash(ext, len, 0) & loaded_mime_types_mask;
+
+    while (loaded_mime_types[slot].extension)
+    {
+        /* Like mime.types itself, the first type listed for an extension wins */
+        if (strcasecmp(loaded_mime_types[slot].extension, ext) == 0) return;
+        slot = (slot + 1) & loaded_mime_types_mask;
+    }
+
+    struct mime_type* entry = &loaded_mime_types[slot];
+    char* extension = strdup(ext);
+    char* header;
+    strtolower(extension);
+    entry->header_len = asprintf(&header, "Content-Type: %s\r\n", type);
+    entry->header = header;
+    entry->extension_len = len;
+    entry->extension = extension;
+}
+
+/*
+    Walks a mime.types file, calling add_loaded_mime_type() for every extension when
+    insert is set. Returns the number of extensions seen.
+*/
+int read_mime_types_file(FILE* file, int insert)
+{
+    char line[1024];
+    int count = 0;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        char* saveptr;
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char* type = strtok_r(line, " \t\r\n", &saveptr);
+        if (!type) continue;
+
+        char* ext;
+        while ((ext = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL)
+        {
+            if (insert) add_loaded_mime_type(ext, type);
+            count++;
+        }
+    }
+    return count;
+}
+
+void load_mime_types(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) return; /* the compiled-in table is all we need */
+
+    int count = read_mime_types_file(file, 0);
+    if (count > 0)
+    {
+        unsigned int capacity = 1;
+        while (capacity < (unsigned int)count * 2) capacity <<= 1;
+
+        loaded_mime_types = calloc(capacity, sizeof(struct mime_type));
+        if (!loaded_mime_types) fatal_error("calloc()");
+        loaded_mime_types_mask = capacity - 1;
+
+        rewind(file);
+        read_mime_types_file(file, 1);
+        printf("Loaded %d media type extensions from %s\n", count, path);
+    }
+    fclose(file);
+}
+
+/*
+    Media type of a file, by its extension. Unknown types are sent as
+    application/octet-stream.
+*/
+const struct mime_type* mime_type_for_path(const char* path)
+{
+    const char* ext = get_filename_ext(path);
+    int len = strlen(ext);
+
+    if (loaded_mime_types && len > 0)
+    {
+        unsigned int slot = mime_hash(ext, len, 0) & loaded_mime_types_mask;
+        while (loaded_mime_types[slot].extension)
+        {
+            if (loaded_mime_types[slot].extension_len == len && strncasecmp(loaded_mime_types[slot].extension, ext, len) == 0)
+                return &loaded_mime_types[slot];
+            slot = (slot + 1) & loaded_mime_types_mask;
+        }
+    }
+
+    const struct mime_type* type = mime_type_lookup(ext, len);
+    return type ? type : &default_mime_type;
+}
+
+/*
+    Response header block. Status lines, the Server header and content types are
+    prebuilt constants, and the Date header is formatted at most once a second per
+    worker, so building headers is a handful of memcpy() calls.
+*/
+struct header_line {
+    const char* data;
+    int         len;
+};
+
+#define HEADER_LINE(s)                  { s, sizeof(s) - 1 }
+
+const struct header_line status_200 = HEADER_LINE("HTTP/1.0 200 OK\r\n");
+const struct header_line status_206 = HEADER_LINE("HTTP/1.0 206 Partial Content\r\n");
+const struct header_line status_304 = HEADER_LINE("HTTP/1.0 304 Not Modified\r\n");
+const struct header_line status_400 = HEADER_LINE("HTTP/1.0 400 Bad Request\r\n");
+const struct header_line status_404 = HEADER_LINE("HTTP/1.0 404 Not Found\r\n");
+const struct header_line status_413 = HEADER_LINE("HTTP/1.0 413 Payload Too Large\r\n");
+const struct header_line status_416 = HEADER_LINE("HTTP/1.0 416 Range Not Satisfiable\r\n");
+const struct header_line server_header = HEADER_LINE(SERVER_STRING);
+
+const struct mime_type html_mime_type = {
+    "html", 4, "Content-Type: text/html\r\n", sizeof("Content-Type: text/html\r\n") - 1
+};
+
+/*
+    time() is answered from the vDSO without entering the kernel, so checking whether
+    the second changed is cheap. Each worker keeps its own copy and never shares it.
+*/
+struct date_header_cache {
+    time_t  second;
+    int     len;
+    char    header[48];
+};
+
+__thread struct date_header_cache date_header_cache;
+
+const char* date_day_names[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+const char* date_month_names[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/* Formats t as an IMF-fixdate, always in English whatever the locale says */
+int format_http_date(char* buffer, size_t size, time_t t)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return snprintf(buffer, size, "%s, %02d %s %d %02d:%02d:%02d GMT",
+        date_day_names[tm.tm_wday], tm.tm_mday, date_month_names[tm.tm_mon], tm.tm_year + 1900,
+        tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+const struct date_header_cache* current_date_header()
+{
+    time_t now = time(NULL);
+    if (now != date_header_cache.second)
+    {
+        char date[32];
+        format_http_date(date, sizeof(date), now);
+        date_header_cache.len = snprintf(date_header_cache.header, sizeof(date_header_cache.header), "Date: %s\r\n", date);
+        date_header_cache.second = now;
+    }
+    return &date_header_cache;
+}
+
+/*
+    Writes the full header block, including the blank line that ends it, into buffer.
+    extra holds already formatted header lines (eg: validators), type may be NULL and
+    content_length negative for responses without a body.
+    buffer must hold RESPONSE_HEADERS_MAX_SIZE bytes. Returns the block length.
+*/
+int build_response_headers(char* buffer, const struct header_line* status, const struct mime_type* type, off_t content_length,
+                           const char* extra, int extra_len)
+{
+    const struct date_header_cache* date = current_date_header();
+    char digits[24];
+    int digits_len = 0;
+    char* p = buffer;
+
+    memcpy(p, status->data, status->len);
+    p += status->len;
+    memcpy(p, server_header.data, server_header.len);
+    p += server_header.len;
+    memcpy(p, date->header, date->len);
+    p += date->len;
+    memcpy(p, extra, extra_len);
+    p += extra_len;
+
+    if (type)
+    {
+        memcpy(p, type->header, type->header_len);
+        p += type->header_len;
+    }
+
+    if (content_length >= 0)
+    {
+        memcpy(p, "content-length: ", 16);
+        p += 16;
+        do {
+            digits[digits_len++] = '0' + content_length % 10;
+            content_length /= 10;
+        } while (content_length > 0);
+        while (digits_len > 0) *p++ = digits[--digits_len];
+        memcpy(p, "\r\n", 2);
+        p += 2;
+    }
+
+    memcpy(p, "\r\n", 2);
+    p += 2;
+    return p - buffer;
+}
+
+/*
+    Child only. A response sent from the shared cache keeps the child inside it (see shared_cache_enter()) until
+    the last byte is queued, and meanwhile the parent can't free anything retired since: one slow client would
+    hold back the memory every other child is waiting for. So such a send gets SHARED_CACHE_SEND_TIMEOUT_MS.
+    SO_SNDTIMEO stops a blocked send() at the latest then, and the send loops check the deadline between calls,
+    so that a client reading a trickle can't stretch it. send_zerocopy(), which also waits for acknowledgements,
+    bounds those with TCP_USER_TIMEOUT. A response that runs out of time is cut short and its connection reset,
+    see end_cached_send()
+*/
+static struct timespec cached_send_deadline;    /* zero outside a send from the cache */
+
+void begin_cached_send(int client_socket)
+{
+    struct timeval send_timeout = { SHARED_CACHE_SEND_TIMEOUT_MS / 1000, SHARED_CACHE_SEND_TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+
+    clock_gettime(CLOCK_MONOTONIC, &cached_send_deadline);
+    cached_send_deadline.tv_sec += SHARED_CACHE_SEND_TIMEOUT_MS / 1000;
+    cached_send_deadline.tv_nsec += SHARED_CACHE_SEND_TIMEOUT_MS % 1000 * 1000000L;
+    if (cached_send_deadline.tv_nsec >= 1000000000L)
+    {
+        cached_send_deadline.tv_sec++;
+        cached_send_deadline.tv_nsec -= 1000000000L;
+    }
+}
+
+/* Milliseconds left of the send from the cache in progress, 0 once it is out of time. -1 outside one */
+long cached_send_remaining_ms()
+{
+    if (!cached_send_deadline.tv_sec) return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long remaining = (cached_send_deadline.tv_sec - now.tv_sec) * 1000 + (cached_send_deadline.tv_nsec - now.tv_nsec) / 1000000;
+    return remaining > 0 ? remaining : 0;
+}
+
+/*
+    Resets a connection right away: with SO_LINGER {1, 0}, connect() with AF_UNSPEC drops the send queue and
+    sends an RST, yet keeps the descriptor, which the caller closes as usual
+*/
+void reset_connection(int client_socket)
+{
+    struct linger linger = { 1, 0 };
+    struct sockaddr unspec = { .sa_family = AF_UNSPEC };
+    setsockopt(client_socket, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    connect(client_socket, &unspec, sizeof(unspec));
+}
+
+/*
+    A send that timed out left the response cut short, the reset tells the client so instead of letting
+    it wait for the rest. SO_SNDTIMEO stays set on the socket, which is closed after this response
+*/
+void end_cached_send(int client_socket, const char* path)
+{
+    int timed_out = cached_send_remaining_ms() == 0;
+    memset(&cached_send_deadline, 0, sizeof(cached_send_deadline));
+    if (!timed_out) return;
+
+    reset_connection(client_socket);
+    scoreboard[child_index].cache_send_timeouts++;
+    printf("static cache: %s not sent within %d ms, connection reset\n", path, SHARED_CACHE_SEND_TIMEOUT_MS);
+}
+
+/*
+    Sends the header block and a body from memory with a single writev()
+*/
+void send_response(int client_socket, const struct header_line* status, const struct mime_type* type,
+                   const char* extra, int extra_len, const char* body, size_t body_len)
+{
+    char headers[RESPONSE_HEADERS_MAX_SIZE];
+    struct iovec iov[2];
+
+    iov[0].iov_base = headers;
+    iov[0].iov_len = build_response_headers(headers, status, type, body_len, extra, extra_len);
+    iov[1].iov_base = (void*)body;
+    iov[1].iov_len = body_len;
+
+    struct iovec* next = iov;
+    int count = 2;
+    while (count > 0 && cached_send_remaining_ms() != 0)
+    {
+        ssize_t n = writev(client_socket, next, count);
+        if (n <= 0)
+        {
+            if (n == -1 && errno == EINTR) continue;
+            return;
+        }
+        /* short write, skip what already went out */
+        while (count > 0 && (size_t)n >= next->iov_len)
+        {
+            n -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0)
+        {
+            next->iov_base = (char*)next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+}
+
+/*
+    Content codings. Compressible files under public/ get .gz and .br variants generated next to
+    them at startup (see build_precompressed_variants()), and a variant is served in place of the
+    file when the client's Accept-Encoding allows it. Preference goes to the highest index
+*/
+#define ENCODING_IDENTITY               0
+#define ENCODING_GZIP                   1
+#define ENCODING_BROTLI                 2
+#define ENCODINGS_COUNT                 3
+
+struct content_encoding {
+    const char  *name;          /* Accept-Encoding token, also tagged onto the ETag */
+    const char  *file_suffix;   /* the variant of public/x.css is public/x.css<suffix> */
+    const char  *header;        /* Content-Encoding line */
+};
+
+const struct content_encoding content_encodings[ENCODINGS_COUNT] = {
+    { "identity",   "",     "" },
+    { "gzip",       ".gz",  "Content-Encoding: gzip\r\n" },
+    { "br",         ".br",  "Content-Encoding: br\r\n" },
+};
+
+/* Text-like media types are worth compressing, images, archives and media already are compressed */
+int mime_type_compressible(const struct mime_type* type)
+{
+    const char* media = type->header + strlen("Content-Type: ");
+    return strncmp(media, "text/", 5) == 0 || strstr(media, "javascript") || strstr(media, "json")
+        || strstr(media, "xml") || strstr(media, "manifest");
+}
+
+/*
+    Validators for conditional GETs. The ETag is built from the inode, size and
+    modification time, so it changes whenever the file is rewritten or replaced
+*/
+struct file_validators {
+    char    etag[64];           /* quoted, exactly as sent */
+    time_t  last_modified;
+    int     negotiated;         /* the file has compressed variants, responses say Vary: Accept-Encoding */
+    char    lines[256];         /* ETag, Last-Modified, Accept-Ranges, Vary and Content-Encoding header lines */
+    int     lines_len;
+};
+
+void format_validator_lines(struct file_validators* validators, int encoding)
+{
+    char date[32];
+
+    format_http_date(date, sizeof(date), validators->last_modified);
+    validators->lines_len = snprintf(validators->lines, sizeof(validators->lines), "ETag: %s\r\nLast-Modified: %s\r\n%s%s%s",
+                                     validators->etag, date,
+                                     encoding == ENCODING_IDENTITY ? "Accept-Ranges: bytes\r\n" : "",
+                                     validators->negotiated ? "Vary: Accept-Encoding\r\n" : "",
+                                     content_encodings[encoding].header);
+}
+
+void file_validators_from_stat(struct file_validators* validators, const struct stat* st, int negotiated)
+{
+    snprintf(validators->etag, sizeof(validators->etag), "\"%lx-%lx-%lx.%lx\"",
+             (unsigned long) st->st_ino, (unsigned long) st->st_size,
+             (unsigned long) st->st_mtim.tv_sec, (unsigned long) st->st_mtim.tv_nsec);
+    validators->last_modified = st->st_mtim.tv_sec;
+    validators->negotiated = negotiated;
+    format_validator_lines(validators, ENCODING_IDENTITY);
+}
+
+/* Validators of a precompressed variant: the same dates, an ETag of its own and the Content-Encoding line */
+void file_validators_for_encoding(struct file_validators* variant, const struct file_validators* identity, int encoding)
+{
+    *variant = *identity;
+    snprintf(variant->etag, sizeof(variant->etag), "%.*s-%s\"",
+             (int) strlen(identity->etag) - 1, identity->etag, content_encodings[encoding].name);
+    format_validator_lines(variant, encoding);
+}
+
+/* 304 carries the validators but no body, no Content-Type and no content-length */
+void send_not_modified(int client_socket, const struct file_validators* validators)
 {
-    return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+    char headers[RESPONSE_HEADERS_MAX_SIZE];
+    int headers_len = build_response_headers(headers, &status_304, NULL, -1, validators->lines, validators->lines_len);
+    send(client_socket, headers, headers_len, 0);
 }
 
+
 /*
     Sends "HTTP Not Found" code and message to the client
 */
 void handle_http_404(int client_socket)
 {
-    send(client_socket, http_404_content, strlen(http_404_content), 0);
+    send_response(client_socket, &status_404, &html_mime_type, NULL, 0, http_404_content, sizeof(http_404_content) - 1);
+}
+
+/*
+    Per request bump allocator. Everything a request needs while parsing and talking to Redis
+    (decoded form fields, Redis commands, list items) is carved out of the worker's arena and
+    released all at once by arena_reset() after the response is sent.
+    The first block is kept from one request to the next, so a typical request does not call malloc() at all
+    and threads don't contend on glibc's malloc arenas
+*/
+struct arena_block {
+    struct arena_block  *next;
+    size_t              size;
+    size_t              used;
+    char                data[];
+};
+
+__thread struct arena_block *request_arena;
+
+void* arena_alloc(size_t size)
+{
+    size = (size + 15) & ~((size_t)15);
+
+    struct arena_block *block = request_arena;
+    if (!block || block->used + size > block->size)
+    {
+        size_t block_size = size > REQUEST_ARENA_BLOCK_SIZE ? size : REQUEST_ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(struct arena_block) + block_size);
+        if (!block) fatal_error("malloc()");
+        block->size = block_size;
+        block->used = 0;
+        block->next = request_arena;
+        request_arena = block;
+    }
+
+    void *p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+/* Like asprintf(), but the string lives in the request arena */
+char* arena_sprintf(const char* fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    char *str = arena_alloc(len + 1);
+    va_start(args, fmt);
+    vsnprintf(str, len + 1, fmt, args);
+    va_end(args);
+    return str;
+}
+
+/*
+    Called once the response is sent. Frees overflow blocks and keeps the oldest one for the next request,
+    unless it was sized for one big allocation (a form body, a long list item), which would stay allocated
+    for the life of the process
+*/
+void arena_reset()
+{
+    struct arena_block *block = request_arena;
+    if (!block) return;
+
+    while (block->next)
+    {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    if (block->size > REQUEST_ARENA_BLOCK_SIZE)
+    {
+        free(block);
+        block = NULL;
+    }
+    else
+    {
+        block->used = 0;
+    }
+    request_arena = block;
 }
 
+/*
+    Value of every hex digit, -1 for everything else.
+    One table lookup per digit instead of isdigit() and tolower() calls
+*/
+static const signed char hex_values[256] = {
+    [0 ... 255] = -1,
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4, ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
 /*
     HTML URls and other data like data sent over POST method are encoded using a simple schema
-    This functions take encoded data and returns a regular, decoded string
     eg:
     Encoded: Nothing+is+better+than+bread+%26+butter%21
     Decoded: Nothing is better than bread & butter!
+
+    url_decode_span() decodes src[0 .. len) into dst, which may be src itself (decoding never writes ahead of reading).
+    It stops early, without consuming it, at an '&' (and at an '=' too with stop_at_equals), or at a '%' that
+    has less than two characters after it, so that form parsing can split fields and carry an escape over to the
+    next read. An invalid escape like "%zz" is copied literally. Returns bytes consumed, *written gets bytes written.
+
+    Two implementations are picked from at load time (see resolve_url_decode_span()):
+    - scalar: one byte at a time
+    - SSSE3: 16 bytes at a time. Runs without any '%' are copied with a single store, '+' is turned into ' '
+      with a compare and blend, and runs of consecutive escapes (typical of UTF-8 text) are decoded 5 at a time
 */
-char* urlencoding_decode(char* str)
+size_t url_decode_span_scalar(const char* src, size_t len, char* dst, size_t* written, int stop_at_equals)
 {
-    char* pstr = str;
-    char* buf = malloc(strlen(str) + 1);
-    char* pbuf = buf;
+    size_t i = 0, o = 0;
 
-    while (*pstr)
+    while (i < len)
     {
-        if(*pstr == '%')
+        char ch = src[i];
+        if (ch == '&' || (ch == '=' && stop_at_equals)) break;
+
+        if (ch == '%')
         {
-            if(pstr[1] && pstr[2])
+            if (i + 2 >= len) break;
+            int hi = hex_values[(unsigned char)src[i + 1]];
+            int lo = hex_values[(unsigned char)src[i + 2]];
+            if (hi >= 0 && lo >= 0)
             {
-                *pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
-                pstr += 2;
+                dst[o++] = hi << 4 | lo;
+                i += 3;
+                continue;
             }
         }
-        else if (*pstr == '+')
+
+        dst[o++] = ch == '+' ? ' ' : ch;
+        i++;
+    }
+
+    *written = o;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+    Decodes "%XX%XX%XX%XX%XX" at src into 5 bytes at dst. Returns 0, having written nothing,
+    if the 15 bytes are anything else. src must have 16 readable bytes
+*/
+__attribute__((target("ssse3")))
+int decode_5_escapes_ssse3(const char* src, char* dst)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*) src);
+
+    /* '%' at 0, 3, 6, 9 and 12 */
+    if ((_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('%'))) & 0x1249) != 0x1249) return 0;
+
+    /* Gather the 10 digits, in order: hi0 lo0 hi1 lo1 ... */
+    __m128i digits = _mm_shuffle_epi8(v, _mm_setr_epi8(1, 2, 4, 5, 7, 8, 10, 11, 13, 14, -1, -1, -1, -1, -1, -1));
+
+    __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(digits, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(digits, _mm_set1_epi8('9' + 1)));
+    __m128i lower = _mm_or_si128(digits, _mm_set1_epi8(0x20));
+    __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    if ((_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) & 0x3FF) != 0x3FF) return 0;
+
+    /* '0'..'9' -> low nibble as is, 'a'..'f' and 'A'..'F' -> low nibble + 9 */
+    __m128i values = _mm_add_epi8(_mm_and_si128(digits, _mm_set1_epi8(0x0F)), _mm_and_si128(is_alpha, _mm_set1_epi8(9)));
+
+    /* hi * 16 + lo for each pair, then narrow the 16 bit results back to bytes */
+    __m128i pairs = _mm_maddubs_epi16(values, _mm_setr_epi8(16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 0, 0, 0, 0, 0, 0));
+    __m128i bytes = _mm_packus_epi16(pairs, pairs);
+
+    char decoded[16];
+    _mm_storeu_si128((__m128i*) decoded, bytes);
+    memcpy(dst, decoded, 5);
+    return 1;
+}
+
+__attribute__((target("ssse3")))
+size_t url_decode_span_ssse3(const char* src, size_t len, char* dst, size_t* written, int stop_at_equals)
+{
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i plus = _mm_set1_epi8('+');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i ampersand = _mm_set1_epi8('&');
+    /* When '=' is not a stop character, compare against '&' twice instead */
+    const __m128i equals = _mm_set1_epi8(stop_at_equals ? '=' : '&');
+    size_t i = 0, o = 0;
+
+    while (i + 16 <= len)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+
+        __m128i is_plus = _mm_cmpeq_epi8(v, plus);
+        v = _mm_or_si128(_mm_andnot_si128(is_plus, v), _mm_and_si128(is_plus, space));
+
+        int special = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, percent),
+                                        _mm_or_si128(_mm_cmpeq_epi8(v, ampersand), _mm_cmpeq_epi8(v, equals))));
+        if (special == 0)
+        {
+            /* dst never runs ahead of src, so this store only overwrites bytes already loaded */
+            _mm_storeu_si128((__m128i*)(dst + o), v);
+            i += 16;
+            o += 16;
+            continue;
+        }
+
+        /* Copy the plain run in front of the special character, and only that: dst may trail src in place */
+        int run = __builtin_ctz(special);
+        char block[16];
+        _mm_storeu_si128((__m128i*) block, v);
+        memcpy(dst + o, block, run);
+        i += run;
+        o += run;
+
+        if (src[i] != '%') break;   /* a separator */
+
+        while (i + 16 <= len && decode_5_escapes_ssse3(src + i, dst + o))
         {
-            *pbuf++ = ' ';
+            i += 15;
+            o += 5;
         }
-        else
+
+        if (src[i] == '%')
         {
-            *pbuf++ = *pstr;
+            if (i + 2 >= len) break;
+            int hi = hex_values[(unsigned char)src[i + 1]];
+            int lo = hex_values[(unsigned char)src[i + 2]];
+            if (hi >= 0 && lo >= 0)
+            {
+                dst[o++] = hi << 4 | lo;
+                i += 3;
+            }
+            else
+            {
+                dst[o++] = '%';
+                i++;
+            }
         }
-        pstr++;
     }
-    *pbuf = '\0';
 
-    return buf;
+    /* Fewer than 16 bytes left, or stopped at a special character, the scalar code finishes */
+    size_t tail_written;
+    i += url_decode_span_scalar(src + i, len - i, dst + o, &tail_written, stop_at_equals);
+    *written = o + tail_written;
+    return i;
+}
+
+static void* resolve_url_decode_span()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3") ? (void*) url_decode_span_ssse3 : (void*) url_decode_span_scalar;
 }
 
+size_t url_decode_span(const char* src, size_t len, char* dst, size_t* written, int stop_at_equals)
+    __attribute__((ifunc("resolve_url_decode_span")));
+#else
+size_t url_decode_span(const char* src, size_t len, char* dst, size_t* written, int stop_at_equals)
+{
+    return url_decode_span_scalar(src, len, dst, written, stop_at_equals);
+}
+#endif
+
 // create a client socket for redis
 void connect_to_redis_server()
 {
@@ -169,15 +968,9 @@ void connect_to_redis_server()
 */
 int _redis_get_key(const char* key, char* value_buffer, int value_buffer_sz)
 {
-    char *req_buffer;
-    /*
-        asprintf() is a useful GNU extension that allocates the string as required
-        No more guessing the right size for the buffer that holds the string
-        Don't forget to call free() once done
-    */
-   asprintf(&req_buffer, "*2\r\n$3\r\nGET\r\n$%ld\r\n%s\r\n", strlen(key), key);
+    /* The command only lives until the response is read, the request arena is the right home for it */
+    char *req_buffer = arena_sprintf("*2\r\n$3\r\nGET\r\n$%ld\r\n%s\r\n", strlen(key), key);
    write(redis_socket_fd, req_buffer, strlen(req_buffer));
-   free(req_buffer);
    read(redis_socket_fd, value_buffer, value_buffer_sz);
    return 0;
 }
@@ -236,19 +1029,21 @@ int redis_incr(char* key)
     Appends an item pointed to by 'value' to the list in redis referred by 'key'
     Uses the redis RPUSH command
 */
-int redis_list_append(char* key, char* value)
+int redis_list_append(char* key, const char* value)
 {
-    char cmd_buf[1024] = "";
-    sprintf(cmd_buf, "*3\r\n$5\r\nRPUSH\r\n$%ld\r\n%s\r\n$%ld\r\n%s\r\n", strlen(key), key, strlen(value), value);
-    write(redis_socket_fd, cmd_buf, strlen(cmd_buf));
-    bzero(cmd_buf, sizeof(cmd_buf));
-    read(redis_socket_fd, cmd_buf, sizeof(cmd_buf));
+    /* Remarks can be as long as a form body, so the command is sized to fit in the request arena */
+    char *cmd = arena_sprintf("*3\r\n$5\r\nRPUSH\r\n$%ld\r\n%s\r\n$%ld\r\n%s\r\n", strlen(key), key, strlen(value), value);
+    write(redis_socket_fd, cmd, strlen(cmd));
+
+    char reply[64];
+    read(redis_socket_fd, reply, sizeof(reply));
     return 0;
 }
 
 /*
     Get range of items in a list from 'start' to 'end'
-    This function allocates memory. An array of pointers and all strings pointed to by it are dynamically allocated.
+    The array of pointers and all strings pointed to by it are allocated from the request arena,
+    they are valid until the response is sent.
 */
 int redis_list_get_range(char* key, int start, int end, char*** items, int* items_count)
 {
@@ -297,7 +1092,7 @@ int redis_list_get_range(char* key, int start, int end, char*** items, int* item
 
     *items_count = returned_items;
     /* Allocate array that will hold pointer each for every element in the returned list */
-    char** items_holder = malloc(sizeof(char*) * returned_items);
+    char** items_holder = arena_alloc(sizeof(char*) * returned_items);
     *items = items_holder;
 
     /*
@@ -321,7 +1116,7 @@ int redis_list_get_range(char* key, int start, int end, char*** items, int* item
         }
 
         // allocate and read the string
-        char *str = malloc(sizeof(char) * str_size + 1);
+        char *str = arena_alloc(sizeof(char) * str_size + 1);
         items_holder[i] = str;
         read(redis_socket_fd, str, str_size);
         str[str_size] = '\0';
@@ -332,144 +1127,2191 @@ int redis_list_get_range(char* key, int start, int end, char*** items, int* item
     }
 }
 
-/* Free all dynamically allocated string */
-int redis_free_array_result(char** items, int length)
-{
-    for (int i = 0; i < length; i++)
-    {
-        free(items[i]);
+/*
+    Utility function to get the whole list
+*/
+int redis_get_list(char* key, char*** items, int* items_count)
+{
+    return redis_list_get_range(key, 0, -1, items, items_count);
+}
+
+// creates a server socket, defines a socket address
+// bind them together and converts the socket to listening socket
+int setup_listening_socket(int server_port)
+{
+    int sock;
+
+    // describes a socket address
+    struct sockaddr_in srv_addr;
+    bzero(&srv_addr, sizeof(srv_addr));
+    srv_addr.sin_family = AF_INET;
+    srv_addr.sin_port = htons(server_port);
+    srv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    // open an IPv4, TCP connection socket
+    sock = socket(PF_INET, SOCK_STREAM, 0);
+    if (sock == -1) fatal_error("socket()");
+
+    int enable = 1;
+    /*
+        If So_REUSEADDR is not set then if server is stopped and restarted immediately after having served atleast 1 client,
+        it won't bind back on port 8000 since any client connection will go into TIME_WAIT state while the OS waits
+        for any potential leftover data to be transferred. This will prevent quick restarts.
+        Use netstat to check out sockets in this state
+    */
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) fatal_error("setsockopt(SO_REUSEADDR)");
+
+    // we bind this socket to this socket address
+    if (bind(sock, (const struct sockaddr *)&srv_addr, sizeof(srv_addr)) < 0) fatal_error("bind()");
+
+    // turn this socket into a listening socket with queue lenght: no of clients that can wait untill their request is accepted
+    if (listen(sock, 10) < 0) fatal_error("listen()");
+
+    return sock;
+}
+
+/*
+    The few request headers we act on. handle_client() resets them for every request and
+    passes each header line to parse_request_header(), everything else is thrown away as before
+*/
+struct request_headers {
+    long    content_length;         /* -1 when the request has no Content-Length */
+    int     form_urlencoded;        /* Content-Type is application/x-www-form-urlencoded */
+    char    if_none_match[256];     /* raw list of entity tags, empty when absent */
+    time_t  if_modified_since;      /* -1 when absent or unparsable */
+    char    range[256];             /* raw Range value, empty when absent */
+    char    if_range[64];           /* raw If-Range value, empty when absent */
+    int     accept_encodings;       /* 1 << ENCODING_x for every coding Accept-Encoding allows */
+};
+
+__thread struct request_headers request_headers;
+
+void reset_request_headers()
+{
+    request_headers.content_length = -1;
+    request_headers.form_urlencoded = 0;
+    request_headers.if_none_match[0] = '\0';
+    request_headers.if_modified_since = -1;
+    request_headers.range[0] = '\0';
+    request_headers.if_range[0] = '\0';
+    request_headers.accept_encodings = 0;
+}
+
+/* q=0 (or 0.0, 0.000) marks a coding as not acceptable */
+int qvalue_is_zero(const char* q)
+{
+    while (*q == '0' || *q == '.') q++;
+    return *q == '\0' || *q == ',' || *q == ';' || *q == ' ' || *q == '\t';
+}
+
+/* Returns the content codings an Accept-Encoding value allows, as a 1 << ENCODING_x mask */
+int parse_accept_encoding(const char* value)
+{
+    int accepted = 0, refused = 0, wildcard = 0;
+    const char* p = value;
+
+    while (*p)
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char* name = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t name_len = p - name;
+        if (name_len == 0) continue;
+
+        int allowed = 1;
+        while (*p && *p != ',')
+        {
+            if (*p == ';')
+            {
+                p++;
+                while (*p == ' ' || *p == '\t') p++;
+                if ((*p == 'q' || *p == 'Q') && p[1] == '=') allowed = !qvalue_is_zero(p + 2);
+            }
+            else
+            {
+                p++;
+            }
+        }
+
+        if (name_len == 1 && *name == '*')
+        {
+            wildcard = allowed;
+            continue;
+        }
+        for (int encoding = ENCODING_GZIP; encoding < ENCODINGS_COUNT; encoding++)
+        {
+            if (strlen(content_encodings[encoding].name) == name_len && strncasecmp(name, content_encodings[encoding].name, name_len) == 0)
+            {
+                if (allowed) accepted |= 1 << encoding;
+                else refused |= 1 << encoding;
+            }
+        }
+    }
+
+    /* "*" covers every coding that is not named explicitly */
+    if (wildcard) accepted |= ((1 << ENCODINGS_COUNT) - 1) & ~(1 << ENCODING_IDENTITY);
+    return accepted & ~refused;
+}
+
+void parse_request_header(const char* line)
+{
+    const char *colon = strchr(line, ':');
+    if (!colon) return;
+
+    const char *value = colon + 1;
+    while (*value == ' ' || *value == '\t') value++;
+
+    if (strncasecmp(line, "content-length:", 15) == 0)
+    {
+        char *end;
+        long length = strtol(value, &end, 10);
+        if (end != value && length >= 0) request_headers.content_length = length;
+    }
+    else if (strncasecmp(line, "content-type:", 13) == 0)
+    {
+        request_headers.form_urlencoded = strncasecmp(value, "application/x-www-form-urlencoded", 33) == 0;
+    }
+    else if (strncasecmp(line, "if-none-match:", 14) == 0)
+    {
+        snprintf(request_headers.if_none_match, sizeof(request_headers.if_none_match), "%s", value);
+    }
+    else if (strncasecmp(line, "if-modified-since:", 18) == 0)
+    {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm)) request_headers.if_modified_since = timegm(&tm);
+    }
+    else if (strncasecmp(line, "range:", 6) == 0)
+    {
+        snprintf(request_headers.range, sizeof(request_headers.range), "%s", value);
+    }
+    else if (strncasecmp(line, "accept-encoding:", 16) == 0)
+    {
+        request_headers.accept_encodings = parse_accept_encoding(value);
+    }
+    else if (strncasecmp(line, "if-range:", 9) == 0)
+    {
+        snprintf(request_headers.if_range, sizeof(request_headers.if_range), "%s", value);
+    }
+}
+
+/* Checks an If-None-Match list ("*" or comma separated, possibly weak, entity tags) against etag */
+int etag_list_matches(const char* list, const char* etag)
+{
+    size_t etag_len = strlen(etag);
+    const char* p = list;
+
+    while (*p)
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '*') return 1;
+
+        /* weak comparison is what GET revalidation asks for */
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+
+        const char* end;
+        if (*p == '"')
+        {
+            end = strchr(p + 1, '"');
+            end = end ? end + 1 : p + strlen(p);
+        }
+        else
+        {
+            end = p;
+            while (*end && *end != ',' && *end != ' ' && *end != '\t') end++;
+        }
+
+        if ((size_t)(end - p) == etag_len && memcmp(p, etag, etag_len) == 0) return 1;
+        p = end;
+    }
+    return 0;
+}
+
+/*
+    Returns 1 when the client's copy is still current. If-None-Match wins over
+    If-Modified-Since when a request carries both
+*/
+int request_not_modified(const struct file_validators* validators)
+{
+    if (request_headers.if_none_match[0])
+        return etag_list_matches(request_headers.if_none_match, validators->etag);
+    if (request_headers.if_modified_since != -1)
+        return validators->last_modified <= request_headers.if_modified_since;
+    return 0;
+}
+
+/*
+    File body transfers. sendfile() writes less than asked whenever the socket buffer fills up,
+    so a transfer keeps its own offset and is resumed until nothing remains. Every call is capped
+    at SENDFILE_CHUNK_SIZE, and a caller can cap a whole turn with 'budget'
+*/
+#define TRANSFER_DONE                   0
+#define TRANSFER_BLOCKED                1   /* socket buffer is full (EAGAIN), wait until it is writable */
+#define TRANSFER_YIELD                  2   /* budget for this turn is spent */
+#define TRANSFER_ERROR                  -1
+
+struct file_transfer {
+    int     fd;
+    off_t   offset;
+    off_t   remaining;
+};
+
+int file_transfer_step(struct file_transfer* transfer, int client_socket, off_t budget)
+{
+    off_t sent = 0;
+
+    while (transfer->remaining > 0)
+    {
+        if (sent >= budget) return TRANSFER_YIELD;
+
+        off_t chunk = transfer->remaining;
+        if (chunk > SENDFILE_CHUNK_SIZE) chunk = SENDFILE_CHUNK_SIZE;
+        if (chunk > budget - sent) chunk = budget - sent;
+
+        ssize_t n = sendfile(client_socket, transfer->fd, &transfer->offset, chunk);
+        if (n > 0)
+        {
+            transfer->remaining -= n;
+            sent += n;
+        }
+        else if (n == 0)
+        {
+            return TRANSFER_ERROR; /* file got shorter since it was stat()ed */
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return TRANSFER_BLOCKED;
+        }
+        else if (errno != EINTR)
+        {
+            return TRANSFER_ERROR;
+        }
+    }
+    return TRANSFER_DONE;
+}
+
+/*
+    Page cache estimates for the bodies hint_file_transfer() saw, shown by print_stats().
+    Lives in a MAP_SHARED mapping made before the first fork(), every child adds to the same totals
+*/
+struct page_cache_stats {
+    long    files;
+    long    pages;
+    long    resident_pages;         /* of those, the ones mincore() found in the page cache before sending */
+    long    dropped_files;          /* let go with POSIX_FADV_DONTNEED once sent */
+};
+
+struct page_cache_stats     page_cache_totals;
+struct page_cache_stats     *page_cache_stats = &page_cache_totals;
+
+/*
+    Counts the pages of a file that are in the page cache. The file is mapped for mincore() only,
+    the mapping is never touched so nothing is read in. Returns -1 if the file can't be mapped
+*/
+long count_resident_pages(int fd, off_t size)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    long pages = (size + page_size - 1) / page_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return -1;
+
+    unsigned char residency[4096];
+    long resident = 0;
+    for (long page = 0; page < pages; page += sizeof(residency))
+    {
+        long count = pages - page < (long) sizeof(residency) ? pages - page : (long) sizeof(residency);
+        if (mincore(map + page * page_size, count * page_size, residency) == -1) break;
+        for (long i = 0; i < count; i++) resident += residency[i] & 1;
+    }
+    munmap(map, size);
+    return resident;
+}
+
+/*
+    Page cache hints for a body about to be sent with sendfile(). A large file is declared sequential, which
+    doubles the kernel's readahead window for it, and its start is read ahead so the first sendfile() finds it.
+    Returns 1 when the file should be dropped from the page cache once sent, see drop_file_pages()
+*/
+int hint_file_transfer(int fd, off_t size)
+{
+    if (size < READAHEAD_MIN_SIZE) return 0;
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    long pages = (size + page_size - 1) / page_size;
+    long resident = count_resident_pages(fd, size);
+    if (resident != -1)
+    {
+        __atomic_add_fetch(&page_cache_stats->files, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&page_cache_stats->pages, pages, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&page_cache_stats->resident_pages, resident, __ATOMIC_RELAXED);
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    readahead(fd, 0, size < READAHEAD_SIZE ? size : READAHEAD_SIZE);
+
+    /* A file that was mostly cached already is being read by others too, it stays */
+    return size >= DONTNEED_MIN_SIZE && resident != -1 && resident * 2 < pages;
+}
+
+void drop_file_pages(int fd)
+{
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    __atomic_add_fetch(&page_cache_stats->dropped_files, 1, __ATOMIC_RELAXED);
+}
+
+/* Sends length bytes from memory, retrying partial writes. Gives up when a send from the cache runs out of time */
+void send_all(int client_socket, const char* data, size_t length)
+{
+    while (length > 0 && cached_send_remaining_ms() != 0)
+    {
+        ssize_t n = send(client_socket, data, length, 0);
+        if (n > 0)
+        {
+            data += n;
+            length -= n;
+        }
+        else if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+/*
+    Zero copy sends of cached bodies. With MSG_ZEROCOPY the kernel sends straight from the shared cache's pages
+    instead of copying them into the socket buffer, but it holds on to them until the data is acknowledged.
+    Each send() gets a completion notification on the socket's error queue once the kernel lets go, and
+    send_zerocopy() waits for all of them: the caller is still inside the shared cache (see shared_cache_enter()),
+    so the parent can't hand the extent to another file while the NIC may still read it.
+    That wait is not free. Unlike a copy, which returns once the last byte is queued, it lasts until the last
+    byte is acknowledged, and while a child waits the parent can't reclaim any entry retired since it entered.
+    So at most ZEROCOPY_MAX_PENDING sends are left unacknowledged: a reader that keeps the oldest of them
+    pending for ZEROCOPY_PENDING_WAIT_MS gets the rest of the body copied, and only those sends are waited for.
+    That last wait ends with the send's time (see begin_cached_send()): TCP_USER_TIMEOUT aborts a client that
+    stops acknowledging, which releases the pages and delivers the notifications. Should they still not come
+    by the deadline, the connection is reset and the child waits for them anyway, see
+    abort_zerocopy_connection(). Once they are all in, TCP_USER_TIMEOUT is cleared again: what is left in the
+    send queue is a copy, and a client with a full receive window may take its time reading it.
+    The time spent waiting is in the scoreboard.
+    Smaller bodies are copied as before, pinning pages and reading notifications costs more than a short copy
+*/
+
+/* Reads one notification off the error queue. Returns how many send() calls it completes, 0 if none is queued */
+int read_zerocopy_completions(int client_socket, int* copied)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(client_socket, &msg, MSG_ERRQUEUE) == -1) return 0;
+
+    int completed = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+            && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) continue;
+
+        struct sock_extended_err *err = (struct sock_extended_err*) CMSG_DATA(cmsg);
+        if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+        completed += err->ee_data - err->ee_info + 1;   /* notifications cover a range of send() calls */
+        if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) *copied = 1;
+    }
+    return completed;
+}
+
+/*
+    Reads notifications until 'target' sends are completed or timeout_ms goes by without one.
+    A queued notification shows up as POLLERR. Returns 0 on timeout
+*/
+int wait_zerocopy_completions(int client_socket, int* completed, int target, int timeout_ms, int* copied)
+{
+    while (*completed < target)
+    {
+        int done = read_zerocopy_completions(client_socket, copied);
+        *completed += done;
+        if (done > 0) continue;
+
+        struct pollfd pfd = { client_socket, 0, 0 };
+        if (poll(&pfd, 1, timeout_ms) == 0) return 0;
+    }
+    return 1;
+}
+
+/*
+    Last resort when the kernel still holds pages once the send is out of time.
+    The caller must not leave the shared cache while it does: the parent could hand the extent to another file
+    and a retransmission would send that file's bytes. reset_connection() drops the send queue but keeps the
+    descriptor, so the notifications can still be read off the error queue, and with the queue gone they
+    follow as soon as the device lets go of the pages
+*/
+void abort_zerocopy_connection(int client_socket, int* completed, int sends, int* copied)
+{
+    printf("MSG_ZEROCOPY: %d of %d sends not completed, resetting the connection\n", sends - *completed, sends);
+    reset_connection(client_socket);
+
+    /* A reset socket polls as hung up all the time, so the error queue is checked on a timer instead */
+    for (long waited_ms = 0; *completed < sends; waited_ms++)
+    {
+        int done = read_zerocopy_completions(client_socket, copied);
+        *completed += done;
+        if (done > 0) continue;
+
+        if (waited_ms > 0 && waited_ms % SHARED_CACHE_SEND_TIMEOUT_MS == 0)
+            printf("MSG_ZEROCOPY: still waiting for %d sends after the reset\n", sends - *completed);
+        usleep(1000);
+    }
+}
+
+/*
+    Sends a body with MSG_ZEROCOPY and returns once the kernel is done with its pages.
+    Returns 0 without sending anything if the socket can't do zero copy
+*/
+int send_zerocopy(int client_socket, const char* data, size_t length)
+{
+    int one = 1, user_timeout = SHARED_CACHE_SEND_TIMEOUT_MS;
+    if (setsockopt(client_socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) return 0;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+
+    struct timespec start, end;
+    long wait_us = 0;
+    int sends = 0, completed = 0, copied = 0, fallback = 0;
+    while (length > 0 && cached_send_remaining_ms() != 0)
+    {
+        if (sends - completed >= ZEROCOPY_MAX_PENDING)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            int caught_up = wait_zerocopy_completions(client_socket, &completed, sends - ZEROCOPY_MAX_PENDING + 1,
+                                                      ZEROCOPY_PENDING_WAIT_MS, &copied);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            wait_us += (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+            if (!caught_up)
+            {
+                /* Slow reader, copying lets go of the cache as soon as the rest is queued */
+                send_all(client_socket, data, length);
+                fallback = 1;
+                break;
+            }
+        }
+
+        ssize_t n = send(client_socket, data, length < ZEROCOPY_CHUNK_SIZE ? length : ZEROCOPY_CHUNK_SIZE, MSG_ZEROCOPY);
+        if (n > 0)
+        {
+            sends++;
+            data += n;
+            length -= n;
+        }
+        else if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            /* ENOBUFS: the socket is out of option memory for notifications, the rest is copied */
+            if (n == -1 && errno == ENOBUFS) send_all(client_socket, data, length);
+            break;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long remaining_ms = cached_send_remaining_ms();
+    if (remaining_ms == 0 || !wait_zerocopy_completions(client_socket, &completed, sends, remaining_ms, &copied))
+    {
+        abort_zerocopy_connection(client_socket, &completed, sends, &copied);
+    }
+    else
+    {
+        user_timeout = 0;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    wait_us += (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+
+    scoreboard[child_index].zerocopy_responses++;
+    if (copied) scoreboard[child_index].zerocopy_copied++;
+    if (fallback) scoreboard[child_index].zerocopy_fallbacks++;
+    scoreboard[child_index].zerocopy_wait_us += wait_us;
+    return 1;
+}
+
+/* send_response() for bodies that stay where they are until it returns, big ones go out with send_zerocopy() */
+void send_response_zerocopy(int client_socket, const struct header_line* status, const struct mime_type* type,
+                            const char* extra, int extra_len, const char* body, size_t body_len)
+{
+    if (body_len < ZEROCOPY_MIN_SIZE)
+    {
+        send_response(client_socket, status, type, extra, extra_len, body, body_len);
+        return;
+    }
+
+    char headers[RESPONSE_HEADERS_MAX_SIZE];
+    int headers_len = build_response_headers(headers, status, type, body_len, extra, extra_len);
+    send(client_socket, headers, headers_len, MSG_MORE);
+    if (!send_zerocopy(client_socket, body, body_len)) send_all(client_socket, body, body_len);
+}
+
+/*
+    Byte range requests. A Range header that does not parse, asks for too many ranges
+    or fails its If-Range check is ignored and the whole file is sent, as RFC 9110 asks
+*/
+#define RANGE_NONE                      0
+#define RANGE_SATISFIABLE               1
+#define RANGE_NOT_SATISFIABLE           2
+
+struct byte_range {
+    off_t   first;
+    off_t   last;       /* inclusive */
+};
+
+const struct mime_type byteranges_mime_type = {
+    "", 0,
+    "Content-Type: multipart/byteranges; boundary=" RANGE_BOUNDARY "\r\n",
+    sizeof("Content-Type: multipart/byteranges; boundary=" RANGE_BOUNDARY "\r\n") - 1
+};
+
+/* If-Range needs an exact match: a strong ETag or the very same Last-Modified date */
+int if_range_matches(const struct file_validators* validators)
+{
+    const char* value = request_headers.if_range;
+
+    if (!value[0]) return 1;
+    if (value[0] == '"') return strcmp(value, validators->etag) == 0;
+    if (strncmp(value, "W/", 2) == 0) return 0;
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (!strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm)) return 0;
+    return timegm(&tm) == validators->last_modified;
+}
+
+/* Parses one off_t, returns the character after it or NULL if there are no digits */
+const char* parse_range_offset(const char* p, off_t* value)
+{
+    if (*p < '0' || *p > '9') return NULL;
+    *value = 0;
+    while (*p >= '0' && *p <= '9')
+    {
+        if (*value > (LLONG_MAX - 9) / 10) return NULL;
+        *value = *value * 10 + (*p++ - '0');
+    }
+    return p;
+}
+
+/*
+    Turns the request's Range header into at most RANGE_MAX_RANGES satisfiable ranges
+    of a 'size' bytes file. Ranges that start past the end of the file are dropped
+*/
+int parse_range_request(off_t size, const struct file_validators* validators, struct byte_range* ranges, int* ranges_count)
+{
+    const char* p = request_headers.range;
+    int specs = 0;
+
+    *ranges_count = 0;
+    if (!p[0] || strncasecmp(p, "bytes=", 6) != 0) return RANGE_NONE;
+    if (!if_range_matches(validators)) return RANGE_NONE;
+    p += 6;
+
+    while (*p)
+    {
+        off_t first, last;
+
+        while (*p == ' ' || *p == '\t') p++;
+        if (++specs > RANGE_MAX_RANGES) return RANGE_NONE;
+
+        if (*p == '-')
+        {
+            /* suffix range: the last N bytes */
+            off_t suffix;
+            p = parse_range_offset(p + 1, &suffix);
+            if (!p) return RANGE_NONE;
+            first = suffix >= size ? 0 : size - suffix;
+            last = size - 1;
+            if (suffix == 0) first = size;
+        }
+        else
+        {
+            p = parse_range_offset(p, &first);
+            if (!p || *p != '-') return RANGE_NONE;
+            p++;
+            if (*p >= '0' && *p <= '9')
+            {
+                p = parse_range_offset(p, &last);
+                if (!p || last < first) return RANGE_NONE;
+                if (last >= size) last = size - 1;
+            }
+            else
+            {
+                last = size - 1;
+            }
+        }
+
+        if (first < size)
+        {
+            ranges[*ranges_count].first = first;
+            ranges[*ranges_count].last = last;
+            (*ranges_count)++;
+        }
+
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == ',') p++;
+        else if (*p) return RANGE_NONE;
+    }
+
+    if (specs == 0) return RANGE_NONE;
+    return *ranges_count > 0 ? RANGE_SATISFIABLE : RANGE_NOT_SATISFIABLE;
+}
+
+/* Sends length bytes at offset, from memory when content is set, else with sendfile() from fd */
+void send_body_range(int client_socket, int fd, const char* content, off_t offset, off_t length)
+{
+    if (content)
+    {
+        send_all(client_socket, content + offset, length);
+        return;
+    }
+
+    struct file_transfer transfer = { fd, offset, length };
+    while (file_transfer_step(&transfer, client_socket, length) == TRANSFER_YIELD);
+}
+
+void send_range_not_satisfiable(int client_socket, off_t size, const struct file_validators* validators)
+{
+    char headers[RESPONSE_HEADERS_MAX_SIZE];
+    char extra[512];
+    int extra_len = snprintf(extra, sizeof(extra), "%sContent-Range: bytes */%ld\r\n", validators->lines, (long) size);
+    int headers_len = build_response_headers(headers, &status_416, NULL, 0, extra, extra_len);
+    send(client_socket, headers, headers_len, 0);
+}
+
+/*
+    206 Partial Content. A single range goes out as is, several become a
+    multipart/byteranges body where every part carries its own Content-Range
+*/
+void send_ranges(int client_socket, const char* path, int fd, const char* content, off_t size,
+                 const struct file_validators* validators, const struct byte_range* ranges, int ranges_count)
+{
+    char headers[RESPONSE_HEADERS_MAX_SIZE];
+    char extra[512];
+    int extra_len, headers_len;
+    const struct mime_type* type = mime_type_for_path(path);
+
+    if (ranges_count == 1)
+    {
+        off_t length = ranges[0].last - ranges[0].first + 1;
+        extra_len = snprintf(extra, sizeof(extra), "%sContent-Range: bytes %ld-%ld/%ld\r\n", validators->lines,
+                             (long) ranges[0].first, (long) ranges[0].last, (long) size);
+        headers_len = build_response_headers(headers, &status_206, type, length, extra, extra_len);
+        send(client_socket, headers, headers_len, MSG_MORE);
+        send_body_range(client_socket, fd, content, ranges[0].first, length);
+        return;
+    }
+
+    /* Part headers are formatted up front, the total length has to be known for content-length */
+    const char* closing = "\r\n--" RANGE_BOUNDARY "--\r\n";
+    char* part_headers[RANGE_MAX_RANGES];
+    off_t total = strlen(closing);
+    for (int i = 0; i < ranges_count; i++)
+    {
+        part_headers[i] = arena_sprintf("\r\n--" RANGE_BOUNDARY "\r\n%.*sContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                                        type->header_len, type->header,
+                                        (long) ranges[i].first, (long) ranges[i].last, (long) size);
+        total += strlen(part_headers[i]) + ranges[i].last - ranges[i].first + 1;
+    }
+
+    headers_len = build_response_headers(headers, &status_206, &byteranges_mime_type, total, validators->lines, validators->lines_len);
+    send(client_socket, headers, headers_len, MSG_MORE);
+    for (int i = 0; i < ranges_count; i++)
+    {
+        send(client_socket, part_headers[i], strlen(part_headers[i]), MSG_MORE);
+        send_body_range(client_socket, fd, content, ranges[i].first, ranges[i].last - ranges[i].first + 1);
+    }
+    send(client_socket, closing, strlen(closing), 0);
+}
+
+int get_line(int sock, char* buf, int size)
+{
+    int i = 0;
+    char c = '\0';
+    ssize_t n;
+
+    while ((i < size - 1) && (c != '\n'))
+    {
+        // read 1 char byte, should be read in chunks for effeciency
+        n = recv(sock, &c, 1, 0);
+        if (n > 0)
+        {
+            // check for \r\n line boundary as per HTTP protocol
+            if (c == '\r')
+            {
+                n = recv(sock, &c, 1, MSG_PEEK); // only peeks, don't read
+                if ((n > 0) && (c == '\n'))
+                {
+                    recv(sock, &c, 1, 0);
+                }
+            }
+            else
+            {
+                buf[i] = c;
+                i++;
+            }
+        }
+        else
+        {
+            return 0;
+        }
+    }
+    buf[i] = '\0';
+    return i;
+}
+
+/*
+    Precompressed variants. Run once at startup, before any worker exists: every compressible file
+    under 'dir' of at least PRECOMPRESS_MIN_SIZE bytes gets a gzip and a brotli copy at maximum
+    compression, unless an up to date one is already there. Variants that do not save at least
+    a tenth of the size are not kept. Serving them is then a plain sendfile() of another file
+*/
+ssize_t compress_buffer(int encoding, const char* src, size_t len, char** out)
+{
+    if (encoding == ENCODING_GZIP)
+    {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+
+        size_t bound = deflateBound(&zs, len);
+        *out = malloc(bound);
+        zs.next_in = (Bytef*) src;
+        zs.avail_in = len;
+        zs.next_out = (Bytef*) *out;
+        zs.avail_out = bound;
+        int status = deflate(&zs, Z_FINISH);
+        deflateEnd(&zs);
+        if (status != Z_STREAM_END)
+        {
+            free(*out);
+            return -1;
+        }
+        return bound - zs.avail_out;
+    }
+
+    size_t out_len = BrotliEncoderMaxCompressedSize(len);
+    *out = malloc(out_len);
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               len, (const uint8_t*) src, &out_len, (uint8_t*) *out))
+    {
+        free(*out);
+        return -1;
+    }
+    return out_len;
+}
+
+/* Writes a variant through a temporary file and rename(), so a worker never sees half of it */
+void write_variant(const char* path, const char* data, size_t len)
+{
+    char tmp_path[1100];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror(tmp_path);
+        return;
+    }
+    ssize_t written = write(fd, data, len);
+    close(fd);
+    if (written != (ssize_t) len || rename(tmp_path, path) == -1)
+    {
+        perror(path);
+        unlink(tmp_path);
+    }
+}
+
+/* A variant counts only if it was written after the file it was made from */
+int variant_is_current(const struct stat* variant, const struct stat* source)
+{
+    if (variant->st_mtim.tv_sec != source->st_mtim.tv_sec) return variant->st_mtim.tv_sec > source->st_mtim.tv_sec;
+    return variant->st_mtim.tv_nsec >= source->st_mtim.tv_nsec;
+}
+
+void precompress_file(const char* path, const struct stat* st, long* files_count, long* saved_bytes)
+{
+    char* content = NULL;
+    int done = 0;
+
+    for (int encoding = ENCODING_GZIP; encoding < ENCODINGS_COUNT; encoding++)
+    {
+        char variant_path[1100];
+        struct stat variant_stat;
+        snprintf(variant_path, sizeof(variant_path), "%s%s", path, content_encodings[encoding].file_suffix);
+        if (stat(variant_path, &variant_stat) == 0 && variant_is_current(&variant_stat, st)) continue;
+
+        if (!content)
+        {
+            int fd = open(path, O_RDONLY);
+            if (fd == -1) return;
+            content = malloc(st->st_size);
+            ssize_t n = read(fd, content, st->st_size);
+            close(fd);
+            if (n != st->st_size)
+            {
+                free(content);
+                return;
+            }
+        }
+
+        char* compressed;
+        ssize_t compressed_len = compress_buffer(encoding, content, st->st_size, &compressed);
+        if (compressed_len > 0 && compressed_len < st->st_size - st->st_size / 10)
+        {
+            write_variant(variant_path, compressed, compressed_len);
+            *saved_bytes += st->st_size - compressed_len;
+            done = 1;
+        }
+        else
+        {
+            unlink(variant_path); /* a stale one must not be served */
+        }
+        if (compressed_len > 0) free(compressed);
+    }
+
+    if (done) (*files_count)++;
+    free(content);
+}
+
+void precompress_directory(const char* dir, long* files_count, long* saved_bytes)
+{
+    DIR *d = opendir(dir);
+    if (!d) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (entry->d_name[0] == '.') continue;
+
+        char path[1024];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (stat(path, &st) == -1) continue;
+
+        if (S_ISDIR(st.st_mode))
+            precompress_directory(path, files_count, saved_bytes);
+        else if (S_ISREG(st.st_mode) && st.st_size >= PRECOMPRESS_MIN_SIZE && mime_type_compressible(mime_type_for_path(path)))
+            precompress_file(path, &st, files_count, saved_bytes);
+    }
+    closedir(d);
+}
+
+void build_precompressed_variants(const char* dir)
+{
+    long files_count = 0, saved_bytes = 0;
+    precompress_directory(dir, &files_count, &saved_bytes);
+    if (files_count > 0) printf("Precompressed %ld files, %ld bytes saved across variants\n", files_count, saved_bytes);
+}
+
+/*
+    Picks the precompressed variant to send for a file, filling variant_path and variant_stat.
+    Range requests are always answered from the identity file
+*/
+int pick_precompressed_variant(const char* path, const struct stat* st, char* variant_path, size_t variant_path_size, struct stat* variant_stat)
+{
+    if (!request_headers.accept_encodings || request_headers.range[0]) return ENCODING_IDENTITY;
+
+    for (int encoding = ENCODINGS_COUNT - 1; encoding > ENCODING_IDENTITY; encoding--)
+    {
+        if (!(request_headers.accept_encodings & (1 << encoding))) continue;
+        snprintf(variant_path, variant_path_size, "%s%s", path, content_encodings[encoding].file_suffix);
+        if (stat(variant_path, variant_stat) == 0 && S_ISREG(variant_stat->st_mode) && variant_is_current(variant_stat, st))
+            return encoding;
+    }
+    return ENCODING_IDENTITY;
+}
+
+/*
+    On-the-fly gzip for dynamic pages. Every worker keeps one deflate stream for its whole life and
+    deflateReset()s it per response, so zlib allocates its window once per worker, not per request.
+    The level follows CPU headroom, sampled at most once a second: COMPRESSION_LEVEL_IDLE while most
+    CPUs are free, COMPRESSION_LEVEL_BUSY once they fill up, and no compression at all when more
+    threads want to run than there are CPUs
+*/
+__thread z_stream   dynamic_stream;
+__thread int        dynamic_stream_ready;
+__thread int        dynamic_stream_level;
+__thread time_t     compression_sampled_at;
+__thread int        compression_level;
+
+/* Runnable threads system wide, the "running" half of the 4th field of /proc/loadavg */
+int runnable_threads()
+{
+    char buffer[128];
+    int fd = open("/proc/loadavg", O_RDONLY);
+    if (fd == -1) return 0;
+    ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    buffer[n] = '\0';
+
+    /* skip the three load averages without strtod(), LC_NUMERIC may not use '.' */
+    char *p = buffer;
+    for (int i = 0; i < 3 && p; i++)
+    {
+        p = strchr(p, ' ');
+        if (p) p++;
+    }
+    return p ? atoi(p) : 0;
+}
+
+int current_compression_level()
+{
+    time_t now = time(NULL);
+    if (now != compression_sampled_at)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int others = runnable_threads() - 1; /* the caller is running too */
+
+        if (others * 2 < cpus) compression_level = COMPRESSION_LEVEL_IDLE;
+        else if (others < cpus) compression_level = COMPRESSION_LEVEL_BUSY;
+        else compression_level = 0;
+        compression_sampled_at = now;
+    }
+    return compression_level;
+}
+
+/* Gets the worker's deflate stream ready for a new response at 'level' */
+int prepare_dynamic_stream(int level)
+{
+    if (!dynamic_stream_ready)
+    {
+        memset(&dynamic_stream, 0, sizeof(dynamic_stream));
+        if (deflateInit2(&dynamic_stream, level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+        dynamic_stream_ready = 1;
+        dynamic_stream_level = level;
+        return 0;
+    }
+
+    deflateReset(&dynamic_stream);
+    if (level != dynamic_stream_level)
+    {
+        if (deflateParams(&dynamic_stream, level, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+        dynamic_stream_level = level;
+    }
+    return 0;
+}
+
+void release_dynamic_stream()
+{
+    if (!dynamic_stream_ready) return;
+    deflateEnd(&dynamic_stream);
+    dynamic_stream_ready = 0;
+}
+
+/*
+    200 response for a generated page, gzipped when the client accepts it and the CPUs can afford it.
+    A page that compresses into one COMPRESSION_CHUNK_SIZE chunk goes out with a content-length in a
+    single writev(), bigger ones are streamed a chunk at a time and end with the connection
+*/
+void send_dynamic_response(int client_socket, const struct mime_type* type, const char* body, size_t body_len)
+{
+    const char *vary = "Vary: Accept-Encoding\r\n";
+    const char *gzip_headers = "Vary: Accept-Encoding\r\nContent-Encoding: gzip\r\n";
+    int level = 0;
+
+    if ((request_headers.accept_encodings & (1 << ENCODING_GZIP)) && body_len >= PRECOMPRESS_MIN_SIZE)
+        level = current_compression_level();
+    if (level == 0 || prepare_dynamic_stream(level) == -1)
+    {
+        send_response(client_socket, &status_200, type, vary, strlen(vary), body, body_len);
+        return;
+    }
+
+    char chunk[COMPRESSION_CHUNK_SIZE];
+    dynamic_stream.next_in = (Bytef*) body;
+    dynamic_stream.avail_in = body_len;
+    dynamic_stream.next_out = (Bytef*) chunk;
+    dynamic_stream.avail_out = sizeof(chunk);
+
+    int status = deflate(&dynamic_stream, Z_FINISH);
+    if (status == Z_STREAM_END)
+    {
+        send_response(client_socket, &status_200, type, gzip_headers, strlen(gzip_headers), chunk, sizeof(chunk) - dynamic_stream.avail_out);
+        return;
+    }
+
+    char headers[RESPONSE_HEADERS_MAX_SIZE];
+    int headers_len = build_response_headers(headers, &status_200, type, -1, gzip_headers, strlen(gzip_headers));
+    send(client_socket, headers, headers_len, MSG_MORE);
+    while (status == Z_OK || status == Z_BUF_ERROR)
+    {
+        send_all(client_socket, chunk, sizeof(chunk) - dynamic_stream.avail_out);
+        dynamic_stream.next_out = (Bytef*) chunk;
+        dynamic_stream.avail_out = sizeof(chunk);
+        status = deflate(&dynamic_stream, Z_FINISH);
+        if (status == Z_STREAM_END) send_all(client_socket, chunk, sizeof(chunk) - dynamic_stream.avail_out);
+    }
+}
+
+/*
+    Read the static file and write to client socket using sendfile() system call [zero copy]
+*/
+void transfer_file_contents(char* file_path, int client_socket, off_t file_size)
+{
+    struct file_transfer transfer = { open(file_path, O_RDONLY), 0, file_size };
+    if (transfer.fd == -1) return;
+    int drop_pages = hint_file_transfer(transfer.fd, file_size);
+
+    /* Blocking socket: step until the whole file is out or the client goes away */
+    while (file_transfer_step(&transfer, client_socket, file_size) == TRANSFER_YIELD);
+    if (drop_pages) drop_file_pages(transfer.fd);
+    close(transfer.fd);
+}
+
+/*
+    Sends the HTTP 200 OK header block ahead of a file body. MSG_MORE holds it back
+    so it leaves in the same segment as the start of the file
+*/
+void send_headers(const char* path, off_t len, const struct file_validators* validators, int client_socket)
+{
+    char headers[RESPONSE_HEADERS_MAX_SIZE];
+    int headers_len = build_response_headers(headers, &status_200, mime_type_for_path(path), len,
+                                             validators->lines, validators->lines_len);
+    send(client_socket, headers, headers_len, MSG_MORE);
+}
+
+/*
+    Packed asset bundle, built with "make public.bundle" (see tools/pack_bundle.c and bundle_format.h).
+    When PUBLIC_BUNDLE exists it stands for the whole of public/: a lookup is a hash probe in the mapped index
+    and bodies go out with sendfile() from the bundle's fd at their recorded offset, so serving a file takes
+    no stat() and no open(), and paths missing from the bundle are 404s.
+    SIGHUP maps the bundle again, which swaps a repacked one in between requests
+*/
+struct asset_bundle {
+    int     fd;
+    char    *map;
+    size_t  size;
+};
+
+struct asset_bundle     *asset_bundle;
+volatile sig_atomic_t   bundle_reload_requested;
+
+/* Maps and checks a bundle. Returns NULL if there is none or it can't be used */
+struct asset_bundle* open_asset_bundle(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        if (errno != ENOENT) perror(path);
+        return NULL;
+    }
+
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(struct bundle_header))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED || !bundle_valid(map, st.st_size))
+    {
+        fprintf(stderr, "%s: not a valid bundle of this version, ignored\n", path);
+        if (map != MAP_FAILED) munmap(map, st.st_size);
+        close(fd);
+        return NULL;
+    }
+
+    struct asset_bundle *bundle = calloc(1, sizeof(struct asset_bundle));
+    bundle->fd = fd;
+    bundle->map = map;
+    bundle->size = st.st_size;
+    const struct bundle_header *header = (const struct bundle_header*) map;
+    printf("Asset bundle %s: %u files, %lu bytes\n", path, header->entries_count, header->size);
+    return bundle;
+}
+
+void close_asset_bundle(struct asset_bundle* bundle)
+{
+    munmap(bundle->map, bundle->size);
+    close(bundle->fd);
+    free(bundle);
+}
+
+void sighup_handler(int signo)
+{
+    bundle_reload_requested = 1;
+
+    /* The parent serves nothing itself, children each swap their own mapping */
+    if (child_index == -1)
+    {
+        for (int i = 0; i < PREFORK_CHILDREN; i++)
+            if (!exited_children[i]) kill(pids[i], SIGHUP);
+    }
+}
+
+/*
+    Maps the bundle again after SIGHUP. A bundle that was removed sends requests back to public/ on the
+    filesystem, one that can't be used leaves the current bundle in place
+*/
+void reload_asset_bundle()
+{
+    struct asset_bundle *bundle = open_asset_bundle(PUBLIC_BUNDLE);
+    if (!bundle && access(PUBLIC_BUNDLE, F_OK) == 0) return;
+    if (asset_bundle) close_asset_bundle(asset_bundle);
+    asset_bundle = bundle;
+}
+
+/* Bundle to serve the current request from, picking up a pending SIGHUP first */
+const struct asset_bundle* current_asset_bundle()
+{
+    if (bundle_reload_requested)
+    {
+        bundle_reload_requested = 0;
+        reload_asset_bundle();
+    }
+    return asset_bundle;
+}
+
+/* sendfile() straight out of the bundle at the body's offset, the fd stays open for the next request */
+void transfer_bundle_body(int client_socket, int bundle_fd, off_t offset, off_t size)
+{
+    struct file_transfer transfer = { bundle_fd, offset, size };
+
+    /* Blocking socket: step until the whole body is out or the client goes away */
+    while (file_transfer_step(&transfer, client_socket, size) == TRANSFER_YIELD);
+}
+
+/* Answers a GET for a file in the bundle, entirely out of the mapping and the bundle's fd */
+void send_bundle_file(int client_socket, const char* final_path, const struct asset_bundle* bundle, const struct bundle_entry* entry)
+{
+    /* Compressed body when the client takes one, ranges always come from the file itself */
+    int encoding = ENCODING_IDENTITY;
+    if (request_headers.accept_encodings && !request_headers.range[0])
+    {
+        for (int e = ENCODINGS_COUNT - 1; e > ENCODING_IDENTITY && encoding == ENCODING_IDENTITY; e--)
+            if ((request_headers.accept_encodings & (1 << e)) && entry->bodies[e].offset) encoding = e;
+    }
+    const struct bundle_body *body = &entry->bodies[encoding];
+
+    /* Validators as if the file was stat()ed when it was packed, so ETags match the ones public/ gets */
+    struct stat packed;
+    memset(&packed, 0, sizeof(packed));
+    packed.st_ino = entry->ino;
+    packed.st_size = entry->bodies[ENCODING_IDENTITY].size;
+    packed.st_mtim.tv_sec = entry->mtime_sec;
+    packed.st_mtim.tv_nsec = entry->mtime_nsec;
+
+    struct file_validators validators;
+    file_validators_from_stat(&validators, &packed, entry->negotiated);
+    if (encoding != ENCODING_IDENTITY)
+    {
+        struct file_validators identity = validators;
+        file_validators_for_encoding(&validators, &identity, encoding);
+    }
+
+    if (request_not_modified(&validators))
+    {
+        send_not_modified(client_socket, &validators);
+        printf("304 %s (bundle)\n", final_path);
+        return;
+    }
+
+    struct byte_range ranges[RANGE_MAX_RANGES];
+    int ranges_count;
+    int range_status = parse_range_request(body->size, &validators, ranges, &ranges_count);
+    if (range_status == RANGE_NOT_SATISFIABLE)
+    {
+        send_range_not_satisfiable(client_socket, body->size, &validators);
+        printf("416 %s (bundle)\n", final_path);
+        return;
+    }
+    if (range_status == RANGE_SATISFIABLE)
+    {
+        send_ranges(client_socket, final_path, -1, bundle->map + body->offset, body->size, &validators, ranges, ranges_count);
+        printf("206 %s %d range(s) (bundle)\n", final_path, ranges_count);
+        return;
+    }
+
+    send_headers(final_path, body->size, &validators, client_socket);
+    transfer_bundle_body(client_socket, bundle->fd, body->offset, body->size);
+    printf("200 %s %ld bytes (bundle, %s)\n", final_path, (long) body->size, content_encodings[encoding].name);
+}
+
+/*
+    Compiled guestbook template, built by the parent before any child is forked.
+    The segments and the template text live in one anonymous mapping that is made read-only after loading,
+    so fork() leaves its pages shared copy-on-write and 100 children use a single copy
+*/
+#define TMPL_VAR_NONE                   0
+#define TMPL_VAR_REMARKS                1
+#define TMPL_VAR_VISITOR                2
+
+struct template_segment {
+    const char  *text;
+    int         text_len;
+    int         variable;
+};
+
+struct template_cache {
+    struct template_segment *segments;
+    int                     segments_count;
+    void                    *arena;
+    size_t                  arena_size;
+};
+
+static struct template_cache template_cache;
+
+/* Reads the whole file into buf, returns bytes read or -1 */
+ssize_t read_whole_file(const char* path, char* buf, off_t size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    ssize_t total = 0;
+    while (total < size)
+    {
+        ssize_t n = read(fd, buf + total, size - total);
+        if (n <= 0) break;
+        total += n;
+    }
+    close(fd);
+    return total;
+}
+
+/*
+    Splits the template at $GUEST_REMARKS$ and $VISITOR_COUNT$.
+    With segments == NULL it only counts them, so the arena can be sized first
+*/
+int compile_guestbook_template(const char* templ, struct template_segment* segments)
+{
+    int count = 0;
+    const char *p = templ;
+
+    while (1)
+    {
+        const char *remarks = strstr(p, GUESTBOOK_TMPL_REMARKS);
+        const char *visitor = strstr(p, GUESTBOOK_TMPL_VISITOR);
+        const char *next = remarks;
+        int variable = TMPL_VAR_REMARKS;
+        if (!next || (visitor && visitor < next))
+        {
+            next = visitor;
+            variable = TMPL_VAR_VISITOR;
+        }
+
+        if (segments)
+        {
+            segments[count].text = p;
+            segments[count].text_len = next ? next - p : strlen(p);
+            segments[count].variable = next ? variable : TMPL_VAR_NONE;
+        }
+        count++;
+
+        if (!next) return count;
+        p = next + strlen(variable == TMPL_VAR_REMARKS ? GUESTBOOK_TMPL_REMARKS : GUESTBOOK_TMPL_VISITOR);
+    }
+}
+
+#define ARENA_ALIGN(x)                  (((x) + 63) & ~((size_t)63))
+
+/*
+    Loads and compiles the guestbook template into the read-only arena.
+    Must be called before create_child()
+*/
+void build_template_cache()
+{
+    struct stat templ_stat;
+    if (stat(GUESTBOOK_TEMPLATE, &templ_stat) == -1) fatal_error("Template stat()");
+
+    /* Template text has to be in place before it can be compiled, segments are counted on the heap copy */
+    char *templ = malloc(templ_stat.st_size + 1);
+    if (read_whole_file(GUESTBOOK_TEMPLATE, templ, templ_stat.st_size) != templ_stat.st_size) fatal_error("Template read()");
+    templ[templ_stat.st_size] = '\0';
+    int segments_count = compile_guestbook_template(templ, NULL);
+
+    template_cache.arena_size = ARENA_ALIGN(sizeof(struct template_segment) * segments_count)
+                              + ARENA_ALIGN(templ_stat.st_size + 1);
+    template_cache.arena = mmap(NULL, template_cache.arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (template_cache.arena == MAP_FAILED) fatal_error("mmap()");
+
+    char *p = template_cache.arena;
+    template_cache.segments = (struct template_segment*) p;
+    p += ARENA_ALIGN(sizeof(struct template_segment) * segments_count);
+
+    memcpy(p, templ, templ_stat.st_size + 1);
+    free(templ);
+    template_cache.segments_count = compile_guestbook_template(p, template_cache.segments);
+
+    if (mprotect(template_cache.arena, template_cache.arena_size, PROT_READ) == -1) fatal_error("mprotect()");
+}
+
+/*
+    Static file cache shared by all children.
+    One memfd mapping, created by the parent before the first fork() and mapped MAP_SHARED by everyone, holds
+    a header, an index of SHARED_CACHE_SETS sets of SHARED_CACHE_WAYS entries and the file contents.
+    A path can only live in the set its hash picks, so a lookup compares at most SHARED_CACHE_WAYS entries,
+    never follows a chain and never takes a lock:
+    - the first child to miss on a file claims a free way with one CAS (EMPTY -> LOADING), reads the file and
+      its precompressed variants into extents popped off the free lists and publishes the entry (-> READY).
+      From then on every child hits it, so a file is read from disk once for all children, not once per child
+    - the parent does everything else from its tick, see maintain_shared_cache(). It keeps the free lists
+      stocked from its private buddy allocator, stat()s the cached files to retire the ones that changed, and
+      decides which entries stay, see the W-TinyLFU policy below
+    - retired memory is reused only when no child can still be reading it. A child publishes, in its scoreboard
+      slot, the cache epoch it was in when it looked an entry up, and the parent bumps the epoch on every retire.
+      An entry retired in epoch E is freed once every child is either out of the cache or past E
+*/
+#define CACHE_ENTRY_EMPTY               0
+#define CACHE_ENTRY_LOADING             1
+#define CACHE_ENTRY_READY               2
+#define CACHE_ENTRY_RETIRED             3
+
+#define CACHE_ENTRY_TAG(hash, state)    (((unsigned long)(hash) << 32) | (state))
+#define CACHE_ENTRY_STATE(tag)          ((unsigned int)((tag) & 0xffffffff))
+#define CACHE_ENTRY_HASH(tag)           ((unsigned int)((tag) >> 32))
+
+struct shared_cache_body {
+    unsigned int            extent;         /* first page of its extent + 1, 0 when there is no such variant */
+    int                     order;          /* the extent is SHARED_CACHE_PAGE_SIZE << order bytes */
+    off_t                   size;
+    ino_t                   ino;            /* the file it was read from, checked by revalidate_shared_cache() */
+    struct timespec         mtime;
+    struct file_validators  validators;
+};
+
+struct shared_cache_entry {
+    unsigned long               tag;            /* path hash << 32 | CACHE_ENTRY_* state, changed by CAS only */
+    unsigned long               retired_epoch;  /* only meaningful while RETIRED, written by the parent */
+    char                        path[SHARED_CACHE_MAX_PATH];
+    struct shared_cache_body    bodies[ENCODINGS_COUNT];    /* the file itself, then its precompressed variants */
+} __attribute__((aligned(64)));
+
+/*
+    Free lists are Treiber stacks of extents, one per order. The head packs a tag, bumped on every change
+    so that a pop racing with a pop and push of the same extent fails its CAS, with extent + 1 (0 when empty).
+    A free extent holds the next one in its first 4 bytes. The parent pushes, children pop
+*/
+struct shared_cache_header {
+    unsigned long   free_lists[SHARED_CACHE_ORDERS];
+    unsigned int    free_counts[SHARED_CACHE_ORDERS];
+    unsigned long   epoch __attribute__((aligned(64)));
+    unsigned int    wanted_orders;      /* bit per order a child found no free extent of */
+    unsigned int    full_set;           /* set + 1 of the latest set a child found no free way in */
+    unsigned int    full_set_hash;      /* and the path hash it wanted to load there */
+    long            loads;
+};
+
+static struct shared_cache_header   *shared_cache;
+static struct shared_cache_entry    *shared_cache_entries;
+static char                         *shared_cache_data;
+
+unsigned int cache_path_hash(const char* path)
+{
+    unsigned int h = 2166136261u;
+    for (; *path; path++)
+    {
+        h ^= (unsigned char) *path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+char* shared_cache_extent(unsigned int extent)
+{
+    return shared_cache_data + (size_t)(extent - 1) * SHARED_CACHE_PAGE_SIZE;
+}
+
+int shared_cache_order(off_t size)
+{
+    int order = 0;
+    while (order < SHARED_CACHE_ORDERS - 1 && ((off_t) SHARED_CACHE_PAGE_SIZE << order) < size) order++;
+    return order;
+}
+
+void push_free_extent(int order, unsigned int extent)
+{
+    unsigned long head = __atomic_load_n(&shared_cache->free_lists[order], __ATOMIC_ACQUIRE);
+    unsigned long next;
+    do
+    {
+        __atomic_store_n((unsigned int*) shared_cache_extent(extent), (unsigned int) head, __ATOMIC_RELAXED);
+        next = (((head >> 32) + 1) << 32) | extent;
+    } while (!__atomic_compare_exchange_n(&shared_cache->free_lists[order], &head, next, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    __atomic_add_fetch(&shared_cache->free_counts[order], 1, __ATOMIC_RELAXED);
+}
+
+/* Returns a free extent of the given order or 0 */
+unsigned int pop_free_extent(int order)
+{
+    unsigned long head = __atomic_load_n(&shared_cache->free_lists[order], __ATOMIC_ACQUIRE);
+    while ((unsigned int) head)
+    {
+        unsigned int extent = (unsigned int) head;
+        unsigned int next = __atomic_load_n((unsigned int*) shared_cache_extent(extent), __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&shared_cache->free_lists[order], &head, (((head >> 32) + 1) << 32) | next,
+                                        1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        {
+            __atomic_sub_fetch(&shared_cache->free_counts[order], 1, __ATOMIC_RELAXED);
+            return extent;
+        }
+    }
+    return 0;
+}
+
+/*
+    Parent only: buddy allocator over the pages of the data area, the free lists are stocked from it
+    and retired extents go back to it, where they merge with their free buddies again
+*/
+static unsigned char    *buddy_free_order;      /* order + 1 at the first page of a free block, 0 otherwise */
+static int              *buddy_next, *buddy_prev;
+static int              buddy_lists[SHARED_CACHE_ORDERS];
+static int              buddy_pages;
+
+void buddy_list_add(int page, int order)
+{
+    buddy_free_order[page] = order + 1;
+    buddy_prev[page] = -1;
+    buddy_next[page] = buddy_lists[order];
+    if (buddy_lists[order] != -1) buddy_prev[buddy_lists[order]] = page;
+    buddy_lists[order] = page;
+}
+
+void buddy_list_remove(int page, int order)
+{
+    buddy_free_order[page] = 0;
+    if (buddy_prev[page] != -1) buddy_next[buddy_prev[page]] = buddy_next[page];
+    else buddy_lists[order] = buddy_next[page];
+    if (buddy_next[page] != -1) buddy_prev[buddy_next[page]] = buddy_prev[page];
+}
+
+/* Returns the first page of a free block of the given order, splitting a bigger one if needed, or -1 */
+int buddy_alloc(int order)
+{
+    int o = order;
+    while (o < SHARED_CACHE_ORDERS && buddy_lists[o] == -1) o++;
+    if (o == SHARED_CACHE_ORDERS) return -1;
+
+    int page = buddy_lists[o];
+    buddy_list_remove(page, o);
+    while (o > order)
+    {
+        o--;
+        buddy_list_add(page + (1 << o), o);
+    }
+    return page;
+}
+
+void buddy_free(int page, int order)
+{
+    while (order < SHARED_CACHE_ORDERS - 1)
+    {
+        int buddy = page ^ (1 << order);
+        if (buddy >= buddy_pages || buddy_free_order[buddy] != order + 1) break;
+        buddy_list_remove(buddy, order);
+        page &= ~(1 << order);
+        order++;
+    }
+    buddy_list_add(page, order);
+}
+
+/* Parent only, statistics for print_stats() */
+static long shared_cache_evictions, shared_cache_invalidations, shared_cache_rejections;
+
+/*
+    Children bracket every use of the cache with these two. While a child is between them,
+    nothing retired after shared_cache_enter() is freed under it
+*/
+void shared_cache_enter()
+{
+    __atomic_store_n(&scoreboard[child_index].cache_epoch, __atomic_load_n(&shared_cache->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+void shared_cache_leave()
+{
+    __atomic_store_n(&scoreboard[child_index].cache_epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Returns the READY entry for path, or NULL */
+struct shared_cache_entry* shared_cache_find(const char* path, unsigned int hash)
+{
+    struct shared_cache_entry *set = &shared_cache_entries[(hash % SHARED_CACHE_SETS) * SHARED_CACHE_WAYS];
+
+    for (int way = 0; way < SHARED_CACHE_WAYS; way++)
+    {
+        if (__atomic_load_n(&set[way].tag, __ATOMIC_SEQ_CST) == CACHE_ENTRY_TAG(hash, CACHE_ENTRY_READY)
+            && strcmp(set[way].path, path) == 0) return &set[way];
+    }
+    return NULL;
+}
+
+/* Reads one file into a fresh extent. Running out of extents is reported to the parent */
+int load_shared_cache_body(struct shared_cache_body* body, const char* path, const struct stat* st)
+{
+    int order = shared_cache_order(st->st_size);
+    unsigned int extent = pop_free_extent(order);
+    if (!extent)
+    {
+        __atomic_or_fetch(&shared_cache->wanted_orders, 1u << order, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    /* Recorded before the read, a child that dies in it leaves the extent where recover_exited_children() finds it */
+    body->extent = extent;
+    body->order = order;
+    if (read_whole_file(path, shared_cache_extent(extent), st->st_size) != st->st_size)
+    {
+        body->extent = 0;
+        push_free_extent(order, extent);
+        return 0;
+    }
+
+    body->size = st->st_size;
+    body->ino = st->st_ino;
+    body->mtime = st->st_mtim;
+    return 1;
+}
+
+void free_shared_cache_bodies(struct shared_cache_entry* entry, int to_buddy)
+{
+    for (int encoding = 0; encoding < ENCODINGS_COUNT; encoding++)
+    {
+        struct shared_cache_body *body = &entry->bodies[encoding];
+        if (!body->extent) continue;
+        if (to_buddy) buddy_free(body->extent - 1, body->order);
+        else push_free_extent(body->order, body->extent);
+        body->extent = 0;
+    }
+}
+
+/*
+    Loads a file and its current precompressed variants into the cache after a miss.
+    Returns the new entry, or NULL when the file can't be cached right now: not a small enough regular file,
+    no free way in its set or no free extent left, or another child loading the same file at the same time
+*/
+struct shared_cache_entry* load_shared_cache_entry(const char* path, unsigned int hash)
+{
+    struct stat st;
+    if (strlen(path) >= SHARED_CACHE_MAX_PATH) return NULL;
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size > STATIC_CACHE_MAX_FILE_SIZE) return NULL;
+
+    /*
+        The claim is announced in the scoreboard before it is made, so that if this child dies while loading,
+        the parent knows which LOADING entry nobody is going to finish, see recover_exited_children()
+    */
+    int *loading_entry = &scoreboard[child_index].loading_entry;
+    struct shared_cache_entry *set = &shared_cache_entries[(hash % SHARED_CACHE_SETS) * SHARED_CACHE_WAYS];
+    struct shared_cache_entry *entry = NULL;
+    for (int way = 0; way < SHARED_CACHE_WAYS && !entry; way++)
+    {
+        unsigned long empty = CACHE_ENTRY_TAG(0, CACHE_ENTRY_EMPTY);
+        __atomic_store_n(loading_entry, (int) (&set[way] - shared_cache_entries) + 1, __ATOMIC_SEQ_CST);
+        if (__atomic_compare_exchange_n(&set[way].tag, &empty, CACHE_ENTRY_TAG(hash, CACHE_ENTRY_LOADING),
+                                        0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) entry = &set[way];
+    }
+    if (!entry)
+    {
+        __atomic_store_n(loading_entry, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&shared_cache->full_set_hash, hash, __ATOMIC_RELAXED);
+        __atomic_store_n(&shared_cache->full_set, (hash % SHARED_CACHE_SETS) + 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    /*
+        Two children that missed on the same file at the same time can each claim a way. Both claims are
+        sequentially consistent, so at least one of them sees the other here and backs off
+    */
+    for (int way = 0; way < SHARED_CACHE_WAYS; way++)
+    {
+        unsigned long tag = __atomic_load_n(&set[way].tag, __ATOMIC_SEQ_CST);
+        if (&set[way] != entry && CACHE_ENTRY_HASH(tag) == hash
+            && (CACHE_ENTRY_STATE(tag) == CACHE_ENTRY_LOADING || CACHE_ENTRY_STATE(tag) == CACHE_ENTRY_READY))
+        {
+            __atomic_store_n(&entry->tag, CACHE_ENTRY_TAG(0, CACHE_ENTRY_EMPTY), __ATOMIC_RELEASE);
+            __atomic_store_n(loading_entry, 0, __ATOMIC_RELEASE);
+            return NULL;
+        }
+    }
+
+    strcpy(entry->path, path);
+    memset(entry->bodies, 0, sizeof(entry->bodies));
+    if (!load_shared_cache_body(&entry->bodies[ENCODING_IDENTITY], path, &st))
+    {
+        __atomic_store_n(&entry->tag, CACHE_ENTRY_TAG(0, CACHE_ENTRY_EMPTY), __ATOMIC_RELEASE);
+        __atomic_store_n(loading_entry, 0, __ATOMIC_RELEASE);
+        return NULL;
     }
-    free(items);
+
+    struct shared_cache_body *identity = &entry->bodies[ENCODING_IDENTITY];
+    int negotiated = st.st_size >= PRECOMPRESS_MIN_SIZE && mime_type_compressible(mime_type_for_path(path));
+    file_validators_from_stat(&identity->validators, &st, negotiated);
+
+    for (int encoding = ENCODING_GZIP; negotiated && encoding < ENCODINGS_COUNT; encoding++)
+    {
+        char variant_path[SHARED_CACHE_MAX_PATH + 8];
+        struct stat variant_stat;
+        snprintf(variant_path, sizeof(variant_path), "%s%s", path, content_encodings[encoding].file_suffix);
+        if (stat(variant_path, &variant_stat) == -1 || !S_ISREG(variant_stat.st_mode) || !variant_is_current(&variant_stat, &st)
+            || variant_stat.st_size > STATIC_CACHE_MAX_FILE_SIZE) continue;
+        if (load_shared_cache_body(&entry->bodies[encoding], variant_path, &variant_stat))
+            file_validators_for_encoding(&entry->bodies[encoding].validators, &identity->validators, encoding);
+    }
+
+    __atomic_store_n(&entry->tag, CACHE_ENTRY_TAG(hash, CACHE_ENTRY_READY), __ATOMIC_SEQ_CST);
+    __atomic_store_n(loading_entry, 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&shared_cache->loads, 1, __ATOMIC_RELAXED);
+    return entry;
 }
 
 /*
-    Utility function to get the whole list
+    Reports a lookup to the parent, which feeds it to the eviction policy on its next tick.
+    The slot's own cache line is the only thing written, hits on a hot entry don't bounce it between CPUs
 */
-int redis_get_list(char* key, char*** items, int* items_count)
+void record_cache_access(unsigned int hash, int entry)
 {
-    return redis_list_get_range(key, 0, -1, items, items_count);
+    struct child_slot *slot = &scoreboard[child_index];
+    struct cache_access *access = &slot->accesses[slot->accesses_head % SHARED_CACHE_ACCESS_RING];
+    access->hash = hash;
+    access->entry = entry;
+    __atomic_store_n(&slot->accesses_head, slot->accesses_head + 1, __ATOMIC_RELEASE);
 }
 
-// creates a server socket, defines a socket address
-// bind them together and converts the socket to listening socket
-int setup_listening_socket(int server_port)
+/*
+    Returns the cached copy of a file under public/, loading it on a miss, or NULL if it is not cacheable.
+    Must be called between shared_cache_enter() and shared_cache_leave()
+*/
+const struct shared_cache_entry* shared_cache_lookup(const char* path)
 {
-    int sock;
+    unsigned int hash = cache_path_hash(path);
+    struct shared_cache_entry *entry = shared_cache_find(path, hash);
 
-    // describes a socket address
-    struct sockaddr_in srv_addr;
-    bzero(&srv_addr, sizeof(srv_addr));
-    srv_addr.sin_family = AF_INET;
-    srv_addr.sin_port = htons(server_port);
-    srv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (entry)
+    {
+        record_cache_access(hash, entry - shared_cache_entries);
+        scoreboard[child_index].cache_hits++;
+        scoreboard[child_index].cache_hit_bytes += entry->bodies[ENCODING_IDENTITY].size;
+        return entry;
+    }
 
-    // open an IPv4, TCP connection socket
-    sock = socket(PF_INET, SOCK_STREAM, 0);
-    if (sock == -1) fatal_error("socket()");
+    record_cache_access(hash, -1);
+    scoreboard[child_index].cache_misses++;
+    entry = load_shared_cache_entry(path, hash);
+    if (entry) scoreboard[child_index].cache_miss_bytes += entry->bodies[ENCODING_IDENTITY].size;
+    return entry;
+}
 
-    int enable = 1;
-    /*
-        If So_REUSEADDR is not set then if server is stopped and restarted immediately after having served atleast 1 client,
-        it won't bind back on port 8000 since any client connection will go into TIME_WAIT state while the OS waits
-        for any potential leftover data to be transferred. This will prevent quick restarts.
-        Use netstat to check out sockets in this state
-    */
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) fatal_error("setsockopt(SO_REUSEADDR)");
+/*
+    Which entries stay is decided by W-TinyLFU, so that a crawler walking the whole tree once can't push
+    the popular files out:
+    - every lookup, hit or miss, is counted in a count-min sketch of SHARED_CACHE_SKETCH_ROWS rows of 4 bit
+      counters. The counters are halved every 10 lookups per entry, old popularity fades
+    - a new entry lands in a small LRU window. When the window is over its share, its least recently used
+      entry becomes a candidate for the main area. Once the main area is full, the candidate only gets in
+      if the sketch says it is more popular than the main area's next victim, else the candidate is evicted
+    - the main area is a segmented LRU: an entry hit while on probation moves to protected, protected entries
+      beyond their share go back on probation, and victims are taken from probation first
+    Children only report their lookups (child_slot.accesses), the policy itself is parent-private
+*/
+#define CACHE_SEGMENT_NONE              0
+#define CACHE_SEGMENT_WINDOW            1
+#define CACHE_SEGMENT_PROBATION         2
+#define CACHE_SEGMENT_PROTECTED         3
 
-    // we bind this socket to this socket address
-    if (bind(sock, (const struct sockaddr *)&srv_addr, sizeof(srv_addr)) < 0) fatal_error("bind()");
+#define CACHE_WINDOW_SIZE               ((long) SHARED_CACHE_POLICY_SIZE * SHARED_CACHE_WINDOW_PERCENT / 100)
+#define CACHE_MAIN_SIZE                 ((long) SHARED_CACHE_POLICY_SIZE - CACHE_WINDOW_SIZE)
+#define CACHE_PROTECTED_SIZE            (CACHE_MAIN_SIZE * SHARED_CACHE_PROTECTED_PERCENT / 100)
 
-    // turn this socket into a listening socket with queue lenght: no of clients that can wait untill their request is accepted
-    if (listen(sock, 10) < 0) fatal_error("listen()");
+struct cache_policy {
+    unsigned int    hash;
+    int             segment;            /* CACHE_SEGMENT_*, NONE unless the entry is READY */
+    long            bytes;              /* of cache memory, the extents of all of its bodies */
+    unsigned long   last_access;        /* policy_clock of its latest hit, LRU order within a segment */
+};
 
-    return sock;
+static struct cache_policy  cache_policies[SHARED_CACHE_SETS * SHARED_CACHE_WAYS];
+static long                 segment_bytes[4];
+static unsigned long        policy_clock;
+static unsigned long        accesses_tails[PREFORK_CHILDREN];
+static unsigned char        cache_sketch[SHARED_CACHE_SKETCH_ROWS][SHARED_CACHE_SKETCH_WIDTH];
+static long                 sketch_samples;
+
+static const unsigned int sketch_seeds[SHARED_CACHE_SKETCH_ROWS] = { 0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu };
+
+unsigned int sketch_slot(unsigned int hash, int row)
+{
+    return ((hash * sketch_seeds[row]) >> 16) & (SHARED_CACHE_SKETCH_WIDTH - 1);
 }
 
-int get_line(int sock, char* buf, int size)
+void sketch_increment(unsigned int hash)
 {
-    int i = 0;
-    char c = '\0';
-    ssize_t n;
+    for (int row = 0; row < SHARED_CACHE_SKETCH_ROWS; row++)
+    {
+        unsigned char *counter = &cache_sketch[row][sketch_slot(hash, row)];
+        if (*counter < SHARED_CACHE_SKETCH_MAX) (*counter)++;
+    }
 
-    while ((i < size - 1) && (c != '\n'))
+    if (++sketch_samples >= 10L * SHARED_CACHE_SETS * SHARED_CACHE_WAYS)
     {
-        // read 1 char byte, should be read in chunks for effeciency
-        n = recv(sock, &c, 1, 0);
-        if (n > 0)
+        for (int row = 0; row < SHARED_CACHE_SKETCH_ROWS; row++)
+            for (int i = 0; i < SHARED_CACHE_SKETCH_WIDTH; i++) cache_sketch[row][i] >>= 1;
+        sketch_samples /= 2;
+    }
+}
+
+/* Estimated recent lookups of a path, never below the real count (up to SHARED_CACHE_SKETCH_MAX) */
+int sketch_frequency(unsigned int hash)
+{
+    int frequency = SHARED_CACHE_SKETCH_MAX;
+    for (int row = 0; row < SHARED_CACHE_SKETCH_ROWS; row++)
+    {
+        int counter = cache_sketch[row][sketch_slot(hash, row)];
+        if (counter < frequency) frequency = counter;
+    }
+    return frequency;
+}
+
+void policy_move(int index, int segment)
+{
+    struct cache_policy *policy = &cache_policies[index];
+    if (policy->segment != CACHE_SEGMENT_NONE) segment_bytes[policy->segment] -= policy->bytes;
+    if (segment != CACHE_SEGMENT_NONE) segment_bytes[segment] += policy->bytes;
+    policy->segment = segment;
+}
+
+/* Least recently used entry of a segment other than except, -1 if there is none */
+int policy_lru(int segment, int except)
+{
+    int lru = -1;
+    for (int i = 0; i < SHARED_CACHE_SETS * SHARED_CACHE_WAYS; i++)
+    {
+        if (cache_policies[i].segment != segment || i == except) continue;
+        if (lru == -1 || cache_policies[i].last_access < cache_policies[lru].last_access) lru = i;
+    }
+    return lru;
+}
+
+/* Parent only. Takes a READY entry out of lookups, its memory is freed by release_retired_entries() */
+void retire_shared_cache_entry(struct shared_cache_entry* entry)
+{
+    unsigned long tag = __atomic_load_n(&entry->tag, __ATOMIC_SEQ_CST);
+    if (CACHE_ENTRY_STATE(tag) != CACHE_ENTRY_READY) return;
+    if (!__atomic_compare_exchange_n(&entry->tag, &tag, CACHE_ENTRY_TAG(CACHE_ENTRY_HASH(tag), CACHE_ENTRY_RETIRED),
+                                     0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return;
+    policy_move(entry - shared_cache_entries, CACHE_SEGMENT_NONE);
+
+    /* A child that found the entry READY published an epoch <= retired_epoch, later ones see it RETIRED */
+    entry->retired_epoch = __atomic_fetch_add(&shared_cache->epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+    Parent only. Cleans up after children that died: one that died inside the cache would hold back
+    release_retired_entries() forever, and an entry it was loading would stay LOADING, its way lost.
+    The entry is only taken back when no live child announced a claim on it too: that child may be the one
+    that got it, the dead child's claim waits for a later tick then
+*/
+void recover_exited_children()
+{
+    for (int i = 0; i < PREFORK_CHILDREN; i++)
+    {
+        if (!child_has_exited(i)) continue;
+        __atomic_store_n(&scoreboard[i].cache_epoch, 0, __ATOMIC_RELEASE);
+
+        int claimed = __atomic_load_n(&scoreboard[i].loading_entry, __ATOMIC_ACQUIRE);
+        if (!claimed) continue;
+
+        int contended = 0;
+        for (int j = 0; j < PREFORK_CHILDREN; j++)
+            if (j != i && !child_has_exited(j) && __atomic_load_n(&scoreboard[j].loading_entry, __ATOMIC_ACQUIRE) == claimed)
+                contended = 1;
+        if (contended) continue;
+
+        struct shared_cache_entry *entry = &shared_cache_entries[claimed - 1];
+        if (CACHE_ENTRY_STATE(__atomic_load_n(&entry->tag, __ATOMIC_ACQUIRE)) == CACHE_ENTRY_LOADING)
         {
-            // check for \r\n line boundary as per HTTP protocol
-            if (c == '\r')
+            free_shared_cache_bodies(entry, 1);
+            __atomic_store_n(&entry->tag, CACHE_ENTRY_TAG(0, CACHE_ENTRY_EMPTY), __ATOMIC_RELEASE);
+            printf("static cache: took back the entry child %d died loading\n", i);
+        }
+        scoreboard[i].loading_entry = 0;
+    }
+}
+
+/* Bytes of cache memory an entry's bodies take */
+long shared_cache_entry_bytes(const struct shared_cache_entry* entry)
+{
+    long bytes = 0;
+    for (int encoding = 0; encoding < ENCODINGS_COUNT; encoding++)
+        if (entry->bodies[encoding].extent) bytes += (long) SHARED_CACHE_PAGE_SIZE << entry->bodies[encoding].order;
+    return bytes;
+}
+
+/*
+    Parent only. Frees retired entries that no child in the cache can still be reading.
+    Returns the bytes of those that have to wait for a later tick
+*/
+long release_retired_entries()
+{
+    long pending = 0;
+    unsigned long oldest = ULONG_MAX;
+    for (int i = 0; i < PREFORK_CHILDREN; i++)
+    {
+        unsigned long epoch = __atomic_load_n(&scoreboard[i].cache_epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < oldest) oldest = epoch;
+    }
+
+    for (int i = 0; i < SHARED_CACHE_SETS * SHARED_CACHE_WAYS; i++)
+    {
+        struct shared_cache_entry *entry = &shared_cache_entries[i];
+        if (CACHE_ENTRY_STATE(__atomic_load_n(&entry->tag, __ATOMIC_ACQUIRE)) != CACHE_ENTRY_RETIRED) continue;
+        if (entry->retired_epoch >= oldest)
+        {
+            pending += shared_cache_entry_bytes(entry);
+            continue;
+        }
+
+        free_shared_cache_bodies(entry, 1);
+        __atomic_store_n(&entry->tag, CACHE_ENTRY_TAG(0, CACHE_ENTRY_EMPTY), __ATOMIC_RELEASE);
+    }
+    return pending;
+}
+
+/* Parent only. Retires an entry to make room, returns the bytes of cache memory that will be freed */
+long evict_shared_cache_entry(int index)
+{
+    long bytes = cache_policies[index].bytes;
+    retire_shared_cache_entry(&shared_cache_entries[index]);
+    shared_cache_evictions++;
+    return bytes;
+}
+
+/*
+    The entry the policy values least: probation's least recently used one, else the window's, which has
+    not proven itself yet either, and only then protected's
+*/
+int shared_cache_victim()
+{
+    int victim = policy_lru(CACHE_SEGMENT_PROBATION, -1);
+    if (victim == -1) victim = policy_lru(CACHE_SEGMENT_WINDOW, -1);
+    if (victim == -1) victim = policy_lru(CACHE_SEGMENT_PROTECTED, -1);
+    return victim;
+}
+
+/* Parent only. Puts entries children loaded since the last tick at the head of the window */
+void register_loaded_entries()
+{
+    for (int i = 0; i < SHARED_CACHE_SETS * SHARED_CACHE_WAYS; i++)
+    {
+        struct shared_cache_entry *entry = &shared_cache_entries[i];
+        unsigned long tag = __atomic_load_n(&entry->tag, __ATOMIC_ACQUIRE);
+        if (CACHE_ENTRY_STATE(tag) != CACHE_ENTRY_READY || cache_policies[i].segment != CACHE_SEGMENT_NONE) continue;
+
+        struct cache_policy *policy = &cache_policies[i];
+        policy->hash = CACHE_ENTRY_HASH(tag);
+        policy->bytes = shared_cache_entry_bytes(entry);
+        policy->last_access = ++policy_clock;
+        policy_move(i, CACHE_SEGMENT_WINDOW);
+    }
+}
+
+/*
+    Parent only. Feeds the lookups children reported since the last tick to the sketch and the LRU order.
+    A child that did more than SHARED_CACHE_ACCESS_RING lookups in a tick lost its oldest reports,
+    which only makes the sketch a sample
+*/
+void drain_cache_accesses()
+{
+    for (int child = 0; child < PREFORK_CHILDREN; child++)
+    {
+        struct child_slot *slot = &scoreboard[child];
+        unsigned long head = __atomic_load_n(&slot->accesses_head, __ATOMIC_ACQUIRE);
+        if (head - accesses_tails[child] > SHARED_CACHE_ACCESS_RING) accesses_tails[child] = head - SHARED_CACHE_ACCESS_RING;
+
+        for (; accesses_tails[child] != head; accesses_tails[child]++)
+        {
+            struct cache_access access = slot->accesses[accesses_tails[child] % SHARED_CACHE_ACCESS_RING];
+            sketch_increment(access.hash);
+            if (access.entry < 0) continue;
+
+            struct cache_policy *policy = &cache_policies[access.entry];
+            if (policy->segment == CACHE_SEGMENT_NONE || policy->hash != access.hash) continue;
+            policy->last_access = ++policy_clock;
+            if (policy->segment != CACHE_SEGMENT_PROBATION) continue;
+
+            policy_move(access.entry, CACHE_SEGMENT_PROTECTED);
+            int demoted;
+            while (segment_bytes[CACHE_SEGMENT_PROTECTED] > CACHE_PROTECTED_SIZE
+                   && (demoted = policy_lru(CACHE_SEGMENT_PROTECTED, access.entry)) != -1)
             {
-                n = recv(sock, &c, 1, MSG_PEEK); // only peeks, don't read
-                if ((n > 0) && (c == '\n'))
-                {
-                    recv(sock, &c, 1, 0);
-                }
+                cache_policies[demoted].last_access = ++policy_clock;
+                policy_move(demoted, CACHE_SEGMENT_PROBATION);
             }
+        }
+    }
+}
+
+/*
+    Parent only. Moves the window's overflow to the main area, each candidate against the main area's
+    victims while the main area is over its size. Ties go to the victim, a one hit wonder never gets in
+*/
+void admit_window_candidates()
+{
+    int candidate;
+    while (segment_bytes[CACHE_SEGMENT_WINDOW] > CACHE_WINDOW_SIZE && (candidate = policy_lru(CACHE_SEGMENT_WINDOW, -1)) != -1)
+    {
+        policy_move(candidate, CACHE_SEGMENT_PROBATION);
+        while (segment_bytes[CACHE_SEGMENT_PROBATION] + segment_bytes[CACHE_SEGMENT_PROTECTED] > CACHE_MAIN_SIZE)
+        {
+            int victim = policy_lru(CACHE_SEGMENT_PROBATION, candidate);
+            if (victim == -1) victim = policy_lru(CACHE_SEGMENT_PROTECTED, -1);
+            if (victim == -1) break;
+
+            if (sketch_frequency(cache_policies[candidate].hash) > sketch_frequency(cache_policies[victim].hash))
+                evict_shared_cache_entry(victim);
             else
             {
-                buf[i] = c;
-                i++;
+                evict_shared_cache_entry(candidate);
+                shared_cache_rejections++;
+                break;
             }
         }
-        else
+    }
+}
+
+/*
+    Parent only. A child found no free way for a path in its set: the set's least popular entry
+    makes room if the path is more popular, else the path stays out
+*/
+void admit_to_full_set(int set, unsigned int hash)
+{
+    int victim = -1, victim_frequency = 0;
+    for (int i = set * SHARED_CACHE_WAYS; i < (set + 1) * SHARED_CACHE_WAYS; i++)
+    {
+        if (cache_policies[i].segment == CACHE_SEGMENT_NONE) continue;
+        int frequency = sketch_frequency(cache_policies[i].hash);
+        if (victim == -1 || frequency < victim_frequency
+            || (frequency == victim_frequency && cache_policies[i].last_access < cache_policies[victim].last_access))
         {
-            return 0;
+            victim = i;
+            victim_frequency = frequency;
         }
     }
-    buf[i] = '\0';
-    return i;
+    if (victim == -1) return;
+
+    if (sketch_frequency(hash) > victim_frequency) evict_shared_cache_entry(victim);
+    else shared_cache_rejections++;
+}
+
+/* A cached body is stale once the file it came from was replaced, rewritten or removed */
+int shared_cache_body_changed(const struct shared_cache_body* body, const char* path)
+{
+    struct stat st;
+    if (stat(path, &st) == -1) return 1;
+    return st.st_ino != body->ino || st.st_size != body->size
+        || st.st_mtim.tv_sec != body->mtime.tv_sec || st.st_mtim.tv_nsec != body->mtime.tv_nsec;
+}
+
+/* Parent only. Retires entries whose file, or one of whose precompressed variants, changed on disk */
+void revalidate_shared_cache()
+{
+    for (int i = 0; i < SHARED_CACHE_SETS * SHARED_CACHE_WAYS; i++)
+    {
+        struct shared_cache_entry *entry = &shared_cache_entries[i];
+        if (CACHE_ENTRY_STATE(__atomic_load_n(&entry->tag, __ATOMIC_ACQUIRE)) != CACHE_ENTRY_READY) continue;
+
+        int changed = shared_cache_body_changed(&entry->bodies[ENCODING_IDENTITY], entry->path);
+        for (int encoding = ENCODING_GZIP; !changed && entry->bodies[ENCODING_IDENTITY].validators.negotiated && encoding < ENCODINGS_COUNT; encoding++)
+        {
+            char variant_path[SHARED_CACHE_MAX_PATH + 8];
+            snprintf(variant_path, sizeof(variant_path), "%s%s", entry->path, content_encodings[encoding].file_suffix);
+            if (entry->bodies[encoding].extent) changed = shared_cache_body_changed(&entry->bodies[encoding], variant_path);
+            else changed = access(variant_path, R_OK) == 0;     /* a variant appeared, reload to pick it up */
+        }
+
+        if (changed)
+        {
+            printf("Static cache: %s changed on disk, dropped\n", entry->path);
+            retire_shared_cache_entry(entry);
+            shared_cache_invalidations++;
+        }
+    }
+}
+
+/* Free lists are kept at SHARED_CACHE_STOCK_BYTES each, but never below 1 extent */
+int shared_cache_stock_target(int order)
+{
+    int target = SHARED_CACHE_STOCK_BYTES / (SHARED_CACHE_PAGE_SIZE << order);
+    return target < 1 ? 1 : target;
+}
+
+/* Parent only. Tops a free list up from the buddy allocator, returns 0 if it is still empty */
+int stock_free_list(int order)
+{
+    while ((int) __atomic_load_n(&shared_cache->free_counts[order], __ATOMIC_RELAXED) < shared_cache_stock_target(order))
+    {
+        int page = buddy_alloc(order);
+        if (page == -1) break;
+        push_free_extent(order, page + 1);
+    }
+    return __atomic_load_n(&shared_cache->free_counts[order], __ATOMIC_RELAXED) > 0;
+}
+
+/* Parent only. Takes the stocked extents of every other order back, so they can merge into bigger blocks */
+void reclaim_free_lists(int keep_order)
+{
+    for (int order = 0; order < SHARED_CACHE_ORDERS; order++)
+    {
+        unsigned int extent;
+        if (order == keep_order) continue;
+        while ((extent = pop_free_extent(order)) != 0) buddy_free(extent - 1, order);
+    }
 }
 
 /*
-    Read the static file and write to client socket using sendfile() system call [zero copy]
+    Parent only, runs every SHARED_CACHE_TICK_MS. Everything that frees or hands out cache memory happens here,
+    children only ever pop extents that the parent already stocked
 */
-void transfer_file_contents(char* file_path, int client_socket, off_t file_size)
+void maintain_shared_cache()
+{
+    static unsigned long ticks;
+    drain_cache_accesses();
+    register_loaded_entries();
+    admit_window_candidates();
+
+    if (++ticks % SHARED_CACHE_REVALIDATE_TICKS == 0) revalidate_shared_cache();
+    recover_exited_children();
+    long retired_bytes = release_retired_entries();
+
+    unsigned int full_set = __atomic_exchange_n(&shared_cache->full_set, 0, __ATOMIC_ACQUIRE);
+    if (full_set) admit_to_full_set(full_set - 1, __atomic_load_n(&shared_cache->full_set_hash, __ATOMIC_RELAXED));
+
+    /*
+        Orders children ran out of are served first, with memory taken back from the other free lists if need be.
+        When even that is not enough, the policy's victims holding twice the wanted size make room.
+        Their memory becomes usable once every child is past the retire, usually on the next tick.
+        Entries retired earlier and still waiting for a child to leave the cache count towards that size:
+        evicting more on every tick while they wait would only empty the cache
+    */
+    unsigned int wanted_orders = __atomic_exchange_n(&shared_cache->wanted_orders, 0, __ATOMIC_RELAXED);
+    for (int order = 0; order < SHARED_CACHE_ORDERS; order++)
+    {
+        if (!(wanted_orders & (1u << order)) || stock_free_list(order)) continue;
+
+        reclaim_free_lists(order);
+        if (stock_free_list(order)) continue;
+
+        int victim;
+        while (retired_bytes < 2 * ((long) SHARED_CACHE_PAGE_SIZE << order) && (victim = shared_cache_victim()) != -1)
+            retired_bytes += evict_shared_cache_entry(victim);
+    }
+
+    for (int order = 0; order < SHARED_CACHE_ORDERS; order++) stock_free_list(order);
+}
+
+/*
+    Parent only. Runs maintain_shared_cache() when a tick is due and returns the
+    milliseconds until the next one, to be used as a poll() timeout
+*/
+int shared_cache_tick()
+{
+    static struct timespec next_tick;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long remaining = (next_tick.tv_sec - now.tv_sec) * 1000 + (next_tick.tv_nsec - now.tv_nsec) / 1000000;
+    if (remaining <= 0)
+    {
+        maintain_shared_cache();
+        next_tick = now;
+        next_tick.tv_nsec += SHARED_CACHE_TICK_MS * 1000000L;
+        next_tick.tv_sec += next_tick.tv_nsec / 1000000000L;
+        next_tick.tv_nsec %= 1000000000L;
+        remaining = SHARED_CACHE_TICK_MS;
+    }
+    return remaining;
+}
+
+/* Whether the kernel gives shared memory transparent huge pages when asked with MADV_HUGEPAGE */
+int shmem_thp_enabled()
+{
+    char policy[128] = "";
+    FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+    if (!file) return 0;
+    if (!fgets(policy, sizeof(policy), file)) policy[0] = '\0';
+    fclose(file);
+
+    /* The active policy is the one in brackets, eg: "always within_size advise [never] deny force" */
+    return strstr(policy, "[always]") || strstr(policy, "[within_size]") || strstr(policy, "[advise]") || strstr(policy, "[force]");
+}
+
+/*
+    Maps the memfd behind the shared cache with the pages CACHE_PAGES asks for, and describes what it got in 'backing'.
+    A memfd rather than plain MAP_ANONYMOUS, so the region shows up by name in /proc/<pid>/maps
+*/
+char* map_shared_cache(size_t size, const char** backing)
 {
-    int fd;
-    fd = open(file_path, O_RDONLY);
-    sendfile(client_socket, fd, NULL, file_size);
+    char *region;
+
+    if (CACHE_PAGES == CACHE_PAGES_HUGE)
+    {
+        /* hugetlb pages are reserved by mmap(), so a short pool fails here instead of SIGBUSing a child later */
+        int fd = memfd_create("nitishhttpd-static-cache", MFD_CLOEXEC | MFD_HUGETLB);
+        if (fd != -1)
+        {
+            region = MAP_FAILED;
+            if (ftruncate(fd, size) == 0) region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (region != MAP_FAILED)
+            {
+                *backing = "explicit 2 MiB huge pages (hugetlb)";
+                return region;
+            }
+        }
+    }
+
+    int fd = memfd_create("nitishhttpd-static-cache", MFD_CLOEXEC);
+    if (fd == -1) fatal_error("memfd_create()");
+    if (ftruncate(fd, size) == -1) fatal_error("ftruncate()");
+    region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) fatal_error("mmap()");
     close(fd);
+
+    *backing = "regular 4 KiB pages";
+    if (CACHE_PAGES == CACHE_PAGES_HUGE)
+    {
+        if (madvise(region, size, MADV_HUGEPAGE) == 0 && shmem_thp_enabled()) *backing = "transparent huge pages (MADV_HUGEPAGE)";
+        else *backing = "regular 4 KiB pages, no huge pages available (hugetlb pool empty, shmem THP disabled)";
+    }
+    return region;
 }
 
 /*
-    Sends HTTP 200 OK header
+    Creates the shared mapping and fills the free lists for the first time.
+    Must be called before create_child()
 */
-void send_headers(const char* path, off_t len, int client_socket)
+void create_shared_cache()
 {
-    char small_case_path[1024];
-    char send_buffer[1024];
-    strcpy(small_case_path, path);
-    strtolower(small_case_path);
+    /* The data area starts on a huge page boundary, so its huge pages hold file contents only */
+    size_t index_size = sizeof(struct shared_cache_entry) * SHARED_CACHE_SETS * SHARED_CACHE_WAYS;
+    size_t data_offset = (ARENA_ALIGN(sizeof(struct shared_cache_header)) + index_size + SHARED_CACHE_HUGE_PAGE_SIZE - 1)
+                       & ~((size_t) SHARED_CACHE_HUGE_PAGE_SIZE - 1);
+    size_t size = data_offset + STATIC_CACHE_MAX_SIZE;
 
-    strcpy(send_buffer, "HTTP/1.0 200 OK\r\n");
-    send(client_socket, send_buffer, strlen(send_buffer), 0);
-    strcpy(send_buffer, SERVER_STRING);
-    send(client_socket, send_buffer, strlen(send_buffer), 0);
+    const char *backing;
+    char *region = map_shared_cache(size, &backing);
 
-    /*
-        Check file extensions for certain common types of files on web pages
-        and send the appropriate content type header 
-    */
-   const char* file_ext = get_filename_ext(small_case_path);
-   if (strcmp("jpg", file_ext) == 0) strcpy(send_buffer, "Content-Type: image/jpeg\r\n");
-   if (strcmp("jpeg", file_ext) == 0) strcpy(send_buffer, "Content-Type: image/jpeg\r\n");
-   if (strcmp("png", file_ext) == 0) strcpy(send_buffer, "Content-Type: image/png\r\n");
-   if (strcmp("gif", file_ext) == 0) strcpy(send_buffer, "Content-Type: image/gif\r\n");
-   if (strcmp("htm", file_ext) == 0) strcpy(send_buffer, "Content-Type: text/html\r\n");
-   if (strcmp("html", file_ext) == 0) strcpy(send_buffer, "Content-Type: text/html\r\n");
-   if (strcmp("js", file_ext) == 0) strcpy(send_buffer, "Content-Type: application/javascript\r\n");
-   if (strcmp("css", file_ext) == 0) strcpy(send_buffer, "Content-Type: text/css\r\n");
-   if (strcmp("txt", file_ext) == 0) strcpy(send_buffer, "Content-Type: text/plain\r\n");
-   send(client_socket, send_buffer, strlen(send_buffer), 0);
+    /* The memfd starts out zeroed: every entry is EMPTY and every free list is empty */
+    shared_cache = (struct shared_cache_header*) region;
+    shared_cache_entries = (struct shared_cache_entry*) (region + ARENA_ALIGN(sizeof(struct shared_cache_header)));
+    shared_cache_data = region + data_offset;
+    shared_cache->epoch = 1;
 
-   /* Send the content length header*/
-   sprintf(send_buffer, "content-length: %ld\r\n", len);
-   send(client_socket, send_buffer, strlen(send_buffer), 0);
+    buddy_pages = STATIC_CACHE_MAX_SIZE / SHARED_CACHE_PAGE_SIZE;
+    buddy_free_order = calloc(buddy_pages, 1);
+    buddy_next = malloc(sizeof(int) * buddy_pages);
+    buddy_prev = malloc(sizeof(int) * buddy_pages);
+    for (int order = 0; order < SHARED_CACHE_ORDERS; order++) buddy_lists[order] = -1;
+    for (int page = 0; page < buddy_pages; page += 1 << (SHARED_CACHE_ORDERS - 1)) buddy_free(page, SHARED_CACHE_ORDERS - 1);
 
-   /* This empty line with "\r\n" signals browser there are no more headers. Content May follow */
-   strcpy(send_buffer, "\r\n");
-   send(client_socket, send_buffer, strlen(send_buffer), 0);
+    maintain_shared_cache();
+    printf("Static cache: %d MiB in a memfd shared by all children, %d sets of %d entries, backed by %s\n",
+           STATIC_CACHE_MAX_SIZE / (1024 * 1024), SHARED_CACHE_SETS, SHARED_CACHE_WAYS, backing);
 }
 
 /*
@@ -481,15 +3323,8 @@ void send_headers(const char* path, off_t len, int client_socket)
 int render_guestbook_template(int client_socket)
 {
     /* safe programming, all offsets are set to \0, else they are filled with garbage. */
-    char templ[16384] = "";
     char rendering[16384] = "";
 
-    /* Read the template file*/
-    int fd = open(GUESTBOOK_TEMPLATE, O_RDONLY);
-    if (fd == -1) fatal_error("Template read()");
-    read(fd, templ, sizeof(templ));
-    close(fd);
-
     /* Get guestbook entries and render them as HTML */
     int entries_count;
     char** guest_entries;
@@ -502,7 +3337,6 @@ int render_guestbook_template(int client_socket)
         sprintf(guest_entry, "<p class=\"guest-entry\">%s</p>", guest_entries[i]);
         strcat(guest_entries_html, guest_entry);
     }
-    redis_free_array_result(guest_entries, entries_count);
 
     /* In Redis, increment visitor count and fetch latest value */
     int visitor_count;
@@ -511,48 +3345,32 @@ int render_guestbook_template(int client_socket)
     redis_get_int_key(GUESTBOOK_REDIS_VISITOR_KEY, &visitor_count);
     sprintf(visitor_count_str, "%'d", visitor_count);
 
-    /* Replace guestbook entries in HTML*/
-    char *entries = strstr(templ, GUESTBOOK_TMPL_REMARKS);
-    if (entries)
+    /*
+        The template was compiled at startup (see build_template_cache()),
+        rendering just stitches its literal segments and the variables together
+    */
+    size_t rendering_len = 0;
+    for (int i = 0; i < template_cache.segments_count; i++)
     {
-        memcpy(rendering, templ, entries - templ);
-        strcat(rendering, guest_entries_html);
-        char* copy_offset = templ + (entries - templ) + strlen(GUESTBOOK_TMPL_REMARKS);
-        strcat(rendering, copy_offset);
-        strcpy(templ, rendering);
-        bzero(rendering, sizeof(rendering));
-    }
+        const struct template_segment *segment = &template_cache.segments[i];
+        const char *value = "";
+        if (segment->variable == TMPL_VAR_REMARKS) value = guest_entries_html;
+        if (segment->variable == TMPL_VAR_VISITOR) value = visitor_count_str;
+        size_t value_len = strlen(value);
 
-    /* Replace visitor count in HTML*/
-    char* vcount = strstr(templ, GUESTBOOK_TMPL_VISITOR);
-    if (vcount)
-    {
-        memcpy(rendering, templ, vcount - templ);
-        strcat(rendering, visitor_count_str);
-        char* copy_offset = templ + (vcount - templ) + strlen(GUESTBOOK_TMPL_VISITOR);
-        strcat(rendering, copy_offset);
-        strcpy(templ, rendering);
-        bzero(rendering, sizeof(rendering));
+        if (rendering_len + segment->text_len + value_len >= sizeof(rendering)) break;
+        memcpy(rendering + rendering_len, segment->text, segment->text_len);
+        rendering_len += segment->text_len;
+        memcpy(rendering + rendering_len, value, value_len);
+        rendering_len += value_len;
     }
+    rendering[rendering_len] = '\0';
 
     /*
         Template is rendered, Send headers and template over to the client
     */
-    char send_buffer[1024];
-    strcpy(send_buffer, "HTTP/1.0 200 OK\r\n");
-    send(client_socket, send_buffer, strlen(send_buffer), 0);
-    strcpy(send_buffer, SERVER_STRING);
-    send(client_socket, send_buffer, strlen(send_buffer), 0);
-    strcpy(send_buffer, "Content-Type: text/html\r\n");
-    send(client_socket, send_buffer, strlen(send_buffer), 0);
-    sprintf(send_buffer, "content-length: %ld\r\n", strlen(templ));
-    send(client_socket, send_buffer, strlen(send_buffer), 0);
-    strcpy(send_buffer, "\r\n");
-    send(client_socket, send_buffer, strlen(send_buffer), 0);
-
-    // send template
-    send(client_socket, templ, strlen(templ), 0);
-    printf("200 GET /guestbook %ld bytes\n", strlen(templ));
+    send_dynamic_response(client_socket, &html_mime_type, rendering, rendering_len);
+    printf("200 GET /guestbook %ld bytes\n", rendering_len);
 }
 
 /*
@@ -568,7 +3386,47 @@ int handle_app_get_routes(char* path, int client_socket)
         return METHOD_HANDLED;
     }
 
-    return METHOD_NOT_HANDLED;
+    return METHOD_NOT_HANDLED;
+}
+
+/* Answers a GET for a file from its shared cache entry, no stat()/open() needed */
+void send_cached_file(int client_socket, const char* final_path, const struct shared_cache_entry* cached)
+{
+    /* Precompressed variant when the client takes one, ranges always come from the file itself */
+    int encoding = ENCODING_IDENTITY;
+    if (request_headers.accept_encodings && !request_headers.range[0])
+    {
+        for (int e = ENCODINGS_COUNT - 1; e > ENCODING_IDENTITY && encoding == ENCODING_IDENTITY; e--)
+            if ((request_headers.accept_encodings & (1 << e)) && cached->bodies[e].extent) encoding = e;
+    }
+    const struct shared_cache_body *body = &cached->bodies[encoding];
+    const char *content = shared_cache_extent(body->extent);
+
+    if (request_not_modified(&body->validators))
+    {
+        send_not_modified(client_socket, &body->validators);
+        printf("304 %s (cached)\n", final_path);
+        return;
+    }
+
+    struct byte_range ranges[RANGE_MAX_RANGES];
+    int ranges_count;
+    int range_status = parse_range_request(body->size, &body->validators, ranges, &ranges_count);
+    if (range_status == RANGE_NOT_SATISFIABLE)
+    {
+        send_range_not_satisfiable(client_socket, body->size, &body->validators);
+        printf("416 %s (cached)\n", final_path);
+        return;
+    }
+    if (range_status == RANGE_SATISFIABLE)
+    {
+        send_ranges(client_socket, final_path, -1, content, body->size, &body->validators, ranges, ranges_count);
+        printf("206 %s %d range(s) (cached)\n", final_path, ranges_count);
+        return;
+    }
+    send_response_zerocopy(client_socket, &status_200, mime_type_for_path(final_path),
+                           body->validators.lines, body->validators.lines_len, content, body->size);
+    printf("200 %s %ld bytes (cached, %s)\n", final_path, body->size, content_encodings[encoding].name);
 }
 
 /*
@@ -603,6 +3461,32 @@ void handle_get_method(char* path, int client_socket)
         strcat(final_path, path);
     }
 
+    /* With a bundle, public/ is served from it alone */
+    const struct asset_bundle *bundle = current_asset_bundle();
+    if (bundle)
+    {
+        const struct bundle_entry *entry = bundle_lookup(bundle->map, final_path);
+        if (entry) send_bundle_file(client_socket, final_path, bundle, entry);
+        else
+        {
+            printf("404 Not Found: %s\n", final_path);
+            handle_http_404(client_socket);
+        }
+        return;
+    }
+
+    /* Small regular files are served from the cache shared by all children, loaded there on the first miss */
+    shared_cache_enter();
+    const struct shared_cache_entry *cached = shared_cache_lookup(final_path);
+    if (cached)
+    {
+        begin_cached_send(client_socket);
+        send_cached_file(client_socket, final_path, cached);
+        end_cached_send(client_socket, final_path);
+    }
+    shared_cache_leave();
+    if (cached) return;
+
     struct stat path_stat;
     if (stat(final_path, &path_stat) == -1)
     {
@@ -614,7 +3498,62 @@ void handle_get_method(char* path, int client_socket)
         /* Check if this is a regular file and not a directory or something else */
         if (S_ISREG(path_stat.st_mode))
         {
-            send_headers(final_path, path_stat.st_size, client_socket);
+            scoreboard[child_index].cache_miss_bytes += path_stat.st_size;
+
+            struct file_validators validators;
+            int negotiated = path_stat.st_size >= PRECOMPRESS_MIN_SIZE && mime_type_compressible(mime_type_for_path(final_path));
+            file_validators_from_stat(&validators, &path_stat, negotiated);
+
+            /* Send a precompressed variant instead when the client takes one */
+            char variant_path[1100];
+            struct stat variant_stat;
+            int encoding = ENCODING_IDENTITY;
+            if (negotiated) encoding = pick_precompressed_variant(final_path, &path_stat, variant_path, sizeof(variant_path), &variant_stat);
+            if (encoding != ENCODING_IDENTITY)
+            {
+                struct file_validators identity = validators;
+                file_validators_for_encoding(&validators, &identity, encoding);
+            }
+            if (request_not_modified(&validators))
+            {
+                send_not_modified(client_socket, &validators);
+                printf("304 %s\n", final_path);
+                return;
+            }
+
+            struct byte_range ranges[RANGE_MAX_RANGES];
+            int ranges_count;
+            int range_status = parse_range_request(path_stat.st_size, &validators, ranges, &ranges_count);
+            if (range_status == RANGE_NOT_SATISFIABLE)
+            {
+                send_range_not_satisfiable(client_socket, path_stat.st_size, &validators);
+                printf("416 %s\n", final_path);
+                return;
+            }
+            if (range_status == RANGE_SATISFIABLE)
+            {
+                int fd = open(final_path, O_RDONLY);
+                if (fd == -1)
+                {
+                    handle_http_404(client_socket);
+                    printf("404 Not Found: %s\n", final_path);
+                    return;
+                }
+                send_ranges(client_socket, final_path, fd, NULL, path_stat.st_size, &validators, ranges, ranges_count);
+                close(fd);
+                printf("206 %s %d range(s)\n", final_path, ranges_count);
+                return;
+            }
+
+            if (encoding != ENCODING_IDENTITY)
+            {
+                send_headers(final_path, variant_stat.st_size, &validators, client_socket);
+                transfer_file_contents(variant_path, client_socket, variant_stat.st_size);
+                printf("200 %s %ld bytes (%s)\n", final_path, variant_stat.st_size, content_encodings[encoding].name);
+                return;
+            }
+
+            send_headers(final_path, path_stat.st_size, &validators, client_socket);
             transfer_file_contents(final_path, client_socket, path_stat.st_size);
             printf("200 %s %ld bytes\n", final_path, path_stat.st_size);
         }
@@ -627,104 +3566,203 @@ void handle_get_method(char* path, int client_socket)
 }
 
 /*
-    Guest submits name and remarks via the form on the page.
-    That data is available to us as post x-www-form-urlencoded data.
-    Need to decode and get what we need in plain text.
+    Reads the request body. get_line() never reads past the end of the headers,
+    so the whole body is still waiting in the socket
+*/
+ssize_t read_request_body(int client_socket, char* buf, size_t len)
+{
+    return read(client_socket, buf, len);
+}
 
-    At this point, we have already read the headers and whats left is post data, which forms the body of request
+/*
+    Streaming application/x-www-form-urlencoded parser.
+    The body is read into a single request arena buffer of Content-Length bytes and decoded in place as it
+    arrives: decoding never produces more bytes than it consumes, so the write cursor (out_len) can never pass
+    the read cursor (raw_pos). '=' and '&' are overwritten by the '\0' ending the name or value before them,
+    which leaves fields[] pointing straight into the buffer. A %XX escape split across two reads is
+    carried over in pct_state/pct_char.
 */
-void handle_new_guest_remarks(int client_socket)
+struct form_field {
+    const char  *name;
+    const char  *value;
+};
+
+struct form_data {
+    struct form_field   fields[FORM_MAX_FIELDS];
+    int                 fields_count;
+
+    /* Parser state */
+    char                *buf;
+    size_t              raw_len;        /* bytes received so far */
+    size_t              raw_pos;        /* bytes decoded so far */
+    size_t              out_len;        /* decoded bytes written */
+    size_t              token_start;    /* where the name or value being decoded starts */
+    size_t              name_start;
+    int                 in_value;
+    int                 pct_state;      /* 0: not in an escape, 1: after '%', 2: after '%' and one hex digit */
+    char                pct_char;
+};
+
+void form_end_token(struct form_data* form)
 {
-    char remarks[1024] = "";
-    char name[512] = "";
-    char buffer[4026] = "";
-    char* c1;
-    char* c2;
-    read(client_socket, buffer, sizeof(buffer));
-    /*
-     * Sample data format:
-     * guest-remarks=Relatively+great+service&guest-name=Albert+Einstein
-     * */
+    /* An escape cut short by the end of the token is kept literally */
+    if (form->pct_state >= 1) form->buf[form->out_len++] = '%';
+    if (form->pct_state == 2) form->buf[form->out_len++] = form->pct_char;
+    form->pct_state = 0;
 
-    char* assignment = strtok_r(buffer, "&", &c1);
-    do
+    form->buf[form->out_len++] = '\0';
+    if (!form->in_value)
+    {
+        /* A name without '=', treat it as a field with an empty value */
+        form->name_start = form->token_start;
+        form->token_start = form->out_len - 1;
+    }
+
+    if (form->fields_count < FORM_MAX_FIELDS && form->buf[form->name_start])
+    {
+        form->fields[form->fields_count].name = form->buf + form->name_start;
+        form->fields[form->fields_count].value = form->buf + form->token_start;
+        form->fields_count++;
+    }
+    form->in_value = 0;
+    form->token_start = form->out_len;
+}
+
+/*
+    Decodes everything received but not decoded yet.
+    Plain text and complete escapes go through url_decode_span() in bulk, the byte at a time
+    state machine only deals with separators and escapes split across reads
+*/
+void form_decode_received(struct form_data* form)
+{
+    char *buf = form->buf;
+
+    while (form->raw_pos < form->raw_len)
     {
-        char* subassignment = strtok_r(assignment, "=", &c2);
-        if (!subassignment) break;
-        
-        do
+        if (form->pct_state == 0)
+        {
+            size_t written;
+            form->raw_pos += url_decode_span(buf + form->raw_pos, form->raw_len - form->raw_pos, buf + form->out_len, &written, !form->in_value);
+            form->out_len += written;
+            if (form->raw_pos == form->raw_len) break;
+        }
+
+        char ch = buf[form->raw_pos++];
+
+        if (form->pct_state == 1)
         {
-            if (strcmp(subassignment, "guest-name") == 0)
+            if (hex_values[(unsigned char)ch] >= 0)
             {
-                subassignment = strtok_r(NULL, "=", &c2);
-                if (!subassignment)
-                {
-                    name[0] = '\0';
-                    break;
-                }
-                else
-                {
-                    strcpy(name, subassignment);
-                }
+                form->pct_char = ch;
+                form->pct_state = 2;
+                continue;
             }
-
-            if (strcmp(subassignment, "guest-remarks") == 0)
+            buf[form->out_len++] = '%';
+            form->pct_state = 0;
+        }
+        else if (form->pct_state == 2)
+        {
+            form->pct_state = 0;
+            if (hex_values[(unsigned char)ch] >= 0)
             {
-                subassignment = strtok_r(NULL, "=", &c2);
-                if(!subassignment)
-                {
-                    remarks[0] = '\0';
-                    break;
-                }
-                else
-                {
-                    strcpy(remarks, subassignment);
-                }
+                buf[form->out_len++] = hex_values[(unsigned char)form->pct_char] << 4 | hex_values[(unsigned char)ch];
+                continue;
             }
-            subassignment = strtok_r(NULL, "=", &c2);
-            if (!subassignment) break;
-        } while (1);
+            buf[form->out_len++] = '%';
+            buf[form->out_len++] = form->pct_char;
+        }
+
+        if (ch == '%') form->pct_state = 1;
+        else if (ch == '+') buf[form->out_len++] = ' ';
+        else if (ch == '&') form_end_token(form);
+        else if (ch == '=' && !form->in_value)
+        {
+            buf[form->out_len++] = '\0';
+            form->name_start = form->token_start;
+            form->token_start = form->out_len;
+            form->in_value = 1;
+        }
+        else buf[form->out_len++] = ch;
+    }
+}
+
+/* Returns the decoded value of field 'name', or NULL if the form has no such field */
+const char* form_get_field(const struct form_data* form, const char* name)
+{
+    for (int i = 0; i < form->fields_count; i++)
+    {
+        if (strcmp(form->fields[i].name, name) == 0) return form->fields[i].value;
+    }
+    return NULL;
+}
+
+/*
+    Reads a form body of exactly Content-Length bytes, however many reads it takes, and parses it.
+    Bodies that are not form encoded are left unread and give an empty form.
+    Returns 0 on success, 400 or 413 as the HTTP status to fail the request with
+*/
+int read_form_body(int client_socket, struct form_data* form)
+{
+    bzero(form, sizeof(*form));
+    if (!request_headers.form_urlencoded) return 0;
+    if (request_headers.content_length < 0) return 400;
+    if (request_headers.content_length > FORM_MAX_BODY_SIZE) return 413;
+
+    size_t content_length = request_headers.content_length;
+    form->buf = arena_alloc(content_length + 1);
+
+    while (form->raw_len < content_length)
+    {
+        ssize_t n = read_request_body(client_socket, form->buf + form->raw_len, content_length - form->raw_len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return 400; /* client went away or timed out before sending the whole body */
+
+        form->raw_len += n;
+        form_decode_received(form);
+    }
+    if (content_length > 0) form_end_token(form);
+    return 0;
+}
 
-        assignment = strtok_r(NULL, "&", &c1);
-        if (!assignment) break;
-    } while (1);
+/*
+    Guest submits name and remarks via the form on the page.
+    That data is available to us as post x-www-form-urlencoded data,
+    handle_post_method() has already read and decoded it into 'form'.
+    eg: guest-remarks=Relatively+great+service&guest-name=Albert+Einstein
+*/
+void handle_new_guest_remarks(int client_socket, struct form_data* form)
+{
+    const char *name = form_get_field(form, "guest-name");
+    const char *remarks = form_get_field(form, "guest-remarks");
 
     /* Validate name and remark lenghts and show an error page if required */
-    if(strlen(name) == 0 || strlen(remarks) == 0)
+    if (!name || !remarks || strlen(name) == 0 || strlen(remarks) == 0)
     {
-        char* html = "HTTP/1.0 400 Bad Request\r\ncontent-type: text/html\r\n\r\n<html><title>Error</title><body><p>Error: Do not leave name or remarks empty.</p><p><a href=\"/guestbook\">Go back to Guestbook</a></p></body></html>";
-        write(client_socket, html, strlen(html));
+        const char* html = "<html><title>Error</title><body><p>Error: Do not leave name or remarks empty.</p><p><a href=\"/guestbook\">Go back to Guestbook</a></p></body></html>";
+        send_response(client_socket, &status_400, &html_mime_type, NULL, 0, html, strlen(html));
         printf("400 POST /guestbook\n");
         return;
     }
 
-    /*
-        POST uses form URL encoding. Decode the strings and append them to the Redis
-        list that holds all remarks.
-    */
-   char* decoded_name = urlencoding_decode(name);
-   char* decoded_remarks = urlencoding_decode(remarks);
-   bzero(buffer, sizeof(buffer));
-   sprintf(buffer, "%s - %s", decoded_remarks, decoded_name);
-   redis_list_append(GUESTBOOK_REDIS_REMARKS_KEY, buffer);
-   free(decoded_name);
-   free(decoded_remarks);
+    /* Append the entry to the Redis list that holds all remarks */
+    redis_list_append(GUESTBOOK_REDIS_REMARKS_KEY, arena_sprintf("%s - %s", remarks, name));
 
    /* All good! Show a 'thank you' page. */
-   char *html = "HTTP/1.0 200 OK\r\ncontent-type: text/html\r\n\r\n<html><title>Thank you!</title><body><p>Thank you for leaving feedback! We really appreciate that!</p><p><a href=\"/guestbook\">Go back to Guestbook</a></p></body></html>";
-   write(client_socket, html, strlen(html));
+   const char* html = "<html><title>Thank you!</title><body><p>Thank you for leaving feedback! We really appreciate that!</p><p><a href=\"/guestbook\">Go back to Guestbook</a></p></body></html>";
+   send_response(client_socket, &status_200, &html_mime_type, NULL, 0, html, strlen(html));
    printf("200 POST /guestbook\n");
 }
 
 /*
     This is the routing function for POST calls,
-    Can be extended by adding newer POST methods and its handlers
+    Can be extended by adding newer POST methods and its handlers.
+    Form encoded bodies are already parsed, handlers look fields up with form_get_field()
 */
-int handle_app_post_routes(char* path, int client_socket)
+int handle_app_post_routes(char* path, int client_socket, struct form_data* form)
 {
     if (strcmp(path, GUESTBOOK_ROUTE) == 0)
     {
-        handle_new_guest_remarks(client_socket);
+        handle_new_guest_remarks(client_socket, form);
         return METHOD_HANDLED;
     }
 
@@ -734,13 +3772,25 @@ int handle_app_post_routes(char* path, int client_socket)
 
 void handle_post_method(char* path, int client_socket)
 {
+    struct form_data form;
+    int status = read_form_body(client_socket, &form);
+    if (status != 0)
+    {
+        const char *html = status == 413 ?
+            "<html><title>Error</title><body><p>Error: Request body too large.</p></body></html>" :
+            "<html><title>Error</title><body><p>Error: Incomplete or missing request body.</p></body></html>";
+        send_response(client_socket, status == 413 ? &status_413 : &status_400, &html_mime_type, NULL, 0, html, strlen(html));
+        printf("%d POST %s\n", status, path);
+        return;
+    }
+
     // it can only be for app methods
-    handle_app_post_routes(path, client_socket);
+    handle_app_post_routes(path, client_socket, &form);
 }
 
 void handle_unimplemented_method(int client_socket)
 {
-    send(client_socket, unimplemented_content, strlen(unimplemented_content), 0);
+    send_response(client_socket, &status_400, &html_mime_type, NULL, 0, unimplemented_content, sizeof(unimplemented_content) - 1);
 }
 
 void handle_http_method(char* method_buffer, int client_socket)
@@ -771,6 +3821,7 @@ void handle_client(int client_socket)
     char method_buffer[1024];
     int method_line = 0;
 
+    reset_request_headers();
     while (1)
     {
         get_line(client_socket, line_buffer, sizeof(line_buffer));
@@ -789,10 +3840,12 @@ void handle_client(int client_socket)
         {
             // empty line with "/r/n" => end of request headers
             if (len == 0) break;
+            parse_request_header(line_buffer);
         }
     }
 
     handle_http_method(method_buffer, client_socket);
+    arena_reset();
 }
 
 // accept client connections and calls handle_client() to serve the request
@@ -817,6 +3870,155 @@ void enter_server_loop(int server_socket)
     }
 }
 
+/*
+    Sends client_socket over a Unix domain socket as SCM_RIGHTS ancillary data.
+    The kernel installs a duplicate of the descriptor in the receiving process
+*/
+int send_client_socket(int channel, int client_socket)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char byte = 0;
+    char control[CMSG_SPACE(sizeof(int))];
+
+    bzero(&msg, sizeof(msg));
+    bzero(control, sizeof(control));
+
+    /* At least 1 byte of real data has to go along with the ancillary data */
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &client_socket, sizeof(int));
+
+    return sendmsg(channel, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+/* Blocks until the parent passes us a client socket. Returns -1 if the parent went away */
+int receive_client_socket(int channel)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    char byte;
+    char control[CMSG_SPACE(sizeof(int))];
+    int client_socket;
+
+    bzero(&msg, sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do
+    {
+        n = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) return -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return -1;
+    memcpy(&client_socket, CMSG_DATA(cmsg), sizeof(int));
+    return client_socket;
+}
+
+/*
+    Child side of master accept mode: serve whatever client sockets the parent sends us
+    and tell the parent we are done with each one through the scoreboard
+*/
+void enter_passed_socket_loop(int index, int channel)
+{
+    signal(SIGINT, SIG_IGN);
+    connect_to_redis_server();
+
+    while(1)
+    {
+        int client_socket = receive_client_socket(channel);
+        if (client_socket == -1) exit(0);
+
+        handle_client(client_socket);
+        close(client_socket);
+
+        __atomic_add_fetch(&scoreboard[index].connections_served, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&scoreboard[index].active_connections, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+    Least connections: the child with the fewest active connections gets the next one.
+    Scanning starts after the last pick, so that idle children get connections in turn instead of child 0 getting all of them.
+    A child that exited keeps a low count in its slot forever, it is skipped. Only a child that would become the pick
+    is checked, which costs a waitpid() or two per connection. Returns -1 when no child is left
+*/
+int pick_least_loaded_child()
+{
+    static int last_pick = PREFORK_CHILDREN - 1;
+    int best = -1, best_load = 0;
+
+    for (int i = 1; i <= PREFORK_CHILDREN; i++)
+    {
+        int child = (last_pick + i) % PREFORK_CHILDREN;
+        int load = __atomic_load_n(&scoreboard[child].active_connections, __ATOMIC_ACQUIRE);
+        if ((best == -1 || load < best_load) && !child_has_exited(child))
+        {
+            best = child;
+            best_load = load;
+            if (load == 0) break;
+        }
+    }
+
+    if (best != -1) last_pick = best;
+    return best;
+}
+
+/*
+    Parent side of master accept mode. The parent is the only process in accept(),
+    so the kernel's wakeup order no longer decides which child serves a connection
+*/
+void master_accept_loop(int server_socket)
+{
+    struct pollfd listener = { .fd = server_socket, .events = POLLIN };
+
+    while(1)
+    {
+        /* The parent also looks after the shared cache, so it only blocks until the next tick */
+        if (poll(&listener, 1, shared_cache_tick()) <= 0) continue;
+
+        int client_socket = accept(server_socket, NULL, NULL);
+        if (client_socket == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fatal_error("accept()");
+        }
+
+        int child = pick_least_loaded_child();
+        if (child == -1)
+        {
+            fprintf(stderr, "No child left to serve connections\n");
+            close(client_socket);
+            continue;
+        }
+        __atomic_add_fetch(&scoreboard[child].active_connections, 1, __ATOMIC_RELAXED);
+        if (send_client_socket(child_channels[child], client_socket) == -1)
+        {
+            perror("sendmsg()");
+            __atomic_sub_fetch(&scoreboard[child].active_connections, 1, __ATOMIC_RELAXED);
+        }
+
+        /* The child has its own copy of the socket now */
+        close(client_socket);
+    }
+}
+
 // When Ctrl+C is pressed, the shell sends our process SIGINT
 void print_stats()
 {
@@ -833,6 +4035,51 @@ void print_stats()
     sys +=  (double) childusage.ru_stime.tv_sec + childusage.ru_stime.tv_usec/1000000.0;
 
     printf("\nuser time = %g, sys time = %g\n", user, sys);
+
+    if (PREFORK_MODE == PREFORK_MASTER_ACCEPT)
+    {
+        long min_served = -1, max_served = 0;
+        for (int i = 0; i < PREFORK_CHILDREN; i++)
+        {
+            long served = scoreboard[i].connections_served;
+            if (min_served == -1 || served < min_served) min_served = served;
+            if (served > max_served) max_served = served;
+        }
+        printf("connections served per child: min = %ld, max = %ld\n", min_served, max_served);
+    }
+
+    /* Every child uses the same cache, so the hit rate is a global one */
+    long hits = 0, misses = 0, hit_bytes = 0, miss_bytes = 0;
+    for (int i = 0; i < PREFORK_CHILDREN; i++)
+    {
+        hits += scoreboard[i].cache_hits;
+        misses += scoreboard[i].cache_misses;
+        hit_bytes += scoreboard[i].cache_hit_bytes;
+        miss_bytes += scoreboard[i].cache_miss_bytes;
+    }
+    printf("static cache: %ld hits, %ld misses (%.1f%% hit rate, %.1f%% byte hit rate), %ld loads\n",
+           hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+           hit_bytes + miss_bytes ? 100.0 * hit_bytes / (hit_bytes + miss_bytes) : 0.0, shared_cache->loads);
+    printf("static cache: %ld evictions, %ld admission rejections, %ld invalidations\n",
+           shared_cache_evictions, shared_cache_rejections, shared_cache_invalidations);
+
+    long zerocopy_responses = 0, zerocopy_copied = 0, zerocopy_fallbacks = 0, zerocopy_wait_us = 0, send_timeouts = 0;
+    for (int i = 0; i < PREFORK_CHILDREN; i++)
+    {
+        send_timeouts += scoreboard[i].cache_send_timeouts;
+        zerocopy_responses += scoreboard[i].zerocopy_responses;
+        zerocopy_copied += scoreboard[i].zerocopy_copied;
+        zerocopy_fallbacks += scoreboard[i].zerocopy_fallbacks;
+        zerocopy_wait_us += scoreboard[i].zerocopy_wait_us;
+    }
+    printf("static cache: %ld responses aborted after %d ms\n", send_timeouts, SHARED_CACHE_SEND_TIMEOUT_MS);
+    printf("MSG_ZEROCOPY: %ld cached responses, %ld of them copied by the kernel anyway, %ld finished by copying for slow readers\n",
+           zerocopy_responses, zerocopy_copied, zerocopy_fallbacks);
+    printf("MSG_ZEROCOPY: %.1f ms waiting for completions inside the shared cache (%.2f ms per response)\n",
+           zerocopy_wait_us / 1000.0, zerocopy_responses ? zerocopy_wait_us / 1000.0 / zerocopy_responses : 0.0);
+    struct page_cache_stats *cache = page_cache_stats;
+    printf("page cache: %ld large files sent, %.1f%% of their pages resident beforehand, %ld dropped after sending\n",
+           cache->files, cache->pages ? 100.0 * cache->resident_pages / cache->pages : 0.0, cache->dropped_files);
     exit(0);
 }
 
@@ -841,12 +4088,153 @@ void sigint_handler(int signo)
     printf("Signal handler called\n");
     for(int i = 0; i < PREFORK_CHILDREN; i++)
     {
-        kill(pids[i], SIGTERM);
+        if (!exited_children[i]) kill(pids[i], SIGTERM);
     }
     while (wait(NULL) > 0);
     print_stats();
 }
 
+/*
+    Parses a kernel CPU list like "0-3,8-11" and adds every CPU in it that we are allowed to run on
+    (the process might already be restricted by taskset or cgroups) to topology_cpus
+*/
+int parse_cpu_list(const char* list, cpu_set_t* allowed)
+{
+    int added = 0;
+    const char* p = list;
+
+    while (*p && *p != '\n')
+    {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) break;
+        if (*end == '-') last = strtol(end + 1, &end, 10);
+
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+        {
+            if (!CPU_ISSET(cpu, allowed)) continue;
+            topology_cpus[topology_cpus_count++] = cpu;
+            added++;
+        }
+
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return added;
+}
+
+/*
+    Discover which CPUs belong to which NUMA node from sysfs.
+    Machines (or containers) without /sys/devices/system/node are treated as a single node
+*/
+void discover_cpu_topology()
+{
+    cpu_set_t allowed;
+    char path[64], cpu_list[4096];
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) fatal_error("sched_getaffinity()");
+
+    for (int node = 0; node < MAX_NUMA_NODES; node++)
+    {
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) continue;  // node ids can have holes
+
+        ssize_t n = read(fd, cpu_list, sizeof(cpu_list) - 1);
+        close(fd);
+        if (n <= 0) continue;
+        cpu_list[n] = '\0';
+
+        int first = topology_cpus_count;
+        int added = parse_cpu_list(cpu_list, &allowed);
+        if (added == 0) continue; // memory only node or none of its CPUs are allowed
+
+        topology_nodes[topology_nodes_count] = node;
+        node_first_cpu[topology_nodes_count] = first;
+        node_cpus_count[topology_nodes_count] = added;
+        topology_nodes_count++;
+    }
+
+    if (topology_nodes_count == 0)
+    {
+        topology_cpus_count = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &allowed)) topology_cpus[topology_cpus_count++] = cpu;
+        }
+        topology_nodes[0] = 0;
+        node_first_cpu[0] = 0;
+        node_cpus_count[0] = topology_cpus_count;
+        topology_nodes_count = 1;
+    }
+}
+
+const char* affinity_policy_name()
+{
+    switch (AFFINITY_POLICY)
+    {
+        case AFFINITY_COMPACT:      return "compact";
+        case AFFINITY_SCATTER:      return "scatter";
+        case AFFINITY_NUMA_LOCAL:   return "numa-local";
+        default:                    return "none";
+    }
+}
+
+/*
+    Works out the set of CPUs worker 'index' should run on as per AFFINITY_POLICY.
+    Returns the index (into topology_nodes) of the NUMA node those CPUs belong to, or -1 if the worker is not to be pinned
+*/
+int worker_cpuset(int index, cpu_set_t* cpuset)
+{
+    int node, cpu;
+
+    CPU_ZERO(cpuset);
+    if (AFFINITY_POLICY == AFFINITY_NONE || topology_cpus_count == 0) return -1;
+
+    switch (AFFINITY_POLICY)
+    {
+        case AFFINITY_COMPACT:
+            cpu = index % topology_cpus_count;
+            CPU_SET(topology_cpus[cpu], cpuset);
+            for (node = 0; node < topology_nodes_count - 1; node++)
+            {
+                if (cpu < node_first_cpu[node] + node_cpus_count[node]) break;
+            }
+            return node;
+
+        case AFFINITY_SCATTER:
+            node = index % topology_nodes_count;
+            cpu = node_first_cpu[node] + (index / topology_nodes_count) % node_cpus_count[node];
+            CPU_SET(topology_cpus[cpu], cpuset);
+            return node;
+
+        default: /* AFFINITY_NUMA_LOCAL */
+            node = index % topology_nodes_count;
+            for (int i = 0; i < node_cpus_count[node]; i++)
+            {
+                CPU_SET(topology_cpus[node_first_cpu[node] + i], cpuset);
+            }
+            return node;
+    }
+}
+
+/*
+    Ask the kernel to satisfy this worker's memory allocations from its own NUMA node.
+    Must be called by the worker itself, before it touches its buffers: the policy is per thread,
+    and pages are placed when they are first written, not when they are malloc()'d
+*/
+void bind_worker_memory(int node)
+{
+    if (node < 0 || topology_nodes_count < 2) return;
+
+    unsigned long nodemask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    int node_id = topology_nodes[node];
+    nodemask[node_id / (8 * sizeof(unsigned long))] |= 1UL << (node_id % (8 * sizeof(unsigned long)));
+
+    /* MPOL_PREFERRED falls back to other nodes instead of failing the allocation when the local one is full */
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask, MAX_NUMA_NODES + 1) == -1) perror("set_mempolicy()");
+}
+
 /*
     Create PREFORK_CHILDREN number of processes.
     Each of these processes accepts and serves client requests.
@@ -864,13 +4252,47 @@ void sigint_handler(int signo)
 pid_t create_child(int index, int listening_socket)
 {
     pid_t pid;
+    int channel[2];
+
+    if (PREFORK_MODE == PREFORK_MASTER_ACCEPT)
+    {
+        /* SOCK_SEQPACKET keeps one passed socket per message */
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, channel) == -1) fatal_error("socketpair()");
+    }
 
     pid = fork();
     if (pid < 0) fatal_error("fork()");
-    else if (pid > 0) return pid; // parent
+    else if (pid > 0)
+    {
+        // parent
+        if (PREFORK_MODE == PREFORK_MASTER_ACCEPT)
+        {
+            close(channel[1]);
+            child_channels[index] = channel[0];
+        }
+        return pid;
+    }
 
     // child
+    child_index = index;
+
+    /* Pin first and bind memory next, everything the child allocates from here on lands on its NUMA node */
+    cpu_set_t cpuset;
+    int node = worker_cpuset(index, &cpuset);
+    if (node != -1 && sched_setaffinity(0, sizeof(cpuset), &cpuset) == -1) perror("sched_setaffinity()");
+    bind_worker_memory(node);
+
     printf("Server %d(pid: %ld) starting\n", index, (long)getpid());
+
+    if (PREFORK_MODE == PREFORK_MASTER_ACCEPT)
+    {
+        /* Only the parent accepts. Also drop the parent's ends of our older siblings' channels we inherited */
+        close(listening_socket);
+        close(channel[0]);
+        for (int i = 0; i < index; i++) close(child_channels[i]);
+        enter_passed_socket_loop(index, channel[1]);
+    }
+
     enter_server_loop(listening_socket);
 }
 
@@ -899,13 +4321,36 @@ int main(int argc, char* argv[])
 
     // set up the listening socket
     int server_socket = setup_listening_socket(server_port);
+    load_mime_types(MIME_TYPES_FILE);
+    build_precompressed_variants(PRECOMPRESS_DIR);
+    asset_bundle = open_asset_bundle(PUBLIC_BUNDLE);
+    signal(SIGHUP, sighup_handler);
     printf("ZeroHTTPd server listening on port %d\n", server_port);
 
+    /* Set up everything children will share before the first fork() */
+    build_template_cache();
+
+    discover_cpu_topology();
+    printf("%d CPU(s) in %d NUMA node(s), worker affinity policy: %s\n", topology_cpus_count, topology_nodes_count, affinity_policy_name());
+
+    scoreboard = mmap(NULL, sizeof(struct child_slot) * PREFORK_CHILDREN, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (scoreboard == MAP_FAILED) fatal_error("mmap()");
+    /* Children count page cache estimates into it, the parent prints them */
+    page_cache_stats = mmap(NULL, sizeof(struct page_cache_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (page_cache_stats == MAP_FAILED) fatal_error("mmap()");
+    create_shared_cache();
+
     for(int i = 0; i < PREFORK_CHILDREN; i++)
     {
         pids[i] = create_child(i, server_socket);
     }
 
-    /* Pause the process until a signal arrives */
-    for(;;) pause();
+    if (PREFORK_MODE == PREFORK_MASTER_ACCEPT)
+    {
+        printf("Prefork mode: master accept with least connections balancing\n");
+        master_accept_loop(server_socket);
+    }
+
+    /* Look after the shared cache until a signal arrives */
+    for(;;) poll(NULL, 0, shared_cache_tick());
 }
\ No newline at end of file
@@ -0,0 +1,374 @@
+/*
+    Benchmark for the URL percent decoders used by the servers.
+    Compares the original byte at a time urlencoding_decode() (isdigit()/tolower() per hex digit)
+    with url_decode_span_scalar() and url_decode_span_ssse3() over two kinds of input:
+    - guestbook remarks: short form bodies, mostly plain words joined by '+' with the odd escape
+    - long query strings: ~4 KiB of key=value pairs with UTF-8 values, escape heavy
+    Every implementation's output is checked against the original before it is timed.
+
+    Build and run: make bench-urldecode && ./bench-urldecode
+*/
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define ITERATIONS                      20000
+#define REMARKS_COUNT                   64
+#define QUERY_STRINGS_COUNT             8
+#define QUERY_STRING_SIZE               4096
+
+typedef size_t (*span_decoder)(const char* src, size_t len, char* dst, size_t* written, int stop_at_equals);
+
+/* The decoder the servers used to have, kept as the baseline */
+char from_hex(char ch)
+{
+    return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+}
+
+size_t original_decode(const char* str, char* buf)
+{
+    const char* pstr = str;
+    char* pbuf = buf;
+
+    while (*pstr)
+    {
+        if(*pstr == '%')
+        {
+            if(pstr[1] && pstr[2])
+            {
+                *pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
+                pstr += 2;
+            }
+        }
+        else if (*pstr == '+')
+        {
+            *pbuf++ = ' ';
+        }
+        else
+        {
+            *pbuf++ = *pstr;
+        }
+        pstr++;
+    }
+    *pbuf = '\0';
+    return pbuf - buf;
+}
+
+/*
+    Value of every hex digit, -1 for everything else.
+    One table lookup per digit instead of isdigit() and tolower() calls
+*/
+static const signed char hex_values[256] = {
+    [0 ... 255] = -1,
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4, ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
+/*
+    Copies of the decoders in the servers' main.c, see url_decode_span() there
+*/
+size_t url_decode_span_scalar(const char* src, size_t len, char* dst, size_t* written, int stop_at_equals)
+{
+    size_t i = 0, o = 0;
+
+    while (i < len)
+    {
+        char ch = src[i];
+        if (ch == '&' || (ch == '=' && stop_at_equals)) break;
+
+        if (ch == '%')
+        {
+            if (i + 2 >= len) break;
+            int hi = hex_values[(unsigned char)src[i + 1]];
+            int lo = hex_values[(unsigned char)src[i + 2]];
+            if (hi >= 0 && lo >= 0)
+            {
+                dst[o++] = hi << 4 | lo;
+                i += 3;
+                continue;
+            }
+        }
+
+        dst[o++] = ch == '+' ? ' ' : ch;
+        i++;
+    }
+
+    *written = o;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+    Decodes "%XX%XX%XX%XX%XX" at src into 5 bytes at dst. Returns 0, having written nothing,
+    if the 15 bytes are anything else. src must have 16 readable bytes
+*/
+__attribute__((target("ssse3")))
+int decode_5_escapes_ssse3(const char* src, char* dst)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*) src);
+
+    /* '%' at 0, 3, 6, 9 and 12 */
+    if ((_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('%'))) & 0x1249) != 0x1249) return 0;
+
+    /* Gather the 10 digits, in order: hi0 lo0 hi1 lo1 ... */
+    __m128i digits = _mm_shuffle_epi8(v, _mm_setr_epi8(1, 2, 4, 5, 7, 8, 10, 11, 13, 14, -1, -1, -1, -1, -1, -1));
+
+    __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(digits, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(digits, _mm_set1_epi8('9' + 1)));
+    __m128i lower = _mm_or_si128(digits, _mm_set1_epi8(0x20));
+    __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    if ((_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) & 0x3FF) != 0x3FF) return 0;
+
+    /* '0'..'9' -> low nibble as is, 'a'..'f' and 'A'..'F' -> low nibble + 9 */
+    __m128i values = _mm_add_epi8(_mm_and_si128(digits, _mm_set1_epi8(0x0F)), _mm_and_si128(is_alpha, _mm_set1_epi8(9)));
+
+    /* hi * 16 + lo for each pair, then narrow the 16 bit results back to bytes */
+    __m128i pairs = _mm_maddubs_epi16(values, _mm_setr_epi8(16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 0, 0, 0, 0, 0, 0));
+    __m128i bytes = _mm_packus_epi16(pairs, pairs);
+
+    char decoded[16];
+    _mm_storeu_si128((__m128i*) decoded, bytes);
+    memcpy(dst, decoded, 5);
+    return 1;
+}
+
+__attribute__((target("ssse3")))
+size_t url_decode_span_ssse3(const char* src, size_t len, char* dst, size_t* written, int stop_at_equals)
+{
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i plus = _mm_set1_epi8('+');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i ampersand = _mm_set1_epi8('&');
+    /* When '=' is not a stop character, compare against '&' twice instead */
+    const __m128i equals = _mm_set1_epi8(stop_at_equals ? '=' : '&');
+    size_t i = 0, o = 0;
+
+    while (i + 16 <= len)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+
+        __m128i is_plus = _mm_cmpeq_epi8(v, plus);
+        v = _mm_or_si128(_mm_andnot_si128(is_plus, v), _mm_and_si128(is_plus, space));
+
+        int special = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, percent),
+                                        _mm_or_si128(_mm_cmpeq_epi8(v, ampersand), _mm_cmpeq_epi8(v, equals))));
+        if (special == 0)
+        {
+            /* dst never runs ahead of src, so this store only overwrites bytes already loaded */
+            _mm_storeu_si128((__m128i*)(dst + o), v);
+            i += 16;
+            o += 16;
+            continue;
+        }
+
+        /* Copy the plain run in front of the special character, and only that: dst may trail src in place */
+        int run = __builtin_ctz(special);
+        char block[16];
+        _mm_storeu_si128((__m128i*) block, v);
+        memcpy(dst + o, block, run);
+        i += run;
+        o += run;
+
+        if (src[i] != '%') break;   /* a separator */
+
+        while (i + 16 <= len && decode_5_escapes_ssse3(src + i, dst + o))
+        {
+            i += 15;
+            o += 5;
+        }
+
+        if (src[i] == '%')
+        {
+            if (i + 2 >= len) break;
+            int hi = hex_values[(unsigned char)src[i + 1]];
+            int lo = hex_values[(unsigned char)src[i + 2]];
+            if (hi >= 0 && lo >= 0)
+            {
+                dst[o++] = hi << 4 | lo;
+                i += 3;
+            }
+            else
+            {
+                dst[o++] = '%';
+                i++;
+            }
+        }
+    }
+
+    /* Fewer than 16 bytes left, or stopped at a special character, the scalar code finishes */
+    size_t tail_written;
+    i += url_decode_span_scalar(src + i, len - i, dst + o, &tail_written, stop_at_equals);
+    *written = o + tail_written;
+    return i;
+}
+
+#endif
+
+/* Whole string decode on top of a span decoder, the loop the servers' urlencoding_decode() used before form bodies were streamed */
+size_t decode_with(span_decoder decode, const char* str, size_t len, char* buf)
+{
+    size_t i = 0, o = 0;
+
+    while (i < len)
+    {
+        size_t written;
+        i += decode(str + i, len - i, buf + o, &written, 0);
+        o += written;
+        if (i < len) buf[o++] = str[i++];
+    }
+    buf[o] = '\0';
+    return o;
+}
+
+const char *words[] = { "great", "service", "the", "bread", "was", "lovely", "and", "we", "will", "be", "back", "soon",
+                        "thanks", "for", "a", "wonderful", "evening", "Albert", "Einstein", "really" };
+const char *punctuation[] = { "%21", "%2C", "%27", "%3F", "%26", "%2E" };
+/* UTF-8 for a few non ASCII words, percent encoded as browsers send them */
+const char *utf8_words[] = { "%E4%BD%A0%E5%A5%BD", "Z%C3%B6e", "%D0%BF%D1%80%D0%B8%D0%B2%D0%B5%D1%82", "caf%C3%A9", "%F0%9F%98%80" };
+
+char* make_remarks(unsigned int* seed)
+{
+    char *s = malloc(1024);
+    int len = 0, n = 8 + rand_r(seed) % 24;
+
+    for (int w = 0; w < n; w++)
+    {
+        if (w) len += sprintf(s + len, "+");
+        if (rand_r(seed) % 20 == 0) len += sprintf(s + len, "%s", utf8_words[rand_r(seed) % 5]);
+        else len += sprintf(s + len, "%s", words[rand_r(seed) % 20]);
+        if (rand_r(seed) % 6 == 0) len += sprintf(s + len, "%s", punctuation[rand_r(seed) % 6]);
+    }
+    return s;
+}
+
+char* make_query_string(unsigned int* seed)
+{
+    char *s = malloc(QUERY_STRING_SIZE + 256);
+    int len = 0, field = 0;
+
+    while (len < QUERY_STRING_SIZE)
+    {
+        len += sprintf(s + len, "%sfield%d=", field ? "&" : "", field);
+        field++;
+        int n = 1 + rand_r(seed) % 6;
+        for (int w = 0; w < n; w++)
+        {
+            if (w) len += sprintf(s + len, "+");
+            len += sprintf(s + len, "%s", rand_r(seed) % 2 ? utf8_words[rand_r(seed) % 5] : words[rand_r(seed) % 20]);
+        }
+    }
+    return s;
+}
+
+/*
+    Random strings made of the characters the decoders treat specially. Every span decoder must agree
+    with the scalar one byte for byte, decoding into a separate buffer and in place
+*/
+void check_against_scalar(span_decoder decode, const char* name)
+{
+    const char alphabet[] = "%%%+&=0aF9zG";
+    char src[256], expected[256], in_place[256];
+    unsigned int seed = 7;
+
+    for (int round = 0; round < 200000; round++)
+    {
+        size_t len = rand_r(&seed) % 64;
+        for (size_t i = 0; i < len; i++) src[i] = alphabet[rand_r(&seed) % (sizeof(alphabet) - 1)];
+        int stop_at_equals = round & 1;
+
+        size_t expected_written, written;
+        size_t expected_consumed = url_decode_span_scalar(src, len, expected, &expected_written, stop_at_equals);
+
+        memcpy(in_place, src, len);
+        size_t consumed = decode(in_place, len, in_place, &written, stop_at_equals);
+        if (consumed != expected_consumed || written != expected_written || memcmp(in_place, expected, written) != 0)
+        {
+            fprintf(stderr, "%s decoder differs from the scalar one on \"%.*s\"\n", name, (int) len, src);
+            exit(1);
+        }
+    }
+}
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench(const char* name, char** inputs, int count)
+{
+    size_t total = 0, max_len = 0;
+    for (int i = 0; i < count; i++)
+    {
+        size_t len = strlen(inputs[i]);
+        total += len;
+        if (len > max_len) max_len = len;
+    }
+
+    char *expected = malloc(max_len + 1), *out = malloc(max_len + 1);
+    volatile size_t sink = 0;
+
+    struct { const char *name; span_decoder decode; } decoders[] = {
+        { "scalar", url_decode_span_scalar },
+#if defined(__x86_64__) || defined(__i386__)
+        { "ssse3", __builtin_cpu_supports("ssse3") ? url_decode_span_ssse3 : NULL },
+#endif
+    };
+
+    for (int d = 0; d < (int)(sizeof(decoders) / sizeof(decoders[0])); d++)
+    {
+        if (!decoders[d].decode) continue;
+        check_against_scalar(decoders[d].decode, decoders[d].name);
+        for (int i = 0; i < count; i++)
+        {
+            size_t len = strlen(inputs[i]);
+            size_t n = original_decode(inputs[i], expected);
+            if (decode_with(decoders[d].decode, inputs[i], len, out) != n || memcmp(out, expected, n) != 0)
+            {
+                fprintf(stderr, "%s: %s decoder output differs on input %d\n", name, decoders[d].name, i);
+                exit(1);
+            }
+        }
+    }
+
+    printf("%s: %d inputs, %zu bytes on average\n", name, count, total / count);
+
+    double start = now();
+    for (int it = 0; it < ITERATIONS; it++)
+        for (int i = 0; i < count; i++) sink += original_decode(inputs[i], out);
+    double base = now() - start;
+    printf("    %-10s %8.1f MB/s\n", "original", total * (double) ITERATIONS / base / 1e6);
+
+    for (int d = 0; d < (int)(sizeof(decoders) / sizeof(decoders[0])); d++)
+    {
+        if (!decoders[d].decode) continue;
+        start = now();
+        for (int it = 0; it < ITERATIONS; it++)
+            for (int i = 0; i < count; i++) sink += decode_with(decoders[d].decode, inputs[i], strlen(inputs[i]), out);
+        double t = now() - start;
+        printf("    %-10s %8.1f MB/s  %.2fx\n", decoders[d].name, total * (double) ITERATIONS / t / 1e6, base / t);
+    }
+
+    free(expected);
+    free(out);
+}
+
+int main()
+{
+    unsigned int seed = 42;
+    char *remarks[REMARKS_COUNT], *query_strings[QUERY_STRINGS_COUNT];
+
+    for (int i = 0; i < REMARKS_COUNT; i++) remarks[i] = make_remarks(&seed);
+    for (int i = 0; i < QUERY_STRINGS_COUNT; i++) query_strings[i] = make_query_string(&seed);
+
+    bench("guestbook remarks", remarks, REMARKS_COUNT);
+    bench("long query strings", query_strings, QUERY_STRINGS_COUNT);
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+    Layout of public.bundle, written by tools/pack_bundle.c and mapped read-only by the servers.
+
+    +----------------------+  offset 0
+    | bundle_header        |
+    +----------------------+  entries_offset
+    | bundle_entry[]       |  sorted by path
+    +----------------------+  slots_offset
+    | unsigned int[]       |  open addressing hash table of entry index + 1, 0 for a free slot
+    +----------------------+  strings_offset
+    | paths, NUL-ended     |  "public/index.html", the same form the servers' handle_get_method() builds
+    +----------------------+  page aligned from here on
+    | file contents        |  every body starts on a page boundary, so sendfile() reads whole pages
+    +----------------------+  size
+
+    Offsets are from the start of the file. The bundle is only read on the machine that packed it,
+    so numbers are stored in native byte order.
+*/
+#ifndef BUNDLE_FORMAT_H
+#define BUNDLE_FORMAT_H
+
+#define BUNDLE_MAGIC                    "NHBUNDL1"
+#define BUNDLE_VERSION                  1
+#define BUNDLE_PAGE_SIZE                4096
+#define BUNDLE_ENCODINGS                3   /* identity, gzip, br, the order of the servers' content_encodings[] */
+
+struct bundle_header {
+    char            magic[8];
+    unsigned int    version;
+    unsigned int    entries_count;
+    unsigned int    slots_count;        /* a power of 2, at least twice entries_count */
+    unsigned int    reserved;
+    unsigned long   entries_offset;
+    unsigned long   slots_offset;
+    unsigned long   strings_offset;
+    unsigned long   size;               /* of the whole bundle */
+};
+
+struct bundle_body {
+    unsigned long   offset;             /* 0 when there is no such variant */
+    unsigned long   size;
+};
+
+struct bundle_entry {
+    unsigned long       path_offset;    /* from strings_offset */
+    unsigned int        path_len;
+    unsigned int        path_hash;
+    unsigned long       ino;            /* of the packed file, so ETags match the ones served from public/ */
+    long                mtime_sec;
+    long                mtime_nsec;
+    unsigned int        negotiated;     /* has compressed variants, responses say Vary: Accept-Encoding */
+    unsigned int        reserved;
+    struct bundle_body  bodies[BUNDLE_ENCODINGS];
+};
+
+static inline unsigned int bundle_path_hash(const char* path, int len)
+{
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; i++)
+    {
+        h ^= (unsigned char) path[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+    Checks a mapped bundle of 'size' bytes before anything in it is trusted: the sections, every path and body
+    have to lie inside the file, the slot table has to be a power of 2 with a free slot to end probes and
+    hold only valid entry indexes. Returns 1 when bundle_lookup() and the bodies are safe to use
+*/
+static inline int bundle_valid(const char* map, unsigned long size)
+{
+    const struct bundle_header *header = (const struct bundle_header*) map;
+    if (size < sizeof(struct bundle_header) || memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != BUNDLE_VERSION || header->size != size) return 0;
+
+    if (header->entries_offset < sizeof(struct bundle_header) || header->entries_offset > size
+        || header->entries_count > (size - header->entries_offset) / sizeof(struct bundle_entry)
+        || header->slots_offset < header->entries_offset + sizeof(struct bundle_entry) * header->entries_count
+        || header->slots_offset > size
+        || header->slots_count > (size - header->slots_offset) / sizeof(unsigned int)
+        || header->strings_offset < header->slots_offset + sizeof(unsigned int) * header->slots_count
+        || header->strings_offset > size) return 0;
+
+    if (header->slots_count == 0 || (header->slots_count & (header->slots_count - 1)) != 0) return 0;
+    const unsigned int *slots = (const unsigned int*) (map + header->slots_offset);
+    unsigned int free_slots = 0;
+    for (unsigned int slot = 0; slot < header->slots_count; slot++)
+    {
+        if (slots[slot] == 0) free_slots++;
+        else if (slots[slot] > header->entries_count) return 0;
+    }
+    if (free_slots == 0) return 0;
+
+    const struct bundle_entry *entries = (const struct bundle_entry*) (map + header->entries_offset);
+    unsigned long strings_size = size - header->strings_offset;
+    for (unsigned int i = 0; i < header->entries_count; i++)
+    {
+        const struct bundle_entry *entry = &entries[i];
+        /* The path and its NUL */
+        if (entry->path_offset >= strings_size || entry->path_len >= strings_size - entry->path_offset) return 0;
+        for (int encoding = 0; encoding < BUNDLE_ENCODINGS; encoding++)
+            if (entry->bodies[encoding].offset > size || entry->bodies[encoding].size > size - entry->bodies[encoding].offset)
+                return 0;
+    }
+    return 1;
+}
+
+/* Returns the entry for path in a mapped bundle, or NULL when the bundle doesn't have it */
+static inline const struct bundle_entry* bundle_lookup(const char* map, const char* path)
+{
+    const struct bundle_header *header = (const struct bundle_header*) map;
+    const struct bundle_entry *entries = (const struct bundle_entry*) (map + header->entries_offset);
+    const unsigned int *slots = (const unsigned int*) (map + header->slots_offset);
+    const char *strings = map + header->strings_offset;
+
+    int len = strlen(path);
+    unsigned int hash = bundle_path_hash(path, len);
+    for (unsigned int slot = hash & (header->slots_count - 1); slots[slot]; slot = (slot + 1) & (header->slots_count - 1))
+    {
+        const struct bundle_entry *entry = &entries[slots[slot] - 1];
+        if (entry->path_hash == hash && entry->path_len == (unsigned int) len
+            && memcmp(strings + entry->path_offset, path, len) == 0) return entry;
+    }
+    return NULL;
+}
+
+#endif /* BUNDLE_FORMAT_H */
@@ -0,0 +1,268 @@
+/*
+    Generated by tools/gen_mime_types.c from tools/mime.types. Do not edit,
+    change tools/mime.types and run make instead.
+
+    Perfect hash over 196 file extensions. An extension is hashed once to find
+    its bucket, and once more with the bucket's displacement as the seed to find
+    its slot. Extensions are matched case insensitively.
+*/
+#ifndef MIME_TYPES_H
+#define MIME_TYPES_H
+
+#define MIME_TYPES_COUNT                196
+#define MIME_HASH_SLOTS                 512
+#define MIME_HASH_BUCKETS               50
+
+struct mime_type {
+    const char*     extension;      /* lower case, without the dot */
+    int             extension_len;
+    const char*     header;         /* "Content-Type: <type>\r\n" */
+    int             header_len;
+};
+
+static const unsigned short mime_displacements[MIME_HASH_BUCKETS] = {
+    10, 1, 4, 1, 1, 1, 3, 1, 2, 0, 2, 2,
+    1, 1, 14, 1, 2, 3, 0, 2, 4, 0, 2, 1,
+    1, 2, 12, 1, 1, 1, 5, 2, 1, 2, 2, 4,
+    1, 1, 4, 2, 3, 4, 1, 3, 2, 2, 3, 2,
+    1, 4,
+};
+
+static const struct mime_type mime_types[MIME_HASH_SLOTS] = {
+    [1] = { "avi", 3, "Content-Type: video/x-msvideo\r\n", 31 },
+    [3] = { "jxl", 3, "Content-Type: image/jxl\r\n", 25 },
+    [4] = { "3gp", 3, "Content-Type: video/3gpp\r\n", 26 },
+    [7] = { "qt", 2, "Content-Type: video/quicktime\r\n", 31 },
+    [10] = { "3gpp", 4, "Content-Type: video/3gpp\r\n", 26 },
+    [15] = { "ai", 2, "Content-Type: application/postscript\r\n", 38 },
+    [17] = { "war", 3, "Content-Type: application/java-archive\r\n", 40 },
+    [18] = { "jar", 3, "Content-Type: application/java-archive\r\n", 40 },
+    [20] = { "atom", 4, "Content-Type: application/atom+xml\r\n", 36 },
+    [21] = { "tex", 3, "Content-Type: application/x-tex\r\n", 33 },
+    [25] = { "deb", 3, "Content-Type: application/vnd.debian.binary-package\r\n", 53 },
+    [27] = { "sea", 3, "Content-Type: application/x-sea\r\n", 33 },
+    [29] = { "m2ts", 4, "Content-Type: video/mp2t\r\n", 26 },
+    [34] = { "midi", 4, "Content-Type: audio/midi\r\n", 26 },
+    [36] = { "avif", 4, "Content-Type: image/avif\r\n", 26 },
+    [40] = { "mov", 3, "Content-Type: video/quicktime\r\n", 31 },
+    [41] = { "iso", 3, "Content-Type: application/x-iso9660-image\r\n", 43 },
+    [42] = { "3g2", 3, "Content-Type: video/3gpp2\r\n", 27 },
+    [52] = { "hqx", 3, "Content-Type: application/mac-binhex40\r\n", 40 },
+    [53] = { "woff", 4, "Content-Type: font/woff\r\n", 25 },
+    [54] = { "markdown", 8, "Content-Type: text/markdown\r\n", 29 },
+    [55] = { "p12", 3, "Content-Type: application/pkcs12\r\n", 34 },
+    [56] = { "shtml", 5, "Content-Type: text/html\r\n", 25 },
+    [61] = { "eps", 3, "Content-Type: application/postscript\r\n", 38 },
+    [66] = { "msp", 3, "Content-Type: application/octet-stream\r\n", 40 },
+    [68] = { "epub", 4, "Content-Type: application/epub+zip\r\n", 36 },
+    [72] = { "swf", 3, "Content-Type: application/x-shockwave-flash\r\n", 45 },
+    [73] = { "vcard", 5, "Content-Type: text/vcard\r\n", 26 },
+    [75] = { "ear", 3, "Content-Type: application/java-archive\r\n", 40 },
+    [81] = { "mng", 3, "Content-Type: video/x-mng\r\n", 27 },
+    [82] = { "ogg", 3, "Content-Type: audio/ogg\r\n", 25 },
+    [84] = { "xz", 2, "Content-Type: application/x-xz\r\n", 32 },
+    [85] = { "cur", 3, "Content-Type: image/vnd.microsoft.icon\r\n", 40 },
+    [92] = { "ini", 3, "Content-Type: text/plain\r\n", 26 },
+    [93] = { "dtd", 3, "Content-Type: application/xml\r\n", 31 },
+    [94] = { "html", 4, "Content-Type: text/html\r\n", 25 },
+    [95] = { "zst", 3, "Content-Type: application/zstd\r\n", 32 },
+    [100] = { "css", 3, "Content-Type: text/css\r\n", 24 },
+    [102] = { "jsonld", 6, "Content-Type: application/ld+json\r\n", 35 },
+    [103] = { "7z", 2, "Content-Type: application/x-7z-compressed\r\n", 43 },
+    [104] = { "aiff", 4, "Content-Type: audio/x-aiff\r\n", 28 },
+    [110] = { "ppm", 3, "Content-Type: image/x-portable-pixmap\r\n", 39 },
+    [112] = { "conf", 4, "Content-Type: text/plain\r\n", 26 },
+    [114] = { "sh", 2, "Content-Type: application/x-sh\r\n", 32 },
+    [116] = { "heif", 4, "Content-Type: image/heif\r\n", 26 },
+    [117] = { "webp", 4, "Content-Type: image/webp\r\n", 26 },
+    [118] = { "aac", 3, "Content-Type: audio/aac\r\n", 25 },
+    [127] = { "jpe", 3, "Content-Type: image/jpeg\r\n", 26 },
+    [134] = { "mp3", 3, "Content-Type: audio/mpeg\r\n", 26 },
+    [137] = { "webm", 4, "Content-Type: video/webm\r\n", 26 },
+    [139] = { "pl", 2, "Content-Type: application/x-perl\r\n", 34 },
+    [142] = { "m3u8", 4, "Content-Type: application/vnd.apple.mpegurl\r\n", 45 },
+    [143] = { "xpi", 3, "Content-Type: application/x-xpinstall\r\n", 39 },
+    [145] = { "gif", 3, "Content-Type: image/gif\r\n", 25 },
+    [147] = { "tif", 3, "Content-Type: image/tiff\r\n", 26 },
+    [148] = { "apng", 4, "Content-Type: image/apng\r\n", 26 },
+    [150] = { "yaml", 4, "Content-Type: application/yaml\r\n", 32 },
+    [152] = { "sqlite", 6, "Content-Type: application/x-sqlite3\r\n", 37 },
+    [153] = { "aifc", 4, "Content-Type: audio/x-aiff\r\n", 28 },
+    [154] = { "crt", 3, "Content-Type: application/x-x509-ca-cert\r\n", 42 },
+    [155] = { "mpd", 3, "Content-Type: application/dash+xml\r\n", 36 },
+    [157] = { "htc", 3, "Content-Type: text/x-component\r\n", 32 },
+    [163] = { "rss", 3, "Content-Type: application/rss+xml\r\n", 35 },
+    [164] = { "csv", 3, "Content-Type: text/csv\r\n", 24 },
+    [170] = { "odt", 3, "Content-Type: application/vnd.oasis.opendocument.text\r\n", 55 },
+    [171] = { "xls", 3, "Content-Type: application/vnd.ms-excel\r\n", 40 },
+    [174] = { "mjs", 3, "Content-Type: text/javascript\r\n", 31 },
+    [177] = { "aif", 3, "Content-Type: audio/x-aiff\r\n", 28 },
+    [179] = { "ods", 3, "Content-Type: application/vnd.oasis.opendocument.spreadsheet\r\n", 62 },
+    [181] = { "md", 2, "Content-Type: text/markdown\r\n", 29 },
+    [184] = { "doc", 3, "Content-Type: application/msword\r\n", 34 },
+    [186] = { "pnm", 3, "Content-Type: image/x-portable-anymap\r\n", 39 },
+    [187] = { "wmv", 3, "Content-Type: video/x-ms-wmv\r\n", 30 },
+    [188] = { "rgb", 3, "Content-Type: image/x-rgb\r\n", 27 },
+    [190] = { "js", 2, "Content-Type: text/javascript\r\n", 31 },
+    [191] = { "xht", 3, "Content-Type: application/xhtml+xml\r\n", 37 },
+    [194] = { "txz", 3, "Content-Type: application/x-xz\r\n", 32 },
+    [195] = { "docx", 4, "Content-Type: application/vnd.openxmlformats-officedocument.wordprocessingml.document\r\n", 87 },
+    [197] = { "rpa", 3, "Content-Type: application/x-redhat-package-manager\r\n", 52 },
+    [198] = { "xml", 3, "Content-Type: text/xml\r\n", 24 },
+    [201] = { "yml", 3, "Content-Type: application/yaml\r\n", 32 },
+    [204] = { "oga", 3, "Content-Type: audio/ogg\r\n", 25 },
+    [208] = { "xsl", 3, "Content-Type: application/xml\r\n", 31 },
+    [210] = { "mpg", 3, "Content-Type: video/mpeg\r\n", 26 },
+    [220] = { "ttc", 3, "Content-Type: font/collection\r\n", 31 },
+    [225] = { "p7m", 3, "Content-Type: application/pkcs7-mime\r\n", 38 },
+    [226] = { "mpga", 4, "Content-Type: audio/mpeg\r\n", 26 },
+    [228] = { "rar", 3, "Content-Type: application/vnd.rar\r\n", 35 },
+    [231] = { "m4a", 3, "Content-Type: audio/mp4\r\n", 25 },
+    [232] = { "img", 3, "Content-Type: application/octet-stream\r\n", 40 },
+    [233] = { "psd", 3, "Content-Type: image/x-photoshop\r\n", 33 },
+    [238] = { "ts", 2, "Content-Type: video/mp2t\r\n", 26 },
+    [244] = { "pbm", 3, "Content-Type: image/x-portable-bitmap\r\n", 39 },
+    [246] = { "pptx", 4, "Content-Type: application/vnd.openxmlformats-officedocument.presentationml.presentation\r\n", 89 },
+    [249] = { "toml", 4, "Content-Type: application/toml\r\n", 32 },
+    [250] = { "wml", 3, "Content-Type: text/vnd.wap.wml\r\n", 32 },
+    [263] = { "msm", 3, "Content-Type: application/octet-stream\r\n", 40 },
+    [269] = { "rtf", 3, "Content-Type: application/rtf\r\n", 31 },
+    [270] = { "mp4", 3, "Content-Type: video/mp4\r\n", 25 },
+    [271] = { "tcl", 3, "Content-Type: application/x-tcl\r\n", 33 },
+    [272] = { "latex", 5, "Content-Type: application/x-latex\r\n", 35 },
+    [275] = { "gz", 2, "Content-Type: application/gzip\r\n", 32 },
+    [279] = { "svgz", 4, "Content-Type: image/svg+xml\r\n", 29 },
+    [286] = { "pfx", 3, "Content-Type: application/pkcs12\r\n", 34 },
+    [288] = { "p7c", 3, "Content-Type: application/pkcs7-mime\r\n", 38 },
+    [294] = { "bmp", 3, "Content-Type: image/bmp\r\n", 25 },
+    [300] = { "jng", 3, "Content-Type: image/x-jng\r\n", 27 },
+    [303] = { "pgm", 3, "Content-Type: image/x-portable-graymap\r\n", 40 },
+    [304] = { "ppt", 3, "Content-Type: application/vnd.ms-powerpoint\r\n", 45 },
+    [305] = { "mkv", 3, "Content-Type: video/x-matroska\r\n", 32 },
+    [307] = { "otf", 3, "Content-Type: font/otf\r\n", 24 },
+    [311] = { "log", 3, "Content-Type: text/plain\r\n", 26 },
+    [313] = { "heic", 4, "Content-Type: image/heic\r\n", 26 },
+    [318] = { "xbm", 3, "Content-Type: image/x-xbitmap\r\n", 31 },
+    [321] = { "msi", 3, "Content-Type: application/x-msdownload\r\n", 40 },
+    [329] = { "tiff", 4, "Content-Type: image/tiff\r\n", 26 },
+    [331] = { "jardiff", 7, "Content-Type: application/x-java-archive-diff\r\n", 47 },
+    [332] = { "odg", 3, "Content-Type: application/vnd.oasis.opendocument.graphics\r\n", 59 },
+    [334] = { "xhtml", 5, "Content-Type: application/xhtml+xml\r\n", 37 },
+    [336] = { "flv", 3, "Content-Type: video/x-flv\r\n", 27 },
+    [337] = { "webmanifest", 11, "Content-Type: application/manifest+json\r\n", 41 },
+    [338] = { "mid", 3, "Content-Type: audio/midi\r\n", 26 },
+    [341] = { "wasm", 4, "Content-Type: application/wasm\r\n", 32 },
+    [349] = { "pps", 3, "Content-Type: application/vnd.ms-powerpoint\r\n", 45 },
+    [353] = { "ico", 3, "Content-Type: image/x-icon\r\n", 28 },
+    [356] = { "tbz2", 4, "Content-Type: application/x-bzip2\r\n", 35 },
+    [358] = { "br", 2, "Content-Type: application/x-brotli\r\n", 36 },
+    [360] = { "tgz", 3, "Content-Type: application/gzip\r\n", 32 },
+    [362] = { "ps", 2, "Content-Type: application/postscript\r\n", 38 },
+    [363] = { "odp", 3, "Content-Type: application/vnd.oasis.opendocument.presentation\r\n", 63 },
+    [364] = { "sit", 3, "Content-Type: application/x-stuffit\r\n", 37 },
+    [371] = { "pem", 3, "Content-Type: application/x-x509-ca-cert\r\n", 42 },
+    [374] = { "sql", 3, "Content-Type: application/sql\r\n", 31 },
+    [375] = { "dmg", 3, "Content-Type: application/x-apple-diskimage\r\n", 45 },
+    [379] = { "rpm", 3, "Content-Type: application/x-rpm\r\n", 33 },
+    [380] = { "ttf", 3, "Content-Type: font/ttf\r\n", 24 },
+    [382] = { "weba", 4, "Content-Type: audio/webm\r\n", 26 },
+    [383] = { "kar", 3, "Content-Type: audio/midi\r\n", 26 },
+    [394] = { "vtt", 3, "Content-Type: text/vtt\r\n", 24 },
+    [395] = { "jad", 3, "Content-Type: text/vnd.sun.j2me.app-descriptor\r\n", 48 },
+    [399] = { "exe", 3, "Content-Type: application/x-msdownload\r\n", 40 },
+    [401] = { "xpm", 3, "Content-Type: image/x-xpixmap\r\n", 31 },
+    [403] = { "spc", 3, "Content-Type: application/x-pkcs7-certificates\r\n", 48 },
+    [404] = { "apk", 3, "Content-Type: application/vnd.android.package-archive\r\n", 55 },
+    [405] = { "svg", 3, "Content-Type: image/svg+xml\r\n", 29 },
+    [406] = { "xslt", 4, "Content-Type: application/xslt+xml\r\n", 36 },
+    [408] = { "xsd", 3, "Content-Type: application/xml\r\n", 31 },
+    [413] = { "json", 4, "Content-Type: application/json\r\n", 32 },
+    [414] = { "map", 3, "Content-Type: application/json\r\n", 32 },
+    [415] = { "spx", 3, "Content-Type: audio/ogg\r\n", 25 },
+    [416] = { "bz2", 3, "Content-Type: application/x-bzip2\r\n", 35 },
+    [417] = { "dll", 3, "Content-Type: application/x-msdownload\r\n", 40 },
+    [420] = { "kml", 3, "Content-Type: application/vnd.google-earth.kml+xml\r\n", 52 },
+    [421] = { "db3", 3, "Content-Type: application/x-sqlite3\r\n", 37 },
+    [423] = { "vcf", 3, "Content-Type: text/vcard\r\n", 26 },
+    [424] = { "txt", 3, "Content-Type: text/plain\r\n", 26 },
+    [426] = { "tar", 3, "Content-Type: application/x-tar\r\n", 33 },
+    [429] = { "run", 3, "Content-Type: application/x-makeself\r\n", 38 },
+    [432] = { "torrent", 7, "Content-Type: application/x-bittorrent\r\n", 40 },
+    [435] = { "eot", 3, "Content-Type: application/vnd.ms-fontobject\r\n", 45 },
+    [436] = { "mml", 3, "Content-Type: text/mathml\r\n", 27 },
+    [438] = { "wbmp", 4, "Content-Type: image/vnd.wap.wbmp\r\n", 34 },
+    [441] = { "der", 3, "Content-Type: application/x-x509-ca-cert\r\n", 42 },
+    [443] = { "opus", 4, "Content-Type: audio/ogg\r\n", 25 },
+    [445] = { "mpeg", 4, "Content-Type: video/mpeg\r\n", 26 },
+    [446] = { "ics", 3, "Content-Type: text/calendar\r\n", 29 },
+    [448] = { "jnlp", 4, "Content-Type: application/x-java-jnlp-file\r\n", 44 },
+    [449] = { "woff2", 5, "Content-Type: font/woff2\r\n", 26 },
+    [451] = { "dot", 3, "Content-Type: application/msword\r\n", 34 },
+    [452] = { "cer", 3, "Content-Type: application/x-x509-ca-cert\r\n", 42 },
+    [458] = { "ra", 2, "Content-Type: audio/x-realaudio\r\n", 33 },
+    [459] = { "asx", 3, "Content-Type: video/x-ms-asf\r\n", 30 },
+    [461] = { "mka", 3, "Content-Type: audio/x-matroska\r\n", 32 },
+    [464] = { "xlsx", 4, "Content-Type: application/vnd.openxmlformats-officedocument.spreadsheetml.sheet\r\n", 81 },
+    [466] = { "asf", 3, "Content-Type: video/x-ms-asf\r\n", 30 },
+    [467] = { "p7b", 3, "Content-Type: application/x-pkcs7-certificates\r\n", 48 },
+    [468] = { "wmlc", 4, "Content-Type: application/vnd.wap.wmlc\r\n", 40 },
+    [469] = { "bin", 3, "Content-Type: application/octet-stream\r\n", 40 },
+    [470] = { "jpeg", 4, "Content-Type: image/jpeg\r\n", 26 },
+    [471] = { "mpe", 3, "Content-Type: video/mpeg\r\n", 26 },
+    [472] = { "wav", 3, "Content-Type: audio/wav\r\n", 25 },
+    [476] = { "jfif", 4, "Content-Type: image/jpeg\r\n", 26 },
+    [479] = { "ogv", 3, "Content-Type: video/ogg\r\n", 25 },
+    [481] = { "kmz", 3, "Content-Type: application/vnd.google-earth.kmz\r\n", 48 },
+    [482] = { "jpg", 3, "Content-Type: image/jpeg\r\n", 26 },
+    [483] = { "png", 3, "Content-Type: image/png\r\n", 25 },
+    [486] = { "pm", 2, "Content-Type: application/x-perl\r\n", 34 },
+    [487] = { "text", 4, "Content-Type: text/plain\r\n", 26 },
+    [489] = { "m4v", 3, "Content-Type: video/mp4\r\n", 25 },
+    [490] = { "cco", 3, "Content-Type: application/x-cocoa\r\n", 35 },
+    [493] = { "pdf", 3, "Content-Type: application/pdf\r\n", 31 },
+    [494] = { "htm", 3, "Content-Type: text/html\r\n", 25 },
+    [501] = { "flac", 4, "Content-Type: audio/flac\r\n", 26 },
+    [504] = { "zip", 3, "Content-Type: application/zip\r\n", 31 },
+    [505] = { "xlt", 3, "Content-Type: application/vnd.ms-excel\r\n", 40 },
+    [507] = { "tk", 2, "Content-Type: application/x-tcl\r\n", 33 },
+};
+
+static inline unsigned int mime_hash(const char* ext, int len, unsigned int seed)
+{
+    unsigned int h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (int i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char)ext[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        h ^= c;
+        h *= 16777619u;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+/*
+    Returns the table entry for a file extension (without the dot), or NULL
+    when the extension is not in the table.
+*/
+static inline const struct mime_type* mime_type_lookup(const char* ext, int len)
+{
+    if (len <= 0) return NULL;
+
+    unsigned int bucket = mime_hash(ext, len, 0) % MIME_HASH_BUCKETS;
+    unsigned int slot = mime_hash(ext, len, mime_displacements[bucket]) & (MIME_HASH_SLOTS - 1);
+    const struct mime_type* type = &mime_types[slot];
+
+    if (type->extension_len != len) return NULL;
+    for (int i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char)ext[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        if (c != (unsigned char)type->extension[i]) return NULL;
+    }
+    return type;
+}
+
+#endif /* MIME_TYPES_H */
@@ -0,0 +1,265 @@
+/*
+    Generates mime_types.h from a mime.types file.
+
+    Usage: gen-mime-types tools/mime.types > mime_types.h
+
+    Each extension becomes a key in a perfect hash built with the hash-and-displace
+    scheme: the keys are split into buckets by mime_hash(ext, 0), and every bucket
+    gets its own seed (its displacement) that sends all of its keys to free slots
+    of the table. A lookup is then two hashes, one table load and one compare, and
+    the table entry already holds the "Content-Type: ...\r\n" header bytes.
+
+    The hash function is emitted into the generated header so the generator and
+    the servers can never disagree about it.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define MAX_EXTENSIONS          4096
+#define MAX_EXTENSION_LEN       32
+#define MAX_TYPE_LEN            128
+#define MAX_DISPLACEMENT        65535
+#define KEYS_PER_BUCKET         4
+
+struct mime_entry {
+    char    extension[MAX_EXTENSION_LEN];
+    char    type[MAX_TYPE_LEN];
+    int     bucket;
+    int     slot;
+};
+
+struct mime_entry entries[MAX_EXTENSIONS];
+int entries_count = 0;
+
+/* Must stay identical to the mime_hash() emitted below. */
+unsigned int mime_hash(const char* ext, int len, unsigned int seed)
+{
+    unsigned int h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (int i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char)ext[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        h ^= c;
+        h *= 16777619u;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+const char* mime_hash_source =
+    "static inline unsigned int mime_hash(const char* ext, int len, unsigned int seed)\n"
+    "{\n"
+    "    unsigned int h = 2166136261u ^ (seed * 0x9e3779b9u);\n"
+    "    for (int i = 0; i < len; i++)\n"
+    "    {\n"
+    "        unsigned char c = (unsigned char)ext[i];\n"
+    "        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';\n"
+    "        h ^= c;\n"
+    "        h *= 16777619u;\n"
+    "    }\n"
+    "    h ^= h >> 15;\n"
+    "    h *= 0x2c1b3c6du;\n"
+    "    h ^= h >> 12;\n"
+    "    return h;\n"
+    "}\n";
+
+void add_extension(const char* extension, const char* type)
+{
+    char lower[MAX_EXTENSION_LEN];
+    int len = strlen(extension);
+
+    if (len >= MAX_EXTENSION_LEN)
+    {
+        fprintf(stderr, "gen-mime-types: extension too long, skipping: %s\n", extension);
+        return;
+    }
+    for (int i = 0; i <= len; i++) lower[i] = (char)tolower((unsigned char)extension[i]);
+
+    for (int i = 0; i < entries_count; i++)
+    {
+        if (strcmp(entries[i].extension, lower) == 0)
+        {
+            fprintf(stderr, "gen-mime-types: .%s already maps to %s, ignoring %s\n",
+                    lower, entries[i].type, type);
+            return;
+        }
+    }
+    if (entries_count == MAX_EXTENSIONS)
+    {
+        fprintf(stderr, "gen-mime-types: more than %d extensions\n", MAX_EXTENSIONS);
+        exit(1);
+    }
+    strcpy(entries[entries_count].extension, lower);
+    strcpy(entries[entries_count].type, type);
+    entries_count++;
+}
+
+void read_mime_types(FILE* file)
+{
+    char line[1024];
+
+    while (fgets(line, sizeof(line), file))
+    {
+        char* hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+
+        char* type = strtok(line, " \t\r\n");
+        if (!type) continue;
+        if (strlen(type) >= MAX_TYPE_LEN)
+        {
+            fprintf(stderr, "gen-mime-types: media type too long, skipping: %s\n", type);
+            continue;
+        }
+
+        char* extension;
+        while ((extension = strtok(NULL, " \t\r\n")) != NULL)
+            add_extension(extension, type);
+    }
+}
+
+/* Largest buckets are placed first, while the table is still mostly empty. */
+int *bucket_sizes;
+
+int compare_buckets(const void* a, const void* b)
+{
+    return bucket_sizes[*(const int*)b] - bucket_sizes[*(const int*)a];
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s mime.types\n", argv[0]);
+        return 1;
+    }
+
+    FILE* file = fopen(argv[1], "r");
+    if (!file)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    read_mime_types(file);
+    fclose(file);
+
+    if (entries_count == 0)
+    {
+        fprintf(stderr, "gen-mime-types: no extensions in %s\n", argv[1]);
+        return 1;
+    }
+
+    int slots_count = 1;
+    while (slots_count < entries_count * 2) slots_count <<= 1;
+    int buckets_count = entries_count / KEYS_PER_BUCKET + 1;
+
+    bucket_sizes = calloc(buckets_count, sizeof(int));
+    int* bucket_order = malloc(buckets_count * sizeof(int));
+    unsigned int* displacements = calloc(buckets_count, sizeof(unsigned int));
+    int* slot_owner = malloc(slots_count * sizeof(int));
+    int* candidate = malloc(entries_count * sizeof(int));
+
+    for (int i = 0; i < entries_count; i++)
+    {
+        entries[i].bucket = mime_hash(entries[i].extension, strlen(entries[i].extension), 0) % buckets_count;
+        bucket_sizes[entries[i].bucket]++;
+    }
+    for (int b = 0; b < buckets_count; b++) bucket_order[b] = b;
+    qsort(bucket_order, buckets_count, sizeof(int), compare_buckets);
+    for (int s = 0; s < slots_count; s++) slot_owner[s] = -1;
+
+    for (int o = 0; o < buckets_count && bucket_sizes[bucket_order[o]] > 0; o++)
+    {
+        int bucket = bucket_order[o];
+        unsigned int d;
+
+        for (d = 1; d <= MAX_DISPLACEMENT; d++)
+        {
+            int n = 0, ok = 1;
+            for (int i = 0; i < entries_count && ok; i++)
+            {
+                if (entries[i].bucket != bucket) continue;
+                int slot = mime_hash(entries[i].extension, strlen(entries[i].extension), d) & (slots_count - 1);
+                if (slot_owner[slot] != -1) ok = 0;
+                for (int k = 0; k < n && ok; k++)
+                    if (entries[candidate[k]].slot == slot) ok = 0;
+                entries[i].slot = slot;
+                candidate[n++] = i;
+            }
+            if (ok) break;
+        }
+        if (d > MAX_DISPLACEMENT)
+        {
+            fprintf(stderr, "gen-mime-types: no displacement found for bucket %d\n", bucket);
+            return 1;
+        }
+        displacements[bucket] = d;
+        for (int i = 0; i < entries_count; i++)
+            if (entries[i].bucket == bucket) slot_owner[entries[i].slot] = i;
+    }
+
+    printf("/*\n"
+           "    Generated by tools/gen_mime_types.c from tools/mime.types. Do not edit,\n"
+           "    change tools/mime.types and run make instead.\n"
+           "\n"
+           "    Perfect hash over %d file extensions. An extension is hashed once to find\n"
+           "    its bucket, and once more with the bucket's displacement as the seed to find\n"
+           "    its slot. Extensions are matched case insensitively.\n"
+           "*/\n"
+           "#ifndef MIME_TYPES_H\n"
+           "#define MIME_TYPES_H\n\n", entries_count);
+    printf("#define MIME_TYPES_COUNT                %d\n", entries_count);
+    printf("#define MIME_HASH_SLOTS                 %d\n", slots_count);
+    printf("#define MIME_HASH_BUCKETS               %d\n\n", buckets_count);
+
+    printf("struct mime_type {\n"
+           "    const char*     extension;      /* lower case, without the dot */\n"
+           "    int             extension_len;\n"
+           "    const char*     header;         /* \"Content-Type: <type>\\r\\n\" */\n"
+           "    int             header_len;\n"
+           "};\n\n");
+
+    printf("static const unsigned short mime_displacements[MIME_HASH_BUCKETS] = {");
+    for (int b = 0; b < buckets_count; b++)
+        printf("%s%u,", b % 12 == 0 ? "\n    " : " ", displacements[b]);
+    printf("\n};\n\n");
+
+    printf("static const struct mime_type mime_types[MIME_HASH_SLOTS] = {\n");
+    for (int s = 0; s < slots_count; s++)
+    {
+        if (slot_owner[s] == -1) continue;
+        struct mime_entry* e = &entries[slot_owner[s]];
+        printf("    [%d] = { \"%s\", %d, \"Content-Type: %s\\r\\n\", %d },\n",
+               s, e->extension, (int)strlen(e->extension), e->type,
+               (int)(strlen("Content-Type: \r\n") + strlen(e->type)));
+    }
+    printf("};\n\n");
+
+    printf("%s\n", mime_hash_source);
+    printf("/*\n"
+           "    Returns the table entry for a file extension (without the dot), or NULL\n"
+           "    when the extension is not in the table.\n"
+           "*/\n"
+           "static inline const struct mime_type* mime_type_lookup(const char* ext, int len)\n"
+           "{\n"
+           "    if (len <= 0) return NULL;\n"
+           "\n"
+           "    unsigned int bucket = mime_hash(ext, len, 0) %% MIME_HASH_BUCKETS;\n"
+           "    unsigned int slot = mime_hash(ext, len, mime_displacements[bucket]) & (MIME_HASH_SLOTS - 1);\n"
+           "    const struct mime_type* type = &mime_types[slot];\n"
+           "\n"
+           "    if (type->extension_len != len) return NULL;\n"
+           "    for (int i = 0; i < len; i++)\n"
+           "    {\n"
+           "        unsigned char c = (unsigned char)ext[i];\n"
+           "        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';\n"
+           "        if (c != (unsigned char)type->extension[i]) return NULL;\n"
+           "    }\n"
+           "    return type;\n"
+           "}\n\n"
+           "#endif /* MIME_TYPES_H */\n");
+    return 0;
+}
@@ -0,0 +1,295 @@
+/*
+    Packs a directory into an asset bundle the servers can mmap (layout in bundle_format.h).
+
+    Usage: pack-bundle public public.bundle
+
+    Every regular file becomes one entry. Text-like files of at least PRECOMPRESS_MIN_SIZE bytes
+    also get gzip and brotli bodies, compressed here at maximum quality, when that saves at least 10%.
+    *.gz and *.br files next to a packed file are the servers' own precompressed variants and are
+    left out, the bundle carries fresh ones.
+
+    The bundle is written to a temporary file and renamed over the old one, so a server that gets
+    SIGHUP while this runs either maps the old bundle or the complete new one.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+#include "../bundle_format.h"
+#include "../mime_types.h"
+
+#define PRECOMPRESS_MIN_SIZE            256
+
+#define ENCODING_IDENTITY               0
+#define ENCODING_GZIP                   1
+#define ENCODING_BROTLI                 2
+
+struct packed_file {
+    char            *path;
+    struct stat     st;
+    char            *bodies[BUNDLE_ENCODINGS];
+    size_t          sizes[BUNDLE_ENCODINGS];
+};
+
+struct packed_file *files;
+int files_count, files_capacity;
+
+/* Same rule as the servers' mime_type_compressible() */
+int compressible(const char* path)
+{
+    const char* dot = strrchr(path, '.');
+    const char* slash = strrchr(path, '/');
+    if (!dot || (slash && dot < slash)) return 0;
+
+    const struct mime_type* type = mime_type_lookup(dot + 1, strlen(dot + 1));
+    if (!type) return 0;
+
+    const char* media = type->header + strlen("Content-Type: ");
+    return strncmp(media, "text/", 5) == 0 || strstr(media, "javascript") || strstr(media, "json")
+        || strstr(media, "xml") || strstr(media, "manifest");
+}
+
+ssize_t compress_body(int encoding, const char* src, size_t len, char** out)
+{
+    if (encoding == ENCODING_GZIP)
+    {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+
+        size_t bound = deflateBound(&zs, len);
+        *out = malloc(bound);
+        zs.next_in = (Bytef*) src;
+        zs.avail_in = len;
+        zs.next_out = (Bytef*) *out;
+        zs.avail_out = bound;
+        int status = deflate(&zs, Z_FINISH);
+        deflateEnd(&zs);
+        if (status != Z_STREAM_END)
+        {
+            free(*out);
+            return -1;
+        }
+        return bound - zs.avail_out;
+    }
+
+    size_t out_len = BrotliEncoderMaxCompressedSize(len);
+    *out = malloc(out_len);
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               len, (const uint8_t*) src, &out_len, (uint8_t*) *out))
+    {
+        free(*out);
+        return -1;
+    }
+    return out_len;
+}
+
+char* read_file(const char* path, size_t size)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+
+    char* content = malloc(size ? size : 1);
+    if (fread(content, 1, size, file) != size)
+    {
+        free(content);
+        content = NULL;
+    }
+    fclose(file);
+    return content;
+}
+
+/* A x.gz or x.br whose x exists is a server-made variant */
+int is_variant(const char* path)
+{
+    size_t len = strlen(path);
+    if (len < 4 || (strcmp(path + len - 3, ".gz") != 0 && strcmp(path + len - 3, ".br") != 0)) return 0;
+
+    char source[4096];
+    struct stat st;
+    snprintf(source, sizeof(source), "%.*s", (int) len - 3, path);
+    return stat(source, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+void collect_files(const char* dir)
+{
+    DIR* d = opendir(dir);
+    if (!d)
+    {
+        perror(dir);
+        exit(1);
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        char path[4096];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (stat(path, &st) == -1) continue;
+
+        if (S_ISDIR(st.st_mode))
+        {
+            collect_files(path);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || is_variant(path)) continue;
+
+        if (files_count == files_capacity)
+        {
+            files_capacity = files_capacity ? files_capacity * 2 : 64;
+            files = realloc(files, sizeof(struct packed_file) * files_capacity);
+        }
+        struct packed_file* file = &files[files_count++];
+        memset(file, 0, sizeof(*file));
+        file->path = strdup(path);
+        file->st = st;
+    }
+    closedir(d);
+}
+
+int compare_files(const void* a, const void* b)
+{
+    return strcmp(((const struct packed_file*) a)->path, ((const struct packed_file*) b)->path);
+}
+
+unsigned long page_align(unsigned long offset)
+{
+    return (offset + BUNDLE_PAGE_SIZE - 1) & ~((unsigned long) BUNDLE_PAGE_SIZE - 1);
+}
+
+void write_at(FILE* out, unsigned long offset, const void* data, size_t len)
+{
+    if (fseek(out, offset, SEEK_SET) == -1 || fwrite(data, 1, len, out) != len)
+    {
+        perror("pack-bundle: write");
+        exit(1);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s public public.bundle\n", argv[0]);
+        return 1;
+    }
+
+    collect_files(argv[1]);
+    qsort(files, files_count, sizeof(struct packed_file), compare_files);
+
+    unsigned int slots_count = 1;
+    while (slots_count < (unsigned int) files_count * 2) slots_count <<= 1;
+
+    struct bundle_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_VERSION;
+    header.entries_count = files_count;
+    header.slots_count = slots_count;
+    header.entries_offset = sizeof(header);
+    header.slots_offset = header.entries_offset + sizeof(struct bundle_entry) * files_count;
+    header.strings_offset = header.slots_offset + sizeof(unsigned int) * slots_count;
+
+    struct bundle_entry* entries = calloc(files_count ? files_count : 1, sizeof(struct bundle_entry));
+    unsigned int* slots = calloc(slots_count, sizeof(unsigned int));
+
+    /* Paths first, contents start on the first page after them */
+    unsigned long strings_size = 0;
+    for (int i = 0; i < files_count; i++) strings_size += strlen(files[i].path) + 1;
+    unsigned long offset = page_align(header.strings_offset + strings_size);
+
+    unsigned long path_offset = 0;
+    long total_size = 0, compressed_size = 0;
+    for (int i = 0; i < files_count; i++)
+    {
+        struct packed_file* file = &files[i];
+        struct bundle_entry* entry = &entries[i];
+
+        file->bodies[ENCODING_IDENTITY] = read_file(file->path, file->st.st_size);
+        if (!file->bodies[ENCODING_IDENTITY])
+        {
+            perror(file->path);
+            return 1;
+        }
+        file->sizes[ENCODING_IDENTITY] = file->st.st_size;
+
+        entry->path_offset = path_offset;
+        entry->path_len = strlen(file->path);
+        entry->path_hash = bundle_path_hash(file->path, entry->path_len);
+        entry->ino = file->st.st_ino;
+        entry->mtime_sec = file->st.st_mtim.tv_sec;
+        entry->mtime_nsec = file->st.st_mtim.tv_nsec;
+        entry->negotiated = file->st.st_size >= PRECOMPRESS_MIN_SIZE && compressible(file->path);
+        path_offset += entry->path_len + 1;
+
+        for (int encoding = ENCODING_GZIP; entry->negotiated && encoding < BUNDLE_ENCODINGS; encoding++)
+        {
+            char* compressed;
+            ssize_t len = compress_body(encoding, file->bodies[ENCODING_IDENTITY], file->st.st_size, &compressed);
+            if (len < 0) continue;
+            /* Like the servers' own variants, only worth it when at least 10% smaller */
+            if ((size_t) len >= file->sizes[ENCODING_IDENTITY] - file->sizes[ENCODING_IDENTITY] / 10)
+            {
+                free(compressed);
+                continue;
+            }
+            file->bodies[encoding] = compressed;
+            file->sizes[encoding] = len;
+            compressed_size += file->sizes[ENCODING_IDENTITY] - len;
+        }
+
+        for (int encoding = 0; encoding < BUNDLE_ENCODINGS; encoding++)
+        {
+            if (!file->bodies[encoding]) continue;
+            entry->bodies[encoding].offset = offset;
+            entry->bodies[encoding].size = file->sizes[encoding];
+            offset = page_align(offset + file->sizes[encoding]);
+        }
+        total_size += file->st.st_size;
+
+        unsigned int slot = entry->path_hash & (slots_count - 1);
+        while (slots[slot]) slot = (slot + 1) & (slots_count - 1);
+        slots[slot] = i + 1;
+    }
+    header.size = offset;
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", argv[2]);
+    FILE* out = fopen(tmp_path, "wb");
+    if (!out)
+    {
+        perror(tmp_path);
+        return 1;
+    }
+
+    write_at(out, 0, &header, sizeof(header));
+    write_at(out, header.entries_offset, entries, sizeof(struct bundle_entry) * files_count);
+    write_at(out, header.slots_offset, slots, sizeof(unsigned int) * slots_count);
+    for (int i = 0; i < files_count; i++)
+    {
+        write_at(out, header.strings_offset + entries[i].path_offset, files[i].path, entries[i].path_len + 1);
+        for (int encoding = 0; encoding < BUNDLE_ENCODINGS; encoding++)
+            if (files[i].bodies[encoding])
+                write_at(out, entries[i].bodies[encoding].offset, files[i].bodies[encoding], files[i].sizes[encoding]);
+    }
+    /* Pad the last body to a whole page, so the file is exactly header.size bytes */
+    if (ftruncate(fileno(out), header.size) == -1 || fclose(out) != 0 || rename(tmp_path, argv[2]) == -1)
+    {
+        perror(argv[2]);
+        unlink(tmp_path);
+        return 1;
+    }
+
+    printf("%s: %d files, %ld bytes, %ld bytes saved by compressed variants, bundle is %lu bytes\n",
+           argv[2], files_count, total_size, compressed_size, header.size);
+    return 0;
+}